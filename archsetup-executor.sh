@@ -11,6 +11,9 @@ LAUNCHER_SCRIPT_PATH="$HOME/.local/bin/${BINARY_NAME}-launcher.sh"
 CPP_FILE_PATH="$SCRIPT_DIR/setup-linux.cpp"
 ICON_NAME="archlinux.png"
 ICON_PATH="$HOME/.local/share/icons/$ICON_NAME"
+BUNDLE_PATH="$SCRIPT_DIR/bundle"
+PREBUILT_BINARY="$SCRIPT_DIR/arch-setup-prebuilt"
+BASELINE_FILE="$SCRIPT_DIR/arch-setup.baseline"
 
 log() {
     echo "$(date '+%Y-%m-%d %H:%M:%S') - $1"
@@ -21,6 +24,41 @@ request_sudo_access() {
     sudo -v
 }
 
+# Check that this CPU runs code built for an x86-64 microarchitecture level
+# (x86-64, x86-64-v2, x86-64-v3 or x86-64-v4)
+cpu_supports_baseline() {
+    local baseline="$1"
+    local flags required
+
+    [[ "$(uname -m)" == "x86_64" ]] || return 1
+    [[ "$baseline" == "x86-64" ]] && return 0
+
+    # glibc's loader reports the levels it can use on this CPU
+    if /lib64/ld-linux-x86-64.so.2 --help 2>/dev/null | grep -q "^ *$baseline (supported"; then
+        return 0
+    fi
+
+    case "$baseline" in
+    x86-64-v2) required="cx16 lahf_lm popcnt sse4_1 sse4_2 ssse3" ;;
+    x86-64-v3) required="cx16 lahf_lm popcnt sse4_1 sse4_2 ssse3 avx avx2 bmi1 bmi2 f16c fma abm movbe xsave" ;;
+    x86-64-v4) required="cx16 lahf_lm popcnt sse4_1 sse4_2 ssse3 avx avx2 bmi1 bmi2 f16c fma abm movbe xsave avx512f avx512bw avx512cd avx512dq avx512vl" ;;
+    *) return 1 ;;
+    esac
+    flags=" $(grep -m1 '^flags' /proc/cpuinfo | cut -d: -f2) "
+    for flag in $required; do
+        [[ "$flags" == *" $flag "* ]] || return 1
+    done
+    return 0
+}
+
+install_build_tools() {
+    if command -v clang++ &>/dev/null && command -v make &>/dev/null; then
+        return
+    fi
+    log "Installing the compiler toolchain..."
+    sudo pacman -S --noconfirm --needed clang llvm base-devel
+}
+
 compile_binary() {
     log "Compiling $BINARY_NAME using Makefile..."
 
@@ -30,6 +68,20 @@ compile_binary() {
         exit 1
     }
 
+    # Prebuilt installers ship an optimized static binary, used whenever
+    # this CPU supports the baseline it was built for
+    if [[ -x "$PREBUILT_BINARY" ]]; then
+        local baseline
+        baseline="$(cat "$BASELINE_FILE")"
+        if cpu_supports_baseline "$baseline"; then
+            log "Using the prebuilt $BINARY_NAME binary ($baseline)."
+            cp "$PREBUILT_BINARY" "$BINARY_NAME"
+            return
+        fi
+        log "This CPU does not support $baseline. Building from source instead."
+    fi
+    install_build_tools
+
     # Check if Makefile exists
     if [[ ! -f "Makefile" ]]; then
         log "Error: Makefile not found in $SCRIPT_DIR"
@@ -116,6 +168,20 @@ EOL
     update-desktop-database "$HOME/.local/share/applications"
 }
 
+provision_from_bundle() {
+    if [[ ! -d "$BUNDLE_PATH" ]]; then
+        return
+    fi
+    local profiles
+    profiles="$(cat "$BUNDLE_PATH/profiles")"
+    log "Provisioning $profiles from the offline bundle..."
+    if ! "$BINARY_PATH" apply --bundle "$BUNDLE_PATH" --profile "$profiles" --yes; then
+        log "Offline provisioning failed."
+        exit 1
+    fi
+    log "Offline provisioning complete."
+}
+
 install_app() {
     remove_app
     compile_binary
@@ -124,6 +190,7 @@ install_app() {
     install_icon
     create_launcher_script
     create_desktop_entry
+    provision_from_bundle
     log "Installation complete. You can run '$BINARY_NAME' from the terminal or use the Arch Setup application from your desktop."
 }
 
@@ -12,6 +12,39 @@ CPP_FILE="setup-linux.cpp"
 HPP_FILE="setup-linux.hpp"
 ICON_FILE="archlinux.png"
 MAKEFILE="Makefile"
+BUNDLE_DIR="bundle"
+BUNDLE_PROFILES="" # --bundle PROFILE[,PROFILE...]
+PREBUILT_BASELINE="" # --prebuilt[=BASELINE]
+PREBUILT_BINARY="arch-setup-prebuilt"
+BASELINE_FILE="arch-setup.baseline"
+
+# Function to parse the command line
+parse_arguments() {
+    while [[ $# -gt 0 ]]; do
+        case "$1" in
+        --bundle)
+            BUNDLE_PROFILES="$2"
+            shift 2
+            ;;
+        --bundle=*)
+            BUNDLE_PROFILES="${1#*=}"
+            shift
+            ;;
+        --prebuilt)
+            PREBUILT_BASELINE="x86-64-v3"
+            shift
+            ;;
+        --prebuilt=*)
+            PREBUILT_BASELINE="${1#*=}"
+            shift
+            ;;
+        *)
+            echo "Usage: $0 [--prebuilt[=BASELINE]] [--bundle PROFILE[,PROFILE...]]"
+            exit 1
+            ;;
+        esac
+    done
+}
 
 # Function to install prerequisites
 install_prerequisites() {
@@ -59,6 +92,10 @@ copy_files_to_package() {
 }
 
 create_makefile() {
+    if [[ -f "$MAKEFILE" ]]; then
+        echo "Using the existing Makefile."
+        return
+    fi
     echo "Creating Makefile..."
     cat >"$MAKEFILE" <<EOL
 # Compiler
@@ -111,6 +148,31 @@ create_installer() {
     echo "Installer $INSTALLER_NAME created successfully."
 }
 
+# Function to add a static, LTO-optimized binary for CPUs at or above the
+# baseline. The executor installs it instead of compiling when the CPU
+# supports the baseline.
+create_prebuilt_binary() {
+    echo "Building static $PREBUILT_BASELINE binary..."
+    make static BASELINE="$PREBUILT_BASELINE"
+    cp arch-setup-static "$PACKAGE_DIR/$PREBUILT_BINARY"
+    echo "$PREBUILT_BASELINE" >"$PACKAGE_DIR/$BASELINE_FILE"
+    make clean
+    INSTALLER_NAME="archsetup-installer-$VERSION-prebuilt.run"
+    echo "Prebuilt binary created."
+}
+
+# Function to add an offline bundle: everything the profiles download (repo
+# packages, prebuilt AUR packages, configs and git mirrors), so the installer
+# provisions without network
+create_bundle() {
+    echo "Creating offline bundle for $BUNDLE_PROFILES..."
+    make
+    ./arch-setup bundle --profile "$BUNDLE_PROFILES" --out "$PACKAGE_DIR/$BUNDLE_DIR"
+    make clean
+    INSTALLER_NAME="archsetup-installer-$VERSION-offline.run"
+    echo "Offline bundle created."
+}
+
 cleanup() {
     echo "Cleaning up package directory..."
     rm -rf "$PACKAGE_DIR"
@@ -118,13 +180,25 @@ cleanup() {
 }
 
 main() {
+    parse_arguments "$@"
     install_prerequisites
     clean_package_directory
     create_makefile
     copy_files_to_package
+    # Offline targets cannot install a compiler, so bundles are prebuilt for
+    # the plain x86-64 baseline every target CPU can run
+    if [[ -n "$BUNDLE_PROFILES" && -z "$PREBUILT_BASELINE" ]]; then
+        PREBUILT_BASELINE="x86-64"
+    fi
+    if [[ -n "$PREBUILT_BASELINE" ]]; then
+        create_prebuilt_binary
+    fi
+    if [[ -n "$BUNDLE_PROFILES" ]]; then
+        create_bundle
+    fi
     create_installer
     cleanup
 }
 
 # MAIN()
-main
+main "$@"
@@ -14,1108 +14,6803 @@ std::vector<std::string> parse_string(const std::string &input,
   return result;
 }
 
-void parsePacmanYayResults(const std::string &result,
-                           std::vector<PackageStruct> &matchingPackages,
-                           const std::string &source) {
-  std::regex pacmanYayPattern(
-      R"((\S+)\/(\S+)\s+([\d\.]+-\d+)(\s*\[installed\])?\s*\n\s*(.*))");
-  std::smatch match;
-  std::string::const_iterator searchStart(result.cbegin());
-  while (
-      std::regex_search(searchStart, result.cend(), match, pacmanYayPattern)) {
-    std::string packageName = match[2].str();
-    std::string version = match[3].str();
-    std::string description = match[5].str();
-    bool installed = match[4].matched;
-
-    matchingPackages.emplace_back(packageName, version, description, source);
-    searchStart = match.suffix().first;
-  }
-}
-
-void parseYayResults(const std::string &result,
-                     std::vector<PackageStruct> &matchingPackages) {
-  std::istringstream iss(result);
-  std::string line;
-  std::string currentPackage, currentVersion, currentDescription;
-
-  while (std::getline(iss, line)) {
-    if (line.substr(0, 8) == "Package:") {
-      if (!currentPackage.empty()) {
-        matchingPackages.emplace_back(currentPackage, currentVersion,
-                                      currentDescription, "AUR");
-        currentPackage = currentVersion = currentDescription = "";
-      }
-      currentPackage = line.substr(9);
-    } else if (line.substr(0, 8) == "Version:") {
-      currentVersion = line.substr(9);
-    } else if (line.substr(0, 12) == "Description:") {
-      currentDescription = line.substr(13);
+// Streaming Output
+// Child output is read in large chunks into one buffer that is compacted as
+// complete lines are handed out, so memory stays at one chunk plus the
+// longest line (capped) however much the child prints, and records can be
+// parsed while the child is still running.
+constexpr size_t STREAM_CHUNK_SIZE = 64 * 1024;
+constexpr size_t STREAM_MAX_LINE = 1024 * 1024;
+
+// Run a command and pass each chunk of stdout as it arrives. Returns true if
+// the command exited with status 0.
+bool streamCommandChunks(const std::string &command,
+                         const std::function<void(std::string_view)> &onChunk) {
+  FILE *pipe = popen(command.c_str(), "r");
+  if (!pipe) {
+    return false;
+  }
+  std::vector<char> chunk(STREAM_CHUNK_SIZE);
+  int fd = fileno(pipe);
+  while (true) {
+    ssize_t count = read(fd, chunk.data(), chunk.size());
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      break;
     }
+    onChunk(std::string_view(chunk.data(), static_cast<size_t>(count)));
   }
+  return pclose(pipe) == 0;
+}
 
-  // Add the last package if exists
-  if (!currentPackage.empty()) {
-    matchingPackages.emplace_back(currentPackage, currentVersion,
-                                  currentDescription, "AUR");
+// Run a command and pass each line of stdout (without the newline) as soon
+// as it is complete
+bool streamCommandLines(const std::string &command,
+                        const std::function<void(std::string_view)> &onLine) {
+  std::string pending;
+  size_t consumed = 0;
+  bool truncating = false;
+  bool success = streamCommandChunks(command, [&](std::string_view chunk) {
+    pending.append(chunk);
+    for (size_t newline = pending.find('\n', consumed);
+         newline != std::string::npos;
+         newline = pending.find('\n', consumed)) {
+      if (!truncating) {
+        onLine(std::string_view(pending).substr(consumed, newline - consumed));
+      }
+      truncating = false;
+      consumed = newline + 1;
+    }
+    // Hand over an overlong line early and drop the rest of it
+    if (pending.size() - consumed > STREAM_MAX_LINE) {
+      if (!truncating) {
+        onLine(std::string_view(pending).substr(consumed, STREAM_MAX_LINE));
+      }
+      truncating = true;
+      consumed = pending.size();
+    }
+    pending.erase(0, consumed);
+    consumed = 0;
+  });
+  if (!pending.empty() && !truncating) {
+    onLine(pending);
   }
+  return success;
 }
 
-std::string runFlatpakCommand(const std::string &packageName,
-                              const std::string &columns) {
-  std::string flatpakCommand =
-      "flatpak search " + packageName + " --columns=" + columns;
-  std::array<char, 128> buffer;
-  std::string result;
-
-  FILE *pipe = popen(flatpakCommand.c_str(), "r");
-  if (!pipe) {
-    std::cerr << "Failed to run flatpak command." << std::endl;
-    return "";
+// pacman -Ss / yay -Ss records: a "repo/name version ..." header line
+// followed by an indented description line. Only repositories accepted by
+// the filter are kept (an empty filter keeps all).
+void feedSearchLine(SearchParseState &state, std::string_view line,
+                    PackageSource source,
+                    const std::function<bool(std::string_view)> &repoFilter,
+                    const std::function<void(PackageStruct &&)> &onResult) {
+  if (line.empty()) {
+    return;
   }
-
-  while (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
-    result += buffer.data();
+  if (line.front() != ' ' && line.front() != '\t') {
+    state.havePending = false;
+    size_t slash = line.find('/');
+    size_t space = line.find(' ');
+    if (slash == std::string_view::npos || space == std::string_view::npos ||
+        slash > space || (repoFilter && !repoFilter(line.substr(0, slash)))) {
+      return;
+    }
+    size_t versionEnd = line.find(' ', space + 1);
+    state.name = line.substr(slash + 1, space - slash - 1);
+    state.version = line.substr(space + 1, versionEnd == std::string_view::npos
+                                               ? std::string_view::npos
+                                               : versionEnd - space - 1);
+    state.havePending = true;
+    return;
+  }
+  if (state.havePending) {
+    size_t start = line.find_first_not_of(" \t");
+    onResult(PackageStruct(state.name, state.version,
+                           std::string(line.substr(start)), source));
+    state.havePending = false;
   }
-  pclose(pipe);
-
-  return result;
 }
 
-void fetchFlatpakDetails(const std::string &packageName,
-                         std::vector<PackageStruct> &matchingPackages) {
-  std::string nameResult = runFlatpakCommand(packageName, "name");
-  std::string descriptionResult = runFlatpakCommand(packageName, "description");
-  std::string versionResult = runFlatpakCommand(packageName, "version");
-
-  if (nameResult.find("No matches found") != std::string::npos) {
-    return; // Exit if no matches are found
+// flatpak search with --columns=application,name,description,version,remotes
+// prints one tab-separated record per line
+void feedFlatpakLine(std::string_view line,
+                     const std::function<void(PackageStruct &&)> &onResult) {
+  std::vector<std::string> fields;
+  for (size_t start = 0; start <= line.size();) {
+    size_t tab = line.find('\t', start);
+    fields.emplace_back(line.substr(start, tab == std::string_view::npos
+                                               ? std::string_view::npos
+                                               : tab - start));
+    if (tab == std::string_view::npos) {
+      break;
+    }
+    start = tab + 1;
   }
+  if (fields.size() < 5) {
+    return; // "No matches found" and the like
+  }
+  // An app offered by several remotes lists them comma-separated
+  std::string remote = fields[4].substr(0, fields[4].find(','));
+  onResult(PackageStruct(fields[1], fields[3], fields[2],
+                         PackageSource::Flatpak, fields[0], remote));
+}
 
-  std::istringstream nameStream(nameResult);
-  std::istringstream descriptionStream(descriptionResult);
-  std::istringstream versionStream(versionResult);
-
-  std::string nameLine, descriptionLine, versionLine;
-
-  // Collect each field from the respective results
-  while (std::getline(nameStream, nameLine) &&
-         std::getline(descriptionStream, descriptionLine) &&
-         std::getline(versionStream, versionLine)) {
-    matchingPackages.emplace_back(nameLine, versionLine, descriptionLine,
-                                  "Flatpak");
+void fetchFlatpakDetails(
+    const std::string &packageName,
+    const std::function<void(PackageStruct &&)> &onResult) {
+  if (searchAppstream(packageName, onResult)) {
+    return;
   }
+  streamCommandLines("flatpak search " + shellQuote(packageName) +
+                         " --columns=application,name,description,version,"
+                         "remotes 2>/dev/null",
+                     [&](std::string_view line) {
+                       feedFlatpakLine(line, onResult);
+                     });
 }
 
 // Parsing flags
 bool verboseMode = true; // Default to simplified mode
+int aurBuildJobs =
+    std::max(1u, std::thread::hardware_concurrency() / 2); // --aur-jobs=N
+std::string aurCacheDir;               // --aur-cache=DIR
+uintmax_t aurCacheLimitMB = 4096;      // --aur-cache-size=MB
+bool aurCacheAsRepo = false;           // --aur-cache-repo
+std::unordered_set<std::string> forcedSteps; // --force-step=ID[,ID...]
+bool checkStateOnly = false;                 // --check
+std::string subcommand; // apply, rank-mirrors, search, bundle
+std::string mirrorCandidatesPath = "/etc/pacman.d/mirrorlist"; // --mirrors
+std::string mirrorlistOutputPath =
+    "/etc/pacman.d/mirrorlist";                 // --mirrorlist-out
+std::string pacmanConfPath = "/etc/pacman.conf"; // --pacman-conf
+bool skipMirrorRanking = false;              // --no-rank-mirrors
+std::string sysfsRoot;                       // --sysfs-root, "" for /sys
+bool headlessMode = false;                   // set by apply
+bool assumeYes = false;                      // --yes
+std::vector<std::string> requestedProfiles;  // --profile a,b
+std::string answersFilePath;                 // --answers FILE
+std::string resultsFilePath;                 // --results FILE
+std::unordered_map<std::string, std::string> answers;
+std::vector<std::string> targetRoots;        // --root DIR (repeatable)
+std::string targetUserName;                  // --user NAME
+std::vector<std::string> searchTerms;        // search QUERY...
+bool jsonOutput = false;                     // --json
+size_t searchLimit = 0;                      // --limit N, 0 for no limit
+size_t searchOffset = 0;                     // --offset N
+std::string searchSort = "score";            // --sort score|name|source|none
+std::string bundleOutputPath;                // bundle --out DIR
+std::string bundlePath;                      // --bundle DIR
+std::string bundleRuntimeDir; // private pacman files while bundlePath is used
+// Root the current thread provisions into, empty for the running host.
+// thread_local so several image roots can be provisioned concurrently.
+thread_local std::string targetRoot;
+
+// Failed commands, steps, installs and unanswered questions per target root.
+// Keyed by root rather than thread_local, so failures in the worker threads
+// of a root (AUR builds, downloads) count towards that root.
+std::mutex provisioningFailuresMutex;
+std::unordered_map<std::string, int> provisioningFailures;
+
+void noteProvisioningFailure() {
+  std::lock_guard<std::mutex> lock(provisioningFailuresMutex);
+  ++provisioningFailures[targetRoot];
+}
+
+int provisioningFailureCount() {
+  std::lock_guard<std::mutex> lock(provisioningFailuresMutex);
+  return provisioningFailures[targetRoot];
+}
 
 void parseFlags(int argc, char *argv[]) {
+  // Flags that take a value accept both --flag=value and --flag value
+  auto flagValue = [&](const std::string &arg, const std::string &flag,
+                       int &i) -> std::optional<std::string> {
+    if (arg.rfind(flag + "=", 0) == 0) {
+      return arg.substr(flag.size() + 1);
+    }
+    if (arg == flag && i + 1 < argc) {
+      return std::string(argv[++i]);
+    }
+    return std::nullopt;
+  };
+
   for (int i = 1; i < argc; ++i) {
     std::string arg = argv[i];
-    if (arg == "--verbose=0") {
+    if (i == 1 && (arg == "apply" || arg == "rank-mirrors" ||
+                   arg == "search" || arg == "bundle")) {
+      subcommand = arg;
+    } else if (subcommand == "search" && arg.rfind("--", 0) != 0) {
+      searchTerms.push_back(arg);
+    } else if (arg == "--json") {
+      jsonOutput = true;
+    } else if (auto value = flagValue(arg, "--limit", i)) {
+      searchLimit = std::strtoull(value->c_str(), nullptr, 10);
+    } else if (auto value = flagValue(arg, "--offset", i)) {
+      searchOffset = std::strtoull(value->c_str(), nullptr, 10);
+    } else if (auto value = flagValue(arg, "--sort", i)) {
+      searchSort = *value;
+    } else if (auto value = flagValue(arg, "--profile", i)) {
+      for (const auto &profile : parse_string(*value, ',')) {
+        requestedProfiles.push_back(profile);
+      }
+    } else if (auto value = flagValue(arg, "--out", i)) {
+      bundleOutputPath = *value;
+    } else if (auto value = flagValue(arg, "--bundle", i)) {
+      bundlePath = fs::absolute(*value).lexically_normal().string();
+    } else if (auto value = flagValue(arg, "--answers", i)) {
+      answersFilePath = *value;
+    } else if (auto value = flagValue(arg, "--results", i)) {
+      resultsFilePath = *value;
+    } else if (auto value = flagValue(arg, "--root", i)) {
+      targetRoots.push_back(fs::absolute(*value).lexically_normal().string());
+    } else if (auto value = flagValue(arg, "--user", i)) {
+      targetUserName = *value;
+    } else if (auto value = flagValue(arg, "--mirrors", i)) {
+      mirrorCandidatesPath = *value;
+    } else if (auto value = flagValue(arg, "--mirrorlist-out", i)) {
+      mirrorlistOutputPath = *value;
+    } else if (auto value = flagValue(arg, "--pacman-conf", i)) {
+      pacmanConfPath = *value;
+    } else if (auto value = flagValue(arg, "--sysfs-root", i)) {
+      sysfsRoot = *value;
+    } else if (arg == "--no-rank-mirrors") {
+      skipMirrorRanking = true;
+    } else if (arg == "--yes" || arg == "-y") {
+      assumeYes = true;
+    } else if (arg == "--verbose=0") {
       verboseMode = false;
+    } else if (arg.rfind("--aur-jobs=", 0) == 0) {
+      try {
+        aurBuildJobs = std::max(1, std::stoi(arg.substr(11)));
+      } catch (const std::exception &) {
+        std::cerr << ERROR_COLOR << "Invalid value for --aur-jobs: " << arg
+                  << RESET_COLOR << "\n";
+      }
+    } else if (arg.rfind("--aur-cache=", 0) == 0) {
+      aurCacheDir = arg.substr(12);
+    } else if (arg.rfind("--aur-cache-size=", 0) == 0) {
+      try {
+        aurCacheLimitMB = std::stoull(arg.substr(17));
+      } catch (const std::exception &) {
+        std::cerr << ERROR_COLOR << "Invalid value for --aur-cache-size: "
+                  << arg << RESET_COLOR << "\n";
+      }
+    } else if (arg == "--aur-cache-repo") {
+      aurCacheAsRepo = true;
+    } else if (arg == "--check") {
+      checkStateOnly = true;
+    } else if (arg.rfind("--force-step=", 0) == 0) {
+      for (const auto &step : parse_string(arg.substr(13), ',')) {
+        forcedSteps.insert(step);
+      }
     }
   }
 }
 
-// Progress Bar
-void showProgressBar(int totalSteps) {
-  int progress = 0;
-  while (progress <= totalSteps) {
-    std::cout << "[";
-    int pos = totalSteps / 10;
-    for (int i = 0; i < 15; ++i) {
-      if (i < progress / (totalSteps / 10)) {
-        std::cout << "-";
-      } else {
-        std::cout << " ";
-      }
+// Answers
+// Minimal TOML reader for --answers: [section] headers, key = value pairs,
+// quoted or bare values and # comments. Keys are stored as "section.key".
+bool loadAnswersFile(const std::string &path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  auto trim = [](std::string text) {
+    text.erase(0, text.find_first_not_of(" \t\r"));
+    text.erase(text.find_last_not_of(" \t\r") + 1);
+    return text;
+  };
+
+  std::string section, line;
+  while (std::getline(file, line)) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
     }
-    std::cout << "] " << (progress * 100) / totalSteps << "%\r";
-    std::cout.flush();
-    std::this_thread::sleep_for(std::chrono::milliseconds(200));
-    ++progress;
+    if (line.front() == '[' && line.back() == ']') {
+      section = trim(line.substr(1, line.size() - 2));
+      continue;
+    }
+
+    size_t equals = line.find('=');
+    if (equals == std::string::npos) {
+      continue;
+    }
+    std::string key = trim(line.substr(0, equals));
+    std::string value = trim(line.substr(equals + 1));
+    if (!value.empty() && (value[0] == '"' || value[0] == '\'')) {
+      size_t close = value.find(value[0], 1);
+      value = value.substr(1, close == std::string::npos ? std::string::npos
+                                                         : close - 1);
+    } else {
+      value = trim(value.substr(0, value.find('#')));
+    }
+    answers[section.empty() ? key : section + "." + key] = value;
   }
-  std::cout << std::endl;
+  return true;
 }
 
-void runCommand(const std::string &command) {
-  int result = std::system(command.c_str());
-  if (result != 0) {
-    std::cerr << ERROR_COLOR << "Command failed: " << command << RESET_COLOR
-              << std::endl;
+// Answer a question from the answers file, or from the default under --yes.
+// Returns nullopt if the question has to be asked on the terminal.
+std::optional<std::string> unattendedAnswer(const std::string &key,
+                                            const std::string &fallback) {
+  if (!headlessMode) {
+    return std::nullopt;
+  }
+  auto answer = answers.find(key);
+  if (answer != answers.end()) {
+    std::cout << answer->second << " (" << key << ")\n";
+    return answer->second;
   }
+  if (assumeYes) {
+    std::cout << fallback << " (" << key << ", default)\n";
+    return fallback;
+  }
+  std::cerr << ERROR_COLOR << "No answer for " << key
+            << " in the answers file.\n"
+            << RESET_COLOR;
+  noteProvisioningFailure();
+  return "";
 }
 
-bool isCommandSuccessful(const std::string &command) {
-  return std::system(command.c_str()) == 0;
+bool askYesNo(const std::string &key, bool defaultYes) {
+  if (auto answer = unattendedAnswer(key, defaultYes ? "y" : "n")) {
+    std::string value = *answer;
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    return value == "y" || value == "yes" || value == "true" || value == "1";
+  }
+  char choice;
+  std::cin >> choice;
+  return choice == 'y' || choice == 'Y';
 }
 
-// Check if a package is installed using pacman or yay
-bool isPackageInstalled(const std::string &packageName) {
-  return isCommandSuccessful("pacman -Q " + packageName +
-                             " > /dev/null 2>&1") ||
-         isCommandSuccessful("yay -Q " + packageName + " > /dev/null 2>&1");
+// Numbered menu question, names are accepted as well as numbers (1-based)
+int askChoice(const std::string &key, const std::vector<std::string> &names,
+              int defaultChoice) {
+  if (auto answer = unattendedAnswer(key, names[defaultChoice - 1])) {
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (*answer == names[i] || *answer == std::to_string(i + 1)) {
+        return i + 1;
+      }
+    }
+    return 0;
+  }
+  int choice = 0;
+  std::cin >> choice;
+  return choice;
 }
 
-// Install a package with progress bar in non-verbose mode, returns true on
-// success
-bool installPackageWithProgress(const std::string &packageName,
-                                const std::string &extraFlags) {
-  std::string pacmanQuietFlag = verboseMode ? "" : "--quiet";
-  std::string command = "sudo pacman -S --noconfirm --needed " +
-                        pacmanQuietFlag + " " + extraFlags + " " + packageName;
-
-  if (verboseMode) {
-    std::cout << INPUT_COLOR << "Installing " << packageName << "..."
-              << RESET_COLOR << "\n";
-    return isCommandSuccessful(command);
-  } else {
-    std::system("sudo -v");
-
-    // Show progress bar for non-verbose mode
-    std::cout << INPUT_COLOR << "Installing " << packageName << "..."
-              << RESET_COLOR << "\n";
-    std::thread progressThread(showProgressBar, 150); // Progress bar thread
+// Target Root
+// With --root DIR, pacman runs with --root/--dbpath inside DIR while sharing
+// the host's package cache, configs are written under DIR, and commands that
+// must run on the target go through a chroot wrapper.
+std::string targetUser() {
+  if (!targetUserName.empty()) {
+    return targetUserName;
+  }
+  const char *sudoUser = std::getenv("SUDO_USER");
+  const char *user = std::getenv("USER");
+  return sudoUser && *sudoUser ? sudoUser : (user ? user : "root");
+}
 
-    // Redirect output to /dev/null
-    command += " > /dev/null 2>&1";
-    bool success = isCommandSuccessful(command);
+// Home directory of the user being provisioned
+std::string homeDirectory() {
+  if (!targetRoot.empty()) {
+    std::string user = targetUser();
+    return targetRoot + (user == "root" ? "/root" : "/home/" + user);
+  }
+  const char *home = std::getenv("HOME");
+  return home ? home : "/root";
+}
 
-    // Wait for the progress bar to finish
-    progressThread.join();
+// Host path of a file inside the target -> the same path seen from a chroot
+std::string chrootPath(const std::string &hostPath) {
+  if (targetRoot.empty() || hostPath.rfind(targetRoot, 0) != 0) {
+    return hostPath;
+  }
+  std::string inside = hostPath.substr(targetRoot.size());
+  return inside.empty() ? "/" : inside;
+}
 
-    return success;
+std::string shellQuote(const std::string &text) {
+  std::string quoted = "'";
+  for (char c : text) {
+    quoted += (c == '\'') ? std::string("'\\''") : std::string(1, c);
   }
+  return quoted + "'";
 }
 
-// Install a package using pacman, fallback to yay with optional extra flags,
-// returns true on success
-bool installPackage(const std::string &packageName,
-                    const std::string &extraFlags) {
-  std::string pacmanQuietFlag = verboseMode ? "" : "--quiet";
-  std::string yayQuietFlag = verboseMode ? "" : "--quiet --sudoloop";
+// --config for pacman and pacman-conf while an offline bundle is active
+std::string bundleConfigOption() {
+  return bundleRuntimeDir.empty()
+             ? ""
+             : " --config " + bundleRuntimeDir + "/pacman.conf";
+}
 
-  std::string pacmanCommand = "sudo pacman -S --noconfirm --needed " +
-                              pacmanQuietFlag + " " + extraFlags + " " +
-                              packageName;
-  std::string yayCommand = "yay -S --noconfirm --needed " + yayQuietFlag + " " +
-                           extraFlags + " " + packageName;
+// Sync databases pacman reads on the host
+std::string pacmanSyncDir() {
+  return bundleRuntimeDir.empty() ? PACMAN_SYNC_DIR
+                                  : bundleRuntimeDir + "/db/sync";
+}
 
-  if (!verboseMode) {
-    // Redirect output to /dev/null in non-verbose mode
-    pacmanCommand += " > /dev/null 2>&1";
-    yayCommand += " > /dev/null 2>&1";
+// pacman invocation for the running host, whatever the current target
+std::string hostPacmanCommand() {
+  if (bundleRuntimeDir.empty()) {
+    return "pacman";
   }
+  return "pacman" + bundleConfigOption() + " --dbpath " + bundleRuntimeDir +
+         "/db";
+}
 
-  if (!isPackageInstalled(packageName)) {
-    if (installPackageWithProgress(packageName)) {
-      std::cout << SUCCESS_COLOR << packageName
-                << " installed successfully via pacman.\n"
-                << RESET_COLOR;
-      return true;
-    }
-
-    if (isCommandSuccessful(yayCommand)) {
-      if (!isPackageInstalled(packageName)) {
-        std::cerr << ERROR_COLOR << "Failed to install " << packageName
-                  << " via yay. Package not found.\n"
-                  << RESET_COLOR;
-        return false;
-      }
+// pacman invocation for the current target
+std::string pacmanCommand() {
+  if (targetRoot.empty()) {
+    return hostPacmanCommand();
+  }
+  std::string command = "pacman" + bundleConfigOption() + " --root " +
+                        targetRoot + " --dbpath " + targetRoot +
+                        "/var/lib/pacman --logfile " + targetRoot +
+                        "/var/log/pacman.log --cachedir /var/cache/pacman/pkg";
+  if (!bundlePath.empty()) {
+    command += " --cachedir " + bundlePath + "/pkg";
+  }
+  return command;
+}
 
-      std::cout << SUCCESS_COLOR << packageName
-                << " installed successfully via yay.\n"
-                << RESET_COLOR;
-      return true;
-    } else {
-      std::cerr << ERROR_COLOR << "Failed to install " << packageName
-                << " via both pacman and yay.\n"
-                << RESET_COLOR;
-      return false;
-    }
-  } else {
-    std::cout << SUCCESS_COLOR << packageName << " is already installed.\n"
-              << RESET_COLOR;
-    return true;
+// Run a command on the target, as root or as the provisioned user. On the
+// host this is plain sudo or nothing; for a target root it is arch-chroot
+// (or chroot when arch-install-scripts is missing).
+std::string targetCommand(const std::string &command, bool asRoot) {
+  if (targetRoot.empty()) {
+    return asRoot ? "sudo " + command : command;
+  }
+  static const std::string chroot =
+      std::system("command -v arch-chroot > /dev/null 2>&1") == 0
+          ? "arch-chroot"
+          : "chroot";
+  if (asRoot) {
+    return "sudo " + chroot + " " + targetRoot + " /bin/sh -c " +
+           shellQuote(command);
   }
+  return "sudo " + chroot + " " + targetRoot + " runuser -l " + targetUser() +
+         " -c " + shellQuote(command);
 }
 
-bool downloadFile(const std::string &url, const std::string &outputFilePath) {
-  std::string command = "curl -L " + url + " -o " + outputFilePath;
-  return isCommandSuccessful(command);
+bool targetHasCommand(const std::string &name) {
+  if (targetRoot.empty()) {
+    return isCommandSuccessful("which " + name + " > /dev/null 2>&1");
+  }
+  return fs::exists(targetRoot + "/usr/bin/" + name);
 }
 
-// Check if file exists and is not empty
-bool isFileValid(const std::string &filePath) {
-  std::ifstream file(filePath);
-  return file.good() && file.peek() != std::ifstream::traits_type::eof();
+// Create the target's pacman database directory and seed it with the host's
+// sync databases (or an offline bundle's), so no per-root -Sy is needed
+bool prepareTargetRoot() {
+  std::error_code ec;
+  fs::create_directories(targetRoot + "/var/lib/pacman/sync", ec);
+  fs::create_directories(targetRoot + "/var/log", ec);
+  for (const auto &db : fs::directory_iterator(pacmanSyncDir(), ec)) {
+    fs::copy_file(db.path(),
+                  targetRoot + "/var/lib/pacman/sync/" +
+                      db.path().filename().string(),
+                  bundleRuntimeDir.empty()
+                      ? fs::copy_options::update_existing
+                      : fs::copy_options::overwrite_existing,
+                  ec);
+  }
+  return fs::is_directory(targetRoot + "/var/lib/pacman/sync");
 }
 
-void applyConfig(const std::string &gistUrl, const std::string &configPath) {
-  std::string backupPath = configPath + "_old.bak";
-  std::string tempConfigPath = "/tmp/config_gist";
+// Unique scratch path, safe when several roots are provisioned at once
+std::string scratchPath(const std::string &name) {
+  return "/tmp/" + name + "-" + std::to_string(getpid()) + "-" +
+         toHex(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+}
 
-  // Ensure the target directory exists
-  fs::path targetDir = fs::path(configPath).parent_path();
-  if (!fs::exists(targetDir)) {
-    std::cout << INPUT_COLOR
-              << "Target directory does not exist. Creating: " << targetDir
-              << RESET_COLOR << "\n";
-    fs::create_directories(targetDir);
+// Step Logs
+// In quiet mode child output goes into a fixed-size ring per step instead of
+// /dev/null. The step's own thread appends; a background writer drains all
+// rings into a rotating log file without taking locks on the hot path. The
+// ring keeps the newest bytes, so a slow writer loses old output rather than
+// stalling the child, and the tail is always there to print on failure.
+constexpr uintmax_t STEP_LOG_ROTATE_BYTES = 4 * 1024 * 1024;
+constexpr int STEP_LOG_KEEP = 3;
+constexpr int STEP_LOG_TAIL_LINES = 20;
+
+thread_local std::shared_ptr<StepLog> currentStepLog;
+std::mutex stepLogsMutex; // guards the registry, not the rings
+std::vector<std::shared_ptr<StepLog>> stepLogs;
+std::condition_variable stepLogsWake;
+std::thread stepLogWriter;
+bool stepLogWriterStopping = false;
+
+std::string stepLogPath() { return stateDirectory() + "/logs/arch-setup.log"; }
+
+// Single producer: only the thread that owns the log appends to it
+void appendStepLog(StepLog &log, std::string_view bytes) {
+  uint64_t position = log.written.load(std::memory_order_relaxed);
+  uint64_t end = position + bytes.size();
+  if (bytes.size() > StepLog::CAPACITY) {
+    position = end - StepLog::CAPACITY;
+    bytes = bytes.substr(bytes.size() - StepLog::CAPACITY);
   }
+  while (!bytes.empty()) {
+    size_t offset = position % StepLog::CAPACITY;
+    size_t count = std::min(bytes.size(), StepLog::CAPACITY - offset);
+    std::memcpy(log.data.get() + offset, bytes.data(), count);
+    bytes.remove_prefix(count);
+    position += count;
+  }
+  log.written.store(end, std::memory_order_release);
 
-  if (fs::exists(configPath) && isFileValid(configPath)) {
-    std::cout << INPUT_COLOR << "Backing up current config..." << RESET_COLOR
-              << "\n";
-    std::ifstream src(configPath, std::ios::binary);
-    std::ofstream dst(backupPath, std::ios::binary);
-    dst << src.rdbuf();
-    std::cout << SUCCESS_COLOR << "Backup created at: " << backupPath
-              << RESET_COLOR << "\n";
-  } else {
-    std::cout << ERROR_COLOR << "No valid config found to back up.\n"
-              << RESET_COLOR;
+  // Wake the writer early once half the ring is unread
+  if (end - log.notifiedAt > StepLog::CAPACITY / 2) {
+    log.notifiedAt = end;
+    stepLogsWake.notify_all();
   }
+}
 
-  std::cout << INPUT_COLOR << "Downloading new config..." << RESET_COLOR
-            << "\n";
-  if (!downloadFile(gistUrl, tempConfigPath)) {
-    std::cerr << ERROR_COLOR << "Failed to download the config from " << gistUrl
-              << "\n"
-              << RESET_COLOR;
-    return;
+// Copy what the writer has not seen yet. Bytes the producer may have
+// overwritten while they were being copied are dropped and counted.
+std::string drainStepLog(StepLog &log, uint64_t &dropped) {
+  uint64_t end = log.written.load(std::memory_order_acquire);
+  uint64_t start = std::max(log.drained, end > StepLog::CAPACITY
+                                             ? end - StepLog::CAPACITY
+                                             : uint64_t{0});
+  std::string bytes;
+  for (uint64_t position = start; position < end;) {
+    size_t offset = position % StepLog::CAPACITY;
+    size_t count = static_cast<size_t>(
+        std::min<uint64_t>(end - position, StepLog::CAPACITY - offset));
+    bytes.append(log.data.get() + offset, count);
+    position += count;
   }
 
-  if (!isFileValid(tempConfigPath)) {
-    std::cerr << ERROR_COLOR << "Downloaded config file is invalid or empty.\n"
-              << RESET_COLOR;
-    return;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint64_t after = log.written.load(std::memory_order_relaxed);
+  uint64_t safe = after > StepLog::CAPACITY ? after - StepLog::CAPACITY : 0;
+  if (safe > start) {
+    bytes.erase(0, static_cast<size_t>(std::min<uint64_t>(safe - start,
+                                                          bytes.size())));
+    start = safe;
   }
+  dropped = start - log.drained;
+  log.drained = end;
+  return bytes;
+}
 
-  try {
-    std::cout << INPUT_COLOR << "Applying new config..." << RESET_COLOR << "\n";
-    std::ifstream src(tempConfigPath, std::ios::binary);
-    std::ofstream dst(configPath, std::ios::binary);
-    dst << src.rdbuf();
-    std::cout << SUCCESS_COLOR << "Configuration applied successfully.\n"
-              << RESET_COLOR;
-  } catch (const std::exception &e) {
-    std::cerr << ERROR_COLOR << "Error applying new config: " << e.what()
-              << "\n"
-              << RESET_COLOR;
+// Last lines of a log, read by its owning thread
+std::string stepLogTail(const StepLog &log, int lines) {
+  uint64_t end = log.written.load(std::memory_order_relaxed);
+  uint64_t available = std::min<uint64_t>(end, StepLog::CAPACITY);
+  std::string bytes;
+  for (uint64_t position = end - available; position < end; ++position) {
+    bytes += log.data[position % StepLog::CAPACITY];
+  }
+  size_t start = bytes.size();
+  if (start > 0 && bytes.back() == '\n') {
+    --start; // the trailing newline does not open another line
+  }
+  for (int found = 0; start > 0;) {
+    size_t newline = bytes.rfind('\n', start - 1);
+    if (newline == std::string::npos) {
+      start = 0;
+    } else if (++found == lines) {
+      start = newline + 1;
+      break;
+    } else {
+      start = newline;
+    }
   }
+  return bytes.substr(start);
+}
 
-  try {
-    fs::remove(tempConfigPath);
-  } catch (const fs::filesystem_error &e) {
-    std::cerr << ERROR_COLOR << "Failed to remove temporary file: " << e.what()
-              << "\n"
-              << RESET_COLOR;
+void rotateStepLogFile(const std::string &path) {
+  std::error_code ec;
+  if (fs::file_size(path, ec) < STEP_LOG_ROTATE_BYTES || ec) {
+    return;
+  }
+  for (int i = STEP_LOG_KEEP - 1; i >= 1; --i) {
+    fs::rename(path + "." + std::to_string(i),
+               path + "." + std::to_string(i + 1), ec);
   }
+  fs::rename(path, path + ".1", ec);
 }
 
-// Function to install Flatpak and add Flathub repository
-void setupFlatpak() {
-  // Install flatpak
-  installPackage("flatpak", "--needed");
+void runStepLogWriter() {
+  std::string path = stepLogPath();
+  std::error_code ec;
+  fs::create_directories(fs::path(path).parent_path(), ec);
+  std::shared_ptr<StepLog> lastWritten;
 
-  // Add Flathub repository if not already added
-  if (!isCommandSuccessful("flatpak remote-list | grep flathub")) {
-    std::cout << INPUT_COLOR << "Adding Flathub repository to Flatpak...\n"
-              << RESET_COLOR;
-    runCommand("sudo flatpak remote-add --if-not-exists flathub "
-               "https://flathub.org/repo/flathub.flatpakrepo");
+  while (true) {
+    std::vector<std::shared_ptr<StepLog>> logs;
+    bool stopping;
+    {
+      std::unique_lock<std::mutex> lock(stepLogsMutex);
+      stepLogsWake.wait_for(lock, std::chrono::milliseconds(250));
+      logs = stepLogs;
+      stopping = stepLogWriterStopping;
+    }
+
+    std::ofstream file(path, std::ios::app);
+    for (const auto &log : logs) {
+      uint64_t dropped = 0;
+      std::string bytes = drainStepLog(*log, dropped);
+      if (bytes.empty() && dropped == 0) {
+        continue;
+      }
+      if (log != lastWritten) {
+        file << "==> " << log->stepId << "\n";
+        lastWritten = log;
+      }
+      if (dropped > 0) {
+        file << "[... " << dropped << " bytes not logged]\n";
+      }
+      file << bytes;
+    }
+    file.close();
+    rotateStepLogFile(path);
+
+    // Forget logs whose step is over and whose output is on disk
+    {
+      std::lock_guard<std::mutex> lock(stepLogsMutex);
+      stepLogs.erase(std::remove_if(stepLogs.begin(), stepLogs.end(),
+                                    [](const std::shared_ptr<StepLog> &log) {
+                                      return log->finished &&
+                                             log->drained == log->written;
+                                    }),
+                     stepLogs.end());
+    }
+    if (stopping) {
+      return;
+    }
   }
 }
 
-// ZSH & Starship Setup
-void setZshAsDefaultShell() {
-  if (!isCommandSuccessful("which zsh > /dev/null 2>&1")) {
-    std::cout << INPUT_COLOR << "Zsh is not installed. Installing Zsh..."
-              << RESET_COLOR << "\n";
-    installPackage("zsh", "--needed");
+// Flush everything at exit
+void stopStepLogWriter() {
+  {
+    std::lock_guard<std::mutex> lock(stepLogsMutex);
+    stepLogWriterStopping = true;
   }
-
-  const char *user = std::getenv("USER");
-  if (user == nullptr) {
-    std::cerr << ERROR_COLOR
-              << "Failed to get the current user. Cannot set Zsh as the "
-                 "default shell.\n"
-              << RESET_COLOR;
-    return;
+  stepLogsWake.notify_all();
+  if (stepLogWriter.joinable()) {
+    stepLogWriter.join();
   }
+}
 
-  std::string command = "chsh -s $(which zsh) " + std::string(user);
-  if (isCommandSuccessful(command)) {
-    std::cout << SUCCESS_COLOR << "Zsh has been set as the default shell.\n"
-              << RESET_COLOR;
-  } else {
-    std::cerr << ERROR_COLOR << "Failed to set Zsh as the default shell.\n"
-              << RESET_COLOR;
+// Start a new log for a step on this thread; the writer starts on first use
+std::shared_ptr<StepLog> beginStepLog(const std::string &stepId) {
+  auto log = std::make_shared<StepLog>();
+  log->stepId = targetRoot.empty() ? stepId : stepId + " (" + targetRoot + ")";
+  std::lock_guard<std::mutex> lock(stepLogsMutex);
+  stepLogs.push_back(log);
+  if (!stepLogWriter.joinable() && !stepLogWriterStopping) {
+    stepLogWriter = std::thread(runStepLogWriter);
+    std::atexit(stopStepLogWriter);
   }
+  return log;
 }
 
-// Install terminal emulator and apply configuration
-void installTerminal(const std::string &terminalName,
-                     const std::string &configUrl,
-                     const std::string &configPath) {
-  if (!installPackage(terminalName, "--needed")) {
-    std::cerr << ERROR_COLOR << "Failed to install " << terminalName
-              << ". Aborting setup.\n"
-              << RESET_COLOR;
-    return;
-  }
+void endStepLog(const std::shared_ptr<StepLog> &log) {
+  log->finished = true;
+  stepLogsWake.notify_all();
+}
 
-  if (!configUrl.empty() && !configPath.empty()) {
-    applyConfig(configUrl, configPath);
-    std::cout << SUCCESS_COLOR << terminalName << " configuration applied from "
-              << configUrl << ".\n"
-              << RESET_COLOR;
-  } else {
-    std::cout << SUCCESS_COLOR << terminalName
-              << " installed with no specific configuration applied.\n"
-              << RESET_COLOR;
+// Print the end of the current step's output after a failure
+void printStepLogTail() {
+  if (!currentStepLog ||
+      currentStepLog->written.load(std::memory_order_relaxed) == 0) {
+    return;
   }
-
-  std::cout << SUCCESS_COLOR << terminalName << " setup completed.\n"
+  std::cerr << ERROR_COLOR << "Last output of " << currentStepLog->stepId
+            << ":\n"
+            << RESET_COLOR
+            << stepLogTail(*currentStepLog, STEP_LOG_TAIL_LINES) << "\n"
+            << ERROR_COLOR << "Full log: " << stepLogPath() << "\n"
             << RESET_COLOR;
 }
 
-// WezTerm
-void setupWezTerm() {
-  std::string weztermConfigPath =
-      std::string(getenv("HOME")) + "/.config/wezterm/wezterm.lua";
-  installTerminal("wezterm",
-                  "https://gist.githubusercontent.com/adityanav123/"
-                  "dd3031a3dd82b53d36dafdecc58f4257/raw/"
-                  "921bbc3b4346f21123cd8a4e6f8657f3b6fbfb64/wezterm.lua",
-                  weztermConfigPath);
+// Run a command whose output quiet mode hides. Verbose mode shows it as
+// before; quiet mode captures stdout and stderr into the current step log,
+// and feeds the output lines to a progress lane if one is given.
+bool runQuietCommand(const std::string &command, ProgressLane *lane) {
+  if (verboseMode) {
+    return isCommandSuccessful(command);
+  }
+  ensureSudoFor(command);
+  if (!currentStepLog) {
+    currentStepLog = beginStepLog("general");
+  }
+  std::string header = "$ " + command + "\n";
+  appendStepLog(*currentStepLog, header);
+  std::string partialLine;
+  return streamCommandChunks(
+      "(" + command + ") 2>&1", [&](std::string_view chunk) {
+        appendStepLog(*currentStepLog, chunk);
+        if (!lane) {
+          return;
+        }
+        for (size_t newline = chunk.find('\n');
+             newline != std::string_view::npos; newline = chunk.find('\n')) {
+          partialLine.append(chunk.substr(0, newline));
+          feedProgressLine(*lane, partialLine);
+          partialLine.clear();
+          chunk.remove_prefix(newline + 1);
+        }
+        if (partialLine.size() < STREAM_MAX_LINE) {
+          partialLine.append(chunk);
+        }
+      });
 }
 
-// Kitty
-void setupKitty() {
-  std::string kittyConfigPath =
-      std::string(getenv("HOME")) + "/.config/kitty/kitty.conf";
-  installTerminal("kitty",
-                  "https://gist.githubusercontent.com/adityanav123/"
-                  "8afec13d17c5191bbbfc2f92e632d739/raw/"
-                  "c271c161ec0d74506a36900b6f2501c578cd6e18/kitty.conf",
-                  kittyConfigPath);
+// Progress Display
+// Every running task (pacman transaction, AUR build, Flatpak install) gets a
+// lane: one line of a block redrawn in place by a single render thread.
+// Tasks only bump atomic counters, and each frame is one write(), so the
+// cost of the display does not grow with the number of tasks. Finished
+// lanes are replaced by their final message, printed above the block.
+// Without a terminal only the final messages are printed. Other output
+// while the block is drawn goes through printAboveProgress, since writes
+// the renderer does not know about would break its cursor tracking.
+constexpr auto PROGRESS_FRAME = std::chrono::milliseconds(100);
+constexpr int PROGRESS_BAR_WIDTH = 15;
+
+std::mutex progressMutex; // guards the lane list, not the counters
+std::condition_variable progressWake;
+std::vector<std::shared_ptr<ProgressLane>> progressLanes;
+std::vector<std::string> progressMessages; // printed above the next frame
+std::thread progressRenderer;
+bool progressRendererRunning = false;
+bool progressRendererStopping = false;
+std::atomic<bool> terminalResized{false};
+
+int terminalWidth() {
+  winsize size{};
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+    return size.ws_col;
+  }
+  return 80;
 }
 
-void setupTerminal() {
-  std::cout << INPUT_COLOR << "Which terminal would you like to install? \n"
-            << RESET_COLOR;
-  std::cout << OPTION_COLOR << "(1) WezTerm \n(2) Kitty\n" << RESET_COLOR;
+// SIGWINCH: only flag it, the render thread re-reads the width
+void handleTerminalResize(int) { terminalResized = true; }
+
+// "label  [-----     ] 42% (3/7) installing  ETA 0:12", cut to the width.
+// Lanes with nothing to count advance along their ETA and hold at 99%;
+// lanes with neither show a bouncing marker and the elapsed time.
+std::string renderProgressLane(const ProgressLane &lane, int width,
+                               size_t frame) {
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - lane.started)
+                       .count();
+  uint64_t done = lane.done.load(std::memory_order_relaxed);
+  uint64_t total = lane.total.load(std::memory_order_relaxed);
+  const char *phase = lane.phase.load(std::memory_order_relaxed);
+
+  int percent = -1;
+  if (total > 0) {
+    percent = static_cast<int>(std::min<uint64_t>(done, total) * 100 / total);
+  } else if (lane.etaSeconds > 0) {
+    percent = std::min(99, static_cast<int>(elapsed * 100 / lane.etaSeconds));
+  }
 
-  int terminalChoice;
-  std::cin >> terminalChoice;
+  std::string bar(PROGRESS_BAR_WIDTH, ' ');
+  if (percent >= 0) {
+    std::fill_n(bar.begin(), percent * PROGRESS_BAR_WIDTH / 100, '-');
+  } else {
+    size_t span = 2 * (PROGRESS_BAR_WIDTH - 3);
+    size_t position = frame % span;
+    position = position < span / 2 ? position : span - position;
+    bar.replace(position, 3, "<=>");
+  }
 
-  switch (terminalChoice) {
-  case 1:
-    std::cout << INPUT_COLOR << "Setting up WezTerm...\n" << RESET_COLOR;
-    setupWezTerm();
-    break;
-  case 2:
-    std::cout << INPUT_COLOR << "Setting up Kitty...\n" << RESET_COLOR;
-    setupKitty();
-    break;
+  std::string status = "[" + bar + "] ";
+  if (percent >= 0) {
+    status += std::to_string(percent) + "% ";
+  }
+  if (total > 0) {
+    status += "(" + std::to_string(done) + "/" + std::to_string(total) + ") ";
+  }
+  if (phase) {
+    status += std::string(phase) + " ";
+  }
+  status += percent >= 0 && total == 0
+                ? "ETA " + formatDuration(std::max(0.0, lane.etaSeconds -
+                                                            elapsed))
+                : formatDuration(elapsed);
+
+  // Keep the status whole and shorten the label; one column is left free
+  // so the terminal never wraps
+  int labelWidth = std::max(0, width - 1 - static_cast<int>(status.size()) - 2);
+  std::string label = lane.label;
+  if (static_cast<int>(label.size()) > labelWidth) {
+    label = labelWidth > 3 ? label.substr(0, labelWidth - 3) + "..." : "";
+  }
+  std::string line = label + (label.empty() ? "" : "  ") + status;
+  if (static_cast<int>(line.size()) > width - 1) {
+    line.resize(std::max(0, width - 1));
+  }
+  return INPUT_COLOR + line + RESET_COLOR;
+}
+
+void runProgressRenderer() {
+  bool interactive = isatty(STDOUT_FILENO);
+  int width = terminalWidth();
+  size_t drawnLines = 0;
+
+  for (size_t frame = 0;; ++frame) {
+    std::vector<std::shared_ptr<ProgressLane>> lanes;
+    std::vector<std::string> messages;
+    bool stopping;
+    {
+      std::unique_lock<std::mutex> lock(progressMutex);
+      progressWake.wait_for(lock, PROGRESS_FRAME, [] {
+        return progressRendererStopping || !progressMessages.empty();
+      });
+      lanes = progressLanes;
+      messages.swap(progressMessages);
+      progressLanes.erase(
+          std::remove_if(progressLanes.begin(), progressLanes.end(),
+                         [](const std::shared_ptr<ProgressLane> &lane) {
+                           return lane->outcome.load(
+                                      std::memory_order_acquire) != 0;
+                         }),
+          progressLanes.end());
+      stopping = progressRendererStopping;
+    }
+    if (terminalResized.exchange(false)) {
+      width = terminalWidth();
+    }
+
+    // Move back to the top of the block and clear it, print the queued
+    // output and the messages of lanes that ended, then draw the running
+    // ones again
+    std::string output;
+    if (interactive && drawnLines > 0) {
+      output += "\r\x1b[" + std::to_string(drawnLines) + "A\x1b[J";
+    }
+    drawnLines = 0;
+    for (const auto &message : messages) {
+      output += message;
+    }
+    bool anyRunning = false;
+    for (const auto &lane : lanes) {
+      if (lane->outcome.load(std::memory_order_acquire) != 0) {
+        if (!lane->message.empty()) {
+          output += lane->message + "\n";
+        }
+      } else {
+        anyRunning = true;
+      }
+    }
+    if (interactive && !stopping) {
+      for (const auto &lane : lanes) {
+        if (lane->outcome.load(std::memory_order_acquire) == 0) {
+          output += renderProgressLane(*lane, width, frame) + "\n";
+          ++drawnLines;
+        }
+      }
+    }
+    if (!output.empty()) {
+      std::fflush(stdout); // keep ordinary output ahead of the frame
+      for (size_t written = 0; written < output.size();) {
+        ssize_t count = write(STDOUT_FILENO, output.data() + written,
+                              output.size() - written);
+        if (count < 0 && errno == EINTR) {
+          continue;
+        }
+        if (count <= 0) {
+          break;
+        }
+        written += static_cast<size_t>(count);
+      }
+    }
+
+    // Exit once idle; the next lane starts a new renderer
+    std::lock_guard<std::mutex> lock(progressMutex);
+    if (stopping || (!anyRunning && progressLanes.empty() &&
+                     progressMessages.empty())) {
+      progressRendererRunning = false;
+      for (const auto &message : progressMessages) {
+        std::fputs(message.c_str(), stdout);
+      }
+      std::fflush(stdout);
+      progressMessages.clear();
+      return;
+    }
+  }
+}
+
+// Print the last frame at exit
+void stopProgressRenderer() {
+  {
+    std::lock_guard<std::mutex> lock(progressMutex);
+    progressRendererStopping = true;
+  }
+  progressWake.notify_all();
+  if (progressRenderer.joinable()) {
+    progressRenderer.join();
+  }
+}
+
+std::shared_ptr<ProgressLane> beginProgressLane(const std::string &label,
+                                                double etaSeconds) {
+  auto lane = std::make_shared<ProgressLane>();
+  lane->label =
+      targetRoot.empty() ? label : label + " (" + targetRoot + ")";
+  lane->etaSeconds = etaSeconds;
+  lane->started = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(progressMutex);
+  progressLanes.push_back(lane);
+  if (!progressRendererRunning && !progressRendererStopping) {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+      struct sigaction action {};
+      action.sa_handler = handleTerminalResize;
+      sigemptyset(&action.sa_mask);
+      action.sa_flags = SA_RESTART;
+      sigaction(SIGWINCH, &action, nullptr);
+      std::atexit(stopProgressRenderer);
+    });
+    // The previous renderer has left its loop; it no longer takes the lock
+    if (progressRenderer.joinable()) {
+      progressRenderer.join();
+    }
+    progressRendererRunning = true;
+    progressRenderer = std::thread(runProgressRenderer);
+  }
+  return lane;
+}
+
+// The message is printed in place of the lane on the next frame; an empty
+// message just removes the lane
+void endProgressLane(const std::shared_ptr<ProgressLane> &lane, bool success,
+                     const std::string &message) {
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - lane->started)
+                       .count();
+  if (!message.empty()) {
+    lane->message = std::string(success ? SUCCESS_COLOR : ERROR_COLOR) +
+                    message + " (" + formatDuration(elapsed) + ")" +
+                    RESET_COLOR;
+  }
+  lane->outcome.store(success ? 1 : -1, std::memory_order_release);
+  progressWake.notify_all();
+}
+
+// Write text to stream, or, while lanes are drawn on the same terminal,
+// queue it for the renderer to print above the block
+void printAboveProgress(std::ostream &stream, const std::string &text) {
+  bool sameTerminal = isatty(STDOUT_FILENO) &&
+                      (&stream != &std::cerr || isatty(STDERR_FILENO));
+  {
+    std::lock_guard<std::mutex> lock(progressMutex);
+    if (progressRendererRunning && sameTerminal) {
+      progressMessages.push_back(text);
+      progressWake.notify_all();
+      return;
+    }
+  }
+  stream << text << std::flush;
+}
+
+// pacman reports each phase of a transaction as "(k/n) <phase> <target>"
+// lines, and starts some phases with a bare line such as
+// "checking keyring..."; they set the lane's counter and phase
+void feedProgressLine(ProgressLane &lane, std::string_view line) {
+  static const std::pair<std::string_view, const char *> phases[] = {
+      {":: Retrieving packages", "downloading"},
+      {"downloading", "downloading"},
+      {"checking keyring", "checking keys"},
+      {"checking keys", "checking keys"},
+      {"checking package integrity", "checking integrity"},
+      {"checking integrity", "checking integrity"},
+      {"loading package files", "loading files"},
+      {"checking for file conflicts", "checking conflicts"},
+      {"checking available disk space", "checking disk space"},
+      {"installing", "installing"},
+      {"upgrading", "upgrading"},
+      {"reinstalling", "reinstalling"},
+      {":: Running post-transaction hooks", "running hooks"},
+      {"running", "running hooks"},
+  };
+
+  size_t start = line.find_first_not_of(' ');
+  if (start == std::string_view::npos) {
+    return;
+  }
+  line.remove_prefix(start);
+  bool counted = false;
+  if (line.front() == '(') {
+    size_t slash = line.find('/');
+    size_t close = line.find(')');
+    if (slash != std::string_view::npos && close != std::string_view::npos &&
+        slash < close) {
+      uint64_t step = std::strtoull(
+          std::string(line.substr(1, slash - 1)).c_str(), nullptr, 10);
+      uint64_t steps = std::strtoull(
+          std::string(line.substr(slash + 1, close - slash - 1)).c_str(),
+          nullptr, 10);
+      if (steps > 0) {
+        lane.total.store(steps, std::memory_order_relaxed);
+        lane.done.store(step, std::memory_order_relaxed);
+        counted = true;
+      }
+      line.remove_prefix(close + 1);
+      line.remove_prefix(std::min(line.find_first_not_of(' '), line.size()));
+    }
+  }
+  for (const auto &[prefix, phase] : phases) {
+    if (line.substr(0, prefix.size()) == prefix) {
+      if (lane.phase.exchange(phase, std::memory_order_relaxed) != phase &&
+          !counted) {
+        // Until the new phase reports a count, fall back to the ETA
+        lane.total.store(0, std::memory_order_relaxed);
+        lane.done.store(0, std::memory_order_relaxed);
+      }
+      break;
+    }
+  }
+}
+
+bool runCommand(const std::string &command) {
+  ensureSudoFor(command);
+  int result = std::system(command.c_str());
+  if (result != 0) {
+    noteProvisioningFailure();
+    printAboveProgress(std::cerr, std::string(ERROR_COLOR) +
+                                      "Command failed: " + command +
+                                      RESET_COLOR + "\n");
+  }
+  return result == 0;
+}
+
+bool isCommandSuccessful(const std::string &command) {
+  ensureSudoFor(command);
+  return std::system(command.c_str()) == 0;
+}
+
+// Check if a package is installed using pacman or yay
+bool isPackageInstalled(const std::string &packageName) {
+  if (!targetRoot.empty()) {
+    return isCommandSuccessful(pacmanCommand() + " -Q " + packageName +
+                               " > /dev/null 2>&1");
+  }
+  return isCommandSuccessful("pacman -Q " + packageName +
+                             " > /dev/null 2>&1") ||
+         isCommandSuccessful("yay -Q " + packageName + " > /dev/null 2>&1");
+}
+
+// Install a package with progress bar in non-verbose mode, returns true on
+// success
+bool installPackageWithProgress(const std::string &packageName,
+                                const std::string &extraFlags) {
+  return installRepoTransaction({packageName}, extraFlags,
+                                resolveClosure({packageName}).etaSeconds);
+}
+
+// Install repo packages in a single pacman transaction, with a progress bar
+// following etaSeconds in non-verbose mode
+bool installRepoTransaction(const std::vector<std::string> &packageNames,
+                            const std::string &extraFlags, double etaSeconds) {
+  std::string pacmanQuietFlag = verboseMode ? "" : "--quiet";
+  std::string packageList = joinStrings(packageNames, " ");
+  std::string command = "sudo " + pacmanCommand() +
+                        " -S --noconfirm --needed " + pacmanQuietFlag + " " +
+                        extraFlags + " " + packageList;
+
+  if (verboseMode) {
+    std::cout << INPUT_COLOR << "Installing " << packageList << "..."
+              << RESET_COLOR << "\n";
+    return isCommandSuccessful(command);
+  } else {
+    ensureSudoFor(command);
+
+    // Output goes to the step log; pacman's phase lines drive the lane
+    std::string what = packageNames.size() == 1
+                           ? packageList
+                           : std::to_string(packageNames.size()) + " packages";
+    auto lane = beginProgressLane("pacman: " + what, etaSeconds);
+    bool success = runQuietCommand(command, lane.get());
+    endProgressLane(lane, success,
+                    success ? "Installed " + what
+                            : "pacman failed for " + what);
+    return success;
+  }
+}
+
+// Install a package through the installer its provider route picks,
+// returns true on success. A failure counts towards the current root, so
+// installs outside journaled steps (yay, Flatpak, terminals) are reported.
+bool installPackage(const std::string &packageName,
+                    const std::string &extraFlags) {
+  bool installed = installRoutedPackage(packageName, extraFlags);
+  if (!installed) {
+    noteProvisioningFailure();
+  }
+  return installed;
+}
+
+bool installPackages(const std::vector<std::string> &packageNames,
+                     const std::string &extraFlags) {
+  bool installed = installRoutedPackages(packageNames, extraFlags);
+  if (!installed) {
+    noteProvisioningFailure();
+  }
+  return installed;
+}
+
+bool installRoutedPackage(const std::string &packageName,
+                          const std::string &extraFlags) {
+  ProviderRoute route = routePackage(packageName, installedProvisions());
+  switch (route.provider) {
+  case PackageProvider::Installed:
+    std::cout << SUCCESS_COLOR << packageName << " is already installed.\n"
+              << RESET_COLOR;
+    return true;
+  case PackageProvider::Repo:
+    waitForPrefetchedPackages();
+    if (installPackageWithProgress(packageName, extraFlags)) {
+      std::cout << SUCCESS_COLOR << packageName
+                << " installed successfully via pacman.\n"
+                << RESET_COLOR;
+      return true;
+    }
+    std::cerr << ERROR_COLOR << "Failed to install " << packageName
+              << " via pacman.\n"
+              << RESET_COLOR;
+    return false;
+  case PackageProvider::AurCached:
+  case PackageProvider::AurSource:
+    return installAurPackages({packageName});
+  case PackageProvider::Flatpak:
+    return installFlatpakApps({route});
   default:
-    std::cout << ERROR_COLOR << "Invalid choice. Please try again.\n"
+    std::cerr << ERROR_COLOR << packageName
+              << " was not found in the repositories, the AUR or any Flatpak "
+                 "remote.\n"
               << RESET_COLOR;
-    break;
+    return false;
   }
 }
 
-// Setup ZSH shell and apply .zshrc config
-void setupStarshipTheme() {
-  std::cout << INPUT_COLOR << "Choose a theme for Starship: \n" << RESET_COLOR;
-  std::cout << OPTION_COLOR << "(1) Gruvbox\n(2) Catppuccin Mocha\n"
-            << RESET_COLOR;
-
-  int themeChoice;
-  std::cin >> themeChoice;
+// Install a list of packages. Each package is routed to its provider first;
+// repo packages go into one pacman transaction (retried one by one through
+// installRoutedPackage() if it fails), AUR packages are handed to the
+// parallel AUR build stage in one batch, and Flatpak apps are installed per
+// remote.
+bool installRoutedPackages(const std::vector<std::string> &packageNames,
+                           const std::string &extraFlags) {
+  bool allInstalled = true;
+  std::vector<ProviderRoute> routes = routePackages(packageNames);
+  printRoutePlan(routes);
+
+  std::vector<std::string> repoPackages;
+  std::vector<std::string> aurPackages;
+  for (const auto &route : routes) {
+    switch (route.provider) {
+    case PackageProvider::Installed:
+      std::cout << SUCCESS_COLOR << route.name << " is already installed.\n"
+                << RESET_COLOR;
+      break;
+    case PackageProvider::Repo:
+      repoPackages.push_back(route.name);
+      break;
+    case PackageProvider::AurCached:
+    case PackageProvider::AurSource:
+      aurPackages.push_back(route.name);
+      break;
+    case PackageProvider::Unknown:
+      allInstalled = false;
+      break;
+    default:
+      break;
+    }
+  }
 
-  std::string starshipConfigPath =
-      std::string(getenv("HOME")) + "/.config/starship.toml";
+  ClosureEstimate estimate = resolveClosure(repoPackages);
+  if (!estimate.packages.empty()) {
+    std::cout << INPUT_COLOR << estimate.packages.size()
+              << " packages to install: " << formatBytes(estimate.downloadBytes)
+              << " to download, " << formatBytes(estimate.installBytes)
+              << " installed, about " << formatDuration(estimate.etaSeconds)
+              << ".\n"
+              << RESET_COLOR;
+    if (!preflightDiskSpace(estimate)) {
+      return false;
+    }
+  }
+  auto start = std::chrono::steady_clock::now();
 
-  switch (themeChoice) {
-  case 1: {
-    std::string gruvboxCommand =
-        "starship preset gruvbox-rainbow -o " + starshipConfigPath;
-    if (isCommandSuccessful(gruvboxCommand)) {
-      std::cout << SUCCESS_COLOR << "Gruvbox theme applied to Starship.\n"
+  if (!repoPackages.empty()) {
+    waitForPrefetchedPackages();
+    if (installRepoTransaction(repoPackages, extraFlags, estimate.etaSeconds)) {
+      std::cout << SUCCESS_COLOR << repoPackages.size()
+                << " packages installed successfully via pacman.\n"
                 << RESET_COLOR;
     } else {
-      std::cerr << ERROR_COLOR << "Failed to apply Gruvbox theme to Starship.\n"
-                << RESET_COLOR;
+      // Find out which package broke the transaction
+      for (const auto &pkg : repoPackages) {
+        allInstalled = installRoutedPackage(pkg, extraFlags) && allInstalled;
+      }
     }
-    break;
   }
-  case 2: {
-    std::string starshipThemePath = "/tmp/catppuccin_starship";
-    std::string cloneThemeCommand =
-        "git clone https://github.com/catppuccin/starship " + starshipThemePath;
 
-    if (isCommandSuccessful(cloneThemeCommand)) {
-      std::string themeFilePath = starshipThemePath + "/themes/mocha.toml";
+  // Whatever the download did not account for was spent installing
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  double installSeconds =
+      seconds - estimate.downloadBytes /
+                    loadRate("download", DEFAULT_DOWNLOAD_RATE);
+  if (allInstalled && estimate.installBytes > 0 && installSeconds > 1) {
+    recordRate("install", estimate.installBytes / installSeconds);
+  }
 
-      std::ifstream themeFile(themeFilePath);
-      std::ofstream starshipConfig(starshipConfigPath, std::ios_base::app);
+  if (!aurPackages.empty()) {
+    allInstalled = installAurPackages(aurPackages) && allInstalled;
+  }
+  return installFlatpakApps(routes) && allInstalled;
+}
 
-      if (themeFile.is_open() && starshipConfig.is_open()) {
-        // Write the palette and theme configuration to starship.toml
-        starshipConfig << "\npalette = \"catppuccin_mocha\"\n";
-        starshipConfig << themeFile.rdbuf();
-        themeFile.close();
-        starshipConfig.close();
+// Run a command and return everything it wrote to stdout
+std::string captureCommandOutput(const std::string &command) {
+  std::string result;
+  streamCommandChunks(command,
+                      [&](std::string_view chunk) { result.append(chunk); });
+  return result;
+}
 
-        std::cout << SUCCESS_COLOR
-                  << "Catppuccin Mocha theme applied to Starship.\n"
-                  << RESET_COLOR;
-      } else {
-        std::cerr
-            << ERROR_COLOR
-            << "Failed to configure Catppuccin Mocha theme for Starship.\n"
-            << RESET_COLOR;
+// Names of every package in the sync databases, loaded once per run
+const std::unordered_set<std::string> &syncPackageNames() {
+  static const std::unordered_set<std::string> names = [] {
+    std::unordered_set<std::string> loaded;
+    std::istringstream stream(
+        captureCommandOutput(hostPacmanCommand() + " -Slq 2>/dev/null"));
+    std::string line;
+    while (std::getline(stream, line)) {
+      if (!line.empty()) {
+        loaded.insert(line);
       }
+    }
+    return loaded;
+  }();
+  return names;
+}
 
-      fs::remove_all(starshipThemePath);
-    } else {
-      std::cerr << ERROR_COLOR
-                << "Failed to clone Catppuccin Starship theme repository.\n"
-                << RESET_COLOR;
+// "foo>=1.2" -> "foo"
+std::string stripVersionConstraint(const std::string &dependency) {
+  return dependency.substr(0, dependency.find_first_of("<>="));
+}
+
+// Run task(0..taskCount-1) on at most maxJobs worker threads
+void runConcurrently(size_t taskCount, int maxJobs,
+                     const std::function<void(size_t)> &task) {
+  std::atomic<size_t> nextTask{0};
+  size_t workerCount =
+      std::min(taskCount, static_cast<size_t>(std::max(1, maxJobs)));
+
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < workerCount; ++w) {
+    workers.emplace_back([&, root = targetRoot] {
+      targetRoot = root;
+      for (size_t i = nextTask++; i < taskCount; i = nextTask++) {
+        task(i);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+// Mirror Ranking
+// Candidate mirrors (commented or not) are probed concurrently: one ranged
+// download of core.files measures time to first byte and throughput. The
+// reachable mirrors are written back fastest first, and ParallelDownloads is
+// set from the measured bandwidth before a large transaction.
+// The mirrorlist is backed up to <mirrorlist>.arch-setup.bak before it is
+// first replaced, and later runs probe the backup (or the .pacnew pacman
+// left) rather than the ranked list, which only keeps MIRROR_KEEP_COUNT.
+constexpr size_t MIRROR_PROBE_LIMIT = 32;
+constexpr size_t MIRROR_KEEP_COUNT = 10;
+constexpr const char *RANKED_MIRRORLIST_HEADER =
+    "# Ranked by arch-setup, fastest first\n";
+constexpr const char *MIRRORLIST_BACKUP_SUFFIX = ".arch-setup.bak";
+
+bool isRankedMirrorlist(const std::string &path) {
+  return readFileContents(path).rfind(RANKED_MIRRORLIST_HEADER, 0) == 0;
+}
+
+// The list to probe: path itself, unless it is a list written by us
+std::string pristineMirrorlist(const std::string &path) {
+  if (!isRankedMirrorlist(path)) {
+    return path;
+  }
+  for (const auto &candidate :
+       {path + MIRRORLIST_BACKUP_SUFFIX, path + ".pacnew"}) {
+    if (fs::exists(candidate)) {
+      return candidate;
     }
-    break;
   }
-  default:
-    std::cout << ERROR_COLOR << "Invalid choice. No theme applied.\n"
-              << RESET_COLOR;
-    break;
+  return path;
+}
+
+// "Server = https://host/$repo/os/$arch" lines, in file order, deduplicated
+std::vector<std::string> readMirrorCandidates(const std::string &path) {
+  std::vector<std::string> servers;
+  std::unordered_set<std::string> seen;
+  std::istringstream mirrorlist(readFileContents(path));
+  std::string line;
+  while (std::getline(mirrorlist, line) &&
+         servers.size() < MIRROR_PROBE_LIMIT) {
+    size_t start = line.find_first_not_of("# \t");
+    if (start == std::string::npos || line.compare(start, 6, "Server") != 0) {
+      continue;
+    }
+    size_t equals = line.find('=', start);
+    if (equals == std::string::npos) {
+      continue;
+    }
+    std::string server = line.substr(line.find_first_not_of(" \t", equals + 1));
+    server = server.substr(0, server.find_last_not_of(" \t\r") + 1);
+    if (!server.empty() && seen.insert(server).second) {
+      servers.push_back(server);
+    }
   }
+  return servers;
 }
 
-void setupShell() {
-  // check yay
-  ensureYayInstalled();
+std::string expandMirrorUrl(std::string server, const std::string &repo) {
+  for (const auto &[variable, value] :
+       {std::pair<std::string, std::string>{"$repo", repo},
+        {"$arch", "x86_64"}}) {
+    for (size_t pos = server.find(variable); pos != std::string::npos;
+         pos = server.find(variable)) {
+      server.replace(pos, variable.size(), value);
+    }
+  }
+  return server;
+}
 
-  std::vector<std::string> zsh_dependencies{"zsh",
-                                            "ttf-recursive",
-                                            "ttf-recursive-nerd",
-                                            "ttf-firacode-nerd",
-                                            "pfetch",
-                                            "starship",
-                                            "eza"};
-  for (const auto &pkg : zsh_dependencies) {
-    installPackage(pkg, "--needed");
+MirrorProbe probeMirror(const std::string &server) {
+  MirrorProbe probe{server, 0.0, 0.0, false};
+  std::string output = captureCommandOutput(
+      "curl -s -o /dev/null --connect-timeout 2 --max-time 4 -r 0-2097151 "
+      "-w '%{http_code} %{time_starttransfer} %{speed_download}' " +
+      shellQuote(expandMirrorUrl(server, "core") + "/core.files"));
+  std::istringstream fields(output);
+  int httpCode = 0;
+  if (fields >> httpCode >> probe.latencySeconds >> probe.bytesPerSecond) {
+    probe.reachable = (httpCode == 200 || httpCode == 206) &&
+                      probe.bytesPerSecond > 0;
   }
+  return probe;
+}
 
-  // Homebrew Setup
-  std::string homebrewInstallCommand =
-      "/bin/bash -c \"$(curl -fsSL "
-      "https://raw.githubusercontent.com/Homebrew/install/HEAD/install.sh)\"";
-  std::cout << INPUT_COLOR << "Installing Homebrew...\n" << RESET_COLOR;
-  runCommand(homebrewInstallCommand);
-
-  // Source Homebrew
-  std::string sourceHomebrewCommand = "eval $(/opt/homebrew/bin/brew shellenv)";
-  if (isCommandSuccessful(sourceHomebrewCommand)) {
-    std::cout << SUCCESS_COLOR
-              << "Homebrew sourced successfully in this session.\n"
-              << RESET_COLOR;
+// Probe every candidate at once, reachable mirrors sorted fastest first
+std::vector<MirrorProbe> rankMirrors(const std::vector<std::string> &servers) {
+  std::vector<MirrorProbe> probes(servers.size());
+  runConcurrently(servers.size(), static_cast<int>(servers.size()),
+                  [&](size_t i) { probes[i] = probeMirror(servers[i]); });
+
+  probes.erase(
+      std::remove_if(probes.begin(), probes.end(),
+                     [](const MirrorProbe &p) { return !p.reachable; }),
+      probes.end());
+  std::sort(probes.begin(), probes.end(),
+            [](const MirrorProbe &a, const MirrorProbe &b) {
+              if (a.bytesPerSecond != b.bytesPerSecond) {
+                return a.bytesPerSecond > b.bytesPerSecond;
+              }
+              return a.latencySeconds < b.latencySeconds;
+            });
+  return probes;
+}
+
+// Slow links gain nothing from many connections; fast links need several to
+// hide per-package latency. Based on the best single-stream throughput.
+int parallelDownloadsFor(double bytesPerSecond) {
+  double megabytes = bytesPerSecond / (1024.0 * 1024.0);
+  if (megabytes < 1) {
+    return 2;
+  }
+  if (megabytes < 5) {
+    return 3;
+  }
+  if (megabytes < 20) {
+    return 5;
+  }
+  return 8;
+}
+
+// Replace a system file, through sudo when it is not writable by us
+bool writeSystemFile(const std::string &path, const std::string &contents) {
+  std::string tempPath = scratchPath("arch-setup-system-file");
+  {
+    std::ofstream temp(tempPath, std::ios::trunc);
+    temp << contents;
+    if (!temp) {
+      return false;
+    }
+  }
+  bool written;
+  if (access(path.c_str(), W_OK) == 0 ||
+      (!fs::exists(path) && access(fs::path(path).parent_path().c_str(),
+                                   W_OK) == 0)) {
+    std::error_code ec;
+    fs::copy_file(tempPath, path, fs::copy_options::overwrite_existing, ec);
+    written = !ec;
   } else {
-    std::cerr
-        << ERROR_COLOR
-        << "Failed to source Homebrew. You may need to restart the terminal.\n"
-        << RESET_COLOR;
+    written = runCommand("sudo install -m 644 " + tempPath + " " + path);
+  }
+  fs::remove(tempPath);
+  return written;
+}
+
+// Set ParallelDownloads in [options], uncommenting or adding the line
+std::string withParallelDownloads(const std::string &pacmanConf, int count) {
+  // [ \t] rather than \s, which would also match the newlines before it
+  static const std::regex existing(R"(^#?[ \t]*ParallelDownloads[ \t]*=.*$)",
+                                   std::regex::multiline);
+  std::string line = "ParallelDownloads = " + std::to_string(count);
+  if (std::regex_search(pacmanConf, existing)) {
+    return std::regex_replace(pacmanConf, existing, line,
+                              std::regex_constants::format_first_only);
+  }
+  std::string updated = pacmanConf;
+  size_t options = updated.find("[options]");
+  if (options == std::string::npos) {
+    return "[options]\n" + line + "\n" + updated;
+  }
+  updated.insert(updated.find('\n', options) + 1, line + "\n");
+  return updated;
+}
+
+// Rank mirrors and tune pacman, once per run, before a large transaction
+bool optimizeMirrors() {
+  static std::once_flag ranked;
+  static bool success = false;
+  std::call_once(ranked, [] {
+    if (skipMirrorRanking) {
+      return;
+    }
+    std::string candidatesPath = pristineMirrorlist(mirrorCandidatesPath);
+    auto servers = readMirrorCandidates(candidatesPath);
+    if (servers.empty()) {
+      std::cerr << ERROR_COLOR << "No mirrors found in " << candidatesPath
+                << ", keeping the current mirrorlist.\n"
+                << RESET_COLOR;
+      return;
+    }
+
+    std::cout << INPUT_COLOR << "Benchmarking " << servers.size()
+              << " mirrors...\n"
+              << RESET_COLOR;
+    auto probes = rankMirrors(servers);
+    if (probes.empty()) {
+      std::cerr << ERROR_COLOR
+                << "No mirror answered, keeping the current mirrorlist.\n"
+                << RESET_COLOR;
+      return;
+    }
+
+    std::ostringstream mirrorlist;
+    mirrorlist << RANKED_MIRRORLIST_HEADER;
+    for (size_t i = 0; i < probes.size() && i < MIRROR_KEEP_COUNT; ++i) {
+      const auto &probe = probes[i];
+      mirrorlist << "# " << std::fixed << std::setprecision(2)
+                 << probe.bytesPerSecond / (1024.0 * 1024.0) << " MiB/s, "
+                 << std::setprecision(0) << probe.latencySeconds * 1000
+                 << " ms to first byte\n"
+                 << "Server = " << probe.server << "\n";
+      std::cout << OPTION_COLOR << " " << std::setw(2) << i + 1 << ". "
+                << probe.server << RESET_COLOR << " (" << std::fixed
+                << std::setprecision(2)
+                << probe.bytesPerSecond / (1024.0 * 1024.0) << " MiB/s)\n";
+    }
+
+    // Back up the original list once; a ranked list is never backed up
+    std::string backupPath = mirrorlistOutputPath + MIRRORLIST_BACKUP_SUFFIX;
+    if (fs::exists(mirrorlistOutputPath) && !fs::exists(backupPath) &&
+        !isRankedMirrorlist(mirrorlistOutputPath) &&
+        !writeSystemFile(backupPath, readFileContents(mirrorlistOutputPath))) {
+      std::cerr << ERROR_COLOR << "Could not back up " << mirrorlistOutputPath
+                << ", keeping the current mirrorlist.\n"
+                << RESET_COLOR;
+      return;
+    }
+
+    recordRate("download", probes.front().bytesPerSecond);
+    int parallel = parallelDownloadsFor(probes.front().bytesPerSecond);
+    success = writeSystemFile(mirrorlistOutputPath, mirrorlist.str()) &&
+              writeSystemFile(pacmanConfPath,
+                              withParallelDownloads(
+                                  readFileContents(pacmanConfPath), parallel));
+    if (success) {
+      std::cout << SUCCESS_COLOR << "Wrote ranked mirrorlist to "
+                << mirrorlistOutputPath << ", ParallelDownloads = " << parallel
+                << ".\n"
+                << RESET_COLOR;
+    }
+  });
+  return success;
+}
+
+// Hardware Detection
+// GPUs are read from <sysfs>/bus/pci/devices/*/{class,vendor,device}; the
+// sysfs root can be pointed at a fake tree with --sysfs-root. Results are
+// cached per host and reused while the set of PCI slots is unchanged. With
+// --root the host's /sys says nothing about the target's hardware, so no
+// GPU is detected unless --sysfs-root is given as well.
+constexpr unsigned PCI_VENDOR_NVIDIA = 0x10de;
+constexpr unsigned PCI_VENDOR_AMD = 0x1002;
+constexpr unsigned PCI_VENDOR_INTEL = 0x8086;
+
+unsigned readHexFile(const fs::path &path) {
+  try {
+    return static_cast<unsigned>(
+        std::stoul(readFileContents(path), nullptr, 16));
+  } catch (const std::exception &) {
+    return 0;
+  }
+}
+
+// /etc/machine-id, or the hostname when there is none
+std::string hostIdentifier() {
+  std::string id = readFileContents("/etc/machine-id");
+  if (id.empty()) {
+    std::array<char, 256> hostname{};
+    gethostname(hostname.data(), hostname.size() - 1);
+    id = hostname.data();
+  }
+  id.erase(std::remove(id.begin(), id.end(), '\n'), id.end());
+  return id;
+}
+
+std::vector<GpuDevice> detectGpus() {
+  static std::mutex gpusMutex;
+  static std::optional<std::vector<GpuDevice>> detected;
+  std::lock_guard<std::mutex> lock(gpusMutex);
+  if (detected) {
+    return *detected;
+  }
+  if (sysfsRoot.empty() && !targetRoots.empty()) {
+    static std::once_flag warned;
+    std::call_once(warned, [] {
+      printAboveProgress(std::cerr,
+                         std::string(ERROR_COLOR) +
+                             "No --sysfs-root given for --root, so no GPU "
+                             "driver will be installed. Install it yourself "
+                             "or pass the target's sysfs tree.\n" +
+                             RESET_COLOR);
+    });
+    return {};
+  }
+
+  fs::path devicesDir =
+      fs::path(sysfsRoot.empty() ? "/sys" : sysfsRoot) / "bus/pci/devices";
+  std::vector<std::string> slots;
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(devicesDir, ec)) {
+    slots.push_back(entry.path().filename().string());
+  }
+  std::sort(slots.begin(), slots.end());
+
+  std::string cachePath = cacheDirectory() + "/hardware/" +
+                          toHex(fnv1a64(hostIdentifier() + sysfsRoot));
+  std::string slotsFingerprint = toHex(fnv1a64(joinStrings(slots, " ")));
+
+  // Cache layout: fingerprint line, then "slot vendor device" per GPU
+  std::istringstream cached(readFileContents(cachePath));
+  std::string line;
+  if (std::getline(cached, line) && line == slotsFingerprint) {
+    std::vector<GpuDevice> gpus;
+    GpuDevice gpu;
+    while (cached >> gpu.slot >> std::hex >> gpu.vendorId >> gpu.deviceId) {
+      gpus.push_back(gpu);
+    }
+    return *(detected = gpus);
+  }
+
+  std::vector<GpuDevice> gpus;
+  for (const auto &slot : slots) {
+    // Class 0x03xxxx: display controllers (VGA, 3D, other)
+    if ((readHexFile(devicesDir / slot / "class") >> 16) != 0x03) {
+      continue;
+    }
+    gpus.push_back({slot, readHexFile(devicesDir / slot / "vendor"),
+                    readHexFile(devicesDir / slot / "device")});
+  }
+
+  fs::create_directories(fs::path(cachePath).parent_path(), ec);
+  std::ofstream cacheFile(cachePath, std::ios::trunc);
+  cacheFile << slotsFingerprint << "\n";
+  for (const auto &gpu : gpus) {
+    cacheFile << gpu.slot << " " << std::hex << gpu.vendorId << " "
+              << gpu.deviceId << "\n";
+  }
+  return *(detected = gpus);
+}
+
+// Driver packages for the detected GPUs, on top of the common mesa stack
+std::vector<std::string> gpuDriverPackages(const std::vector<GpuDevice> &gpus) {
+  std::vector<std::string> packages;
+  auto add = [&](std::initializer_list<const char *> names) {
+    for (const char *name : names) {
+      if (std::find(packages.begin(), packages.end(), name) == packages.end()) {
+        packages.push_back(name);
+      }
+    }
+  };
+
+  for (const auto &gpu : gpus) {
+    switch (gpu.vendorId) {
+    case PCI_VENDOR_NVIDIA:
+      // Device IDs from 0x1e00 are Turing and newer, which use the open
+      // kernel modules; Maxwell and Pascal need the proprietary ones. Older
+      // cards are left to nouveau in mesa.
+      if (gpu.deviceId >= 0x1e00) {
+        add({"nvidia-open"});
+      } else if (gpu.deviceId >= 0x1340) {
+        add({"nvidia"});
+      } else {
+        break;
+      }
+      add({"nvidia-utils", "lib32-nvidia-utils", "nvidia-settings", "libvdpau",
+           "lib32-libvdpau"});
+      break;
+    case PCI_VENDOR_AMD:
+      add({"vulkan-radeon", "lib32-vulkan-radeon"});
+      break;
+    case PCI_VENDOR_INTEL:
+      add({"vulkan-intel", "lib32-vulkan-intel", "intel-media-driver"});
+      // intel-media-driver starts at Broadwell (0x16xx). Older iGPUs, from
+      // GMA X4500 (0x29xx-0x2exx) to Haswell (up to 0x0dxx), decode video
+      // with the legacy VA-API driver.
+      if (gpu.deviceId < 0x1600 ||
+          (gpu.deviceId >= 0x2900 && gpu.deviceId < 0x2f00)) {
+        add({"libva-intel-driver"});
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return packages;
+}
+
+std::string gpuVendorName(unsigned vendorId) {
+  switch (vendorId) {
+  case PCI_VENDOR_NVIDIA:
+    return "NVIDIA";
+  case PCI_VENDOR_AMD:
+    return "AMD";
+  case PCI_VENDOR_INTEL:
+    return "Intel";
+  default:
+    return "unknown vendor";
+  }
+}
+
+// Dependency Resolver
+// Reads the sync databases directly (desc records inside the .db archives)
+// to work out which packages a transaction will pull in, how much it will
+// download and install, and roughly how long that takes.
+
+// Feed one line of a repository's concatenated desc files. key holds the
+// %SECTION% being read; a %FILENAME% section starts the next package.
+void feedSyncDescLine(std::string &key, const std::string &repo,
+                      std::string_view line, SyncDatabase &db) {
+  if (line.empty()) {
+    key.clear();
+    return;
+  }
+  if (line.size() > 2 && line.front() == '%' && line.back() == '%') {
+    key = line.substr(1, line.size() - 2);
+    if (key == "FILENAME") {
+      db.packages.emplace_back().repo = repo;
+    }
+    return;
+  }
+  if (key.empty() || db.packages.empty()) {
+    return;
+  }
+
+  SyncPackage &current = db.packages.back();
+  std::string value(line);
+  if (key == "FILENAME") {
+    current.filename = value;
+  } else if (key == "NAME") {
+    current.name = value;
+  } else if (key == "VERSION") {
+    current.version = value;
+  } else if (key == "DESC") {
+    current.description = value;
+  } else if (key == "CSIZE") {
+    current.compressedSize = std::stoull(value);
+  } else if (key == "ISIZE") {
+    current.installedSize = std::stoull(value);
+  } else if (key == "DEPENDS") {
+    current.depends.push_back(stripVersionConstraint(value));
+  } else if (key == "PROVIDES") {
+    current.provides.push_back(stripVersionConstraint(value));
+  } else if (key == "REPLACES") {
+    current.replaces.push_back(stripVersionConstraint(value));
+  }
+}
+
+// All sync databases in pacman.conf order, loaded once per run
+const SyncDatabase &syncDatabase() {
+  static const SyncDatabase db = [] {
+    SyncDatabase loaded;
+    std::vector<std::string> repos = parse_string(
+        captureCommandOutput("pacman-conf" + bundleConfigOption() +
+                             " --repo-list 2>/dev/null"), '\n');
+    if (repos.empty()) {
+      std::error_code ec;
+      for (const auto &entry : fs::directory_iterator(pacmanSyncDir(), ec)) {
+        if (entry.path().extension() == ".db") {
+          repos.push_back(entry.path().stem().string());
+        }
+      }
+      std::sort(repos.begin(), repos.end());
+    }
+
+    for (const auto &repo : repos) {
+      std::string dbPath = pacmanSyncDir() + "/" + repo + ".db";
+      if (repo.empty() || !fs::exists(dbPath)) {
+        continue;
+      }
+      std::string key;
+      streamCommandLines("bsdtar -xOf " + dbPath + " 2>/dev/null || tar -xOf " +
+                             dbPath + " 2>/dev/null",
+                         [&](std::string_view line) {
+                           feedSyncDescLine(key, repo, line, loaded);
+                         });
+    }
+
+    for (size_t i = 0; i < loaded.packages.size(); ++i) {
+      const auto &pkg = loaded.packages[i];
+      loaded.byName.emplace(pkg.name, i); // first repo wins, as in pacman
+      for (const auto &provided : pkg.provides) {
+        loaded.providers[provided].push_back(i);
+      }
+      for (const auto &replaced : pkg.replaces) {
+        loaded.replacedBy[replaced].push_back(i);
+      }
+    }
+    return loaded;
+  }();
+  return db;
+}
+
+// Names and provides of everything installed in the current target
+std::unordered_set<std::string> installedProvisions() {
+  std::unordered_set<std::string> provisions;
+  std::error_code ec;
+  for (const auto &entry :
+       fs::directory_iterator(targetRoot + "/var/lib/pacman/local", ec)) {
+    std::istringstream desc(readFileContents(entry.path() / "desc"));
+    std::string line, key;
+    while (std::getline(desc, line)) {
+      if (line.empty()) {
+        key.clear();
+      } else if (line.front() == '%') {
+        key = line;
+      } else if (key == "%NAME%" || key == "%PROVIDES%") {
+        provisions.insert(stripVersionConstraint(line));
+      }
+    }
+  }
+  return provisions;
+}
+
+// Sync package satisfying a dependency: by name, then by provides, then a
+// package that replaces it
+std::optional<size_t> findSyncProvider(const SyncDatabase &db,
+                                       const std::string &dependency) {
+  if (auto byName = db.byName.find(dependency); byName != db.byName.end()) {
+    return byName->second;
+  }
+  if (auto provider = db.providers.find(dependency);
+      provider != db.providers.end()) {
+    return provider->second.front();
+  }
+  if (auto replacement = db.replacedBy.find(dependency);
+      replacement != db.replacedBy.end()) {
+    return replacement->second.front();
+  }
+  return std::nullopt;
+}
+
+// Transitive closure of the requested packages minus what is installed
+ClosureEstimate resolveClosure(const std::vector<std::string> &requested) {
+  return resolveClosure(requested, installedProvisions());
+}
+
+// Transitive closure minus the names and provides in satisfied
+ClosureEstimate resolveClosure(const std::vector<std::string> &requested,
+                               std::unordered_set<std::string> satisfied) {
+  const SyncDatabase &db = syncDatabase();
+  std::unordered_set<std::string> visited;
+  std::vector<std::string> queue;
+  for (const auto &pkg : requested) {
+    queue.push_back(stripVersionConstraint(pkg));
+  }
+
+  ClosureEstimate estimate;
+  while (!queue.empty()) {
+    std::string dependency = queue.back();
+    queue.pop_back();
+    if (!visited.insert(dependency).second || satisfied.count(dependency)) {
+      continue;
+    }
+    auto index = findSyncProvider(db, dependency);
+    if (!index) {
+      estimate.unresolved.push_back(dependency); // AUR or unknown
+      continue;
+    }
+
+    const SyncPackage &pkg = db.packages[*index];
+    satisfied.insert(pkg.name);
+    satisfied.insert(pkg.provides.begin(), pkg.provides.end());
+    estimate.packages.push_back(pkg.name);
+    estimate.installBytes += pkg.installedSize;
+    if (!fs::exists(PACMAN_CACHE_DIR + "/" + pkg.filename)) {
+      estimate.downloadBytes += pkg.compressedSize;
+    }
+    queue.insert(queue.end(), pkg.depends.begin(), pkg.depends.end());
+  }
+
+  estimate.etaSeconds =
+      estimate.downloadBytes / loadRate("download", DEFAULT_DOWNLOAD_RATE) +
+      estimate.installBytes / loadRate("install", DEFAULT_INSTALL_RATE);
+  return estimate;
+}
+
+// Appstream Index
+// Flatpak remotes keep their catalogue as appstream XML on disk. Parsing it
+// here with a streaming tokenizer gives Flatpak apps the same table the sync
+// DBs use, so searches are in-memory lookups instead of a flatpak CLI call
+// that loads the whole catalogue each time.
+
+// Value of one attribute in a tag's raw attribute text
+std::string_view xmlAttribute(std::string_view attributes,
+                              std::string_view name) {
+  for (size_t pos = attributes.find(name); pos != std::string_view::npos;
+       pos = attributes.find(name, pos + 1)) {
+    bool startsWord = pos == 0 || std::isspace(static_cast<unsigned char>(
+                                      attributes[pos - 1]));
+    size_t equals = pos + name.size();
+    if (!startsWord || equals + 1 >= attributes.size() ||
+        attributes[equals] != '=') {
+      continue;
+    }
+    char quote = attributes[equals + 1];
+    size_t end = attributes.find(quote, equals + 2);
+    if (end == std::string_view::npos) {
+      break;
+    }
+    return attributes.substr(equals + 2, end - equals - 2);
+  }
+  return {};
+}
+
+std::string decodeXmlEntities(std::string_view text) {
+  static const std::pair<std::string_view, char> named[] = {
+      {"amp;", '&'},  {"lt;", '<'},    {"gt;", '>'},
+      {"quot;", '"'}, {"apos;", '\''},
+  };
+  std::string decoded;
+  decoded.reserve(text.size());
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] != '&') {
+      decoded += text[i];
+      continue;
+    }
+    std::string_view rest = text.substr(i + 1);
+    bool replaced = false;
+    for (const auto &[entity, character] : named) {
+      if (rest.substr(0, entity.size()) == entity) {
+        decoded += character;
+        i += entity.size();
+        replaced = true;
+        break;
+      }
+    }
+    size_t semicolon = rest.find(';');
+    if (!replaced && rest.size() > 1 && rest[0] == '#' &&
+        semicolon != std::string_view::npos && semicolon < 10) {
+      bool hex = rest[1] == 'x';
+      unsigned long code = std::strtoul(
+          std::string(rest.substr(hex ? 2 : 1, semicolon)).c_str(), nullptr,
+          hex ? 16 : 10);
+      // UTF-8 encode the code point
+      if (code < 0x80) {
+        decoded += static_cast<char>(code);
+      } else if (code < 0x800) {
+        decoded += static_cast<char>(0xC0 | (code >> 6));
+        decoded += static_cast<char>(0x80 | (code & 0x3F));
+      } else if (code < 0x10000) {
+        decoded += static_cast<char>(0xE0 | (code >> 12));
+        decoded += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        decoded += static_cast<char>(0x80 | (code & 0x3F));
+      } else {
+        decoded += static_cast<char>(0xF0 | (code >> 18));
+        decoded += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+        decoded += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        decoded += static_cast<char>(0x80 | (code & 0x3F));
+      }
+      i += semicolon + 1;
+      replaced = true;
+    }
+    if (!replaced) {
+      decoded += '&';
+    }
+  }
+  return decoded;
+}
+
+// Tokenize the next chunk of a document. Complete tags and text runs are
+// handed to the handlers; anything cut off by the chunk boundary waits in
+// state.pending for the next call.
+void feedXmlChunk(XmlParseState &state, std::string_view chunk,
+                  const XmlHandlers &handlers) {
+  state.pending.append(chunk);
+  std::string_view buffer(state.pending);
+  size_t pos = 0;
+  while (pos < buffer.size()) {
+    if (buffer[pos] != '<') {
+      size_t open = buffer.find('<', pos);
+      if (open == std::string_view::npos) {
+        break;
+      }
+      if (handlers.onText) {
+        handlers.onText(buffer.substr(pos, open - pos));
+      }
+      pos = open;
+      continue;
+    }
+
+    std::string_view rest = buffer.substr(pos);
+    if (rest.substr(0, 4) == "<!--") {
+      size_t end = buffer.find("-->", pos + 4);
+      if (end == std::string_view::npos) {
+        break;
+      }
+      pos = end + 3;
+      continue;
+    }
+    if (rest.substr(0, 9) == "<![CDATA[") {
+      size_t end = buffer.find("]]>", pos + 9);
+      if (end == std::string_view::npos) {
+        break;
+      }
+      if (handlers.onText) {
+        handlers.onText(buffer.substr(pos + 9, end - pos - 9));
+      }
+      pos = end + 3;
+      continue;
+    }
+
+    // End of the tag, skipping '>' inside quoted attribute values
+    size_t close = pos + 1;
+    char quote = 0;
+    for (; close < buffer.size(); ++close) {
+      char c = buffer[close];
+      if (quote) {
+        quote = c == quote ? 0 : quote;
+      } else if (c == '"' || c == '\'') {
+        quote = c;
+      } else if (c == '>') {
+        break;
+      }
+    }
+    if (close >= buffer.size()) {
+      break;
+    }
+
+    std::string_view tag = buffer.substr(pos + 1, close - pos - 1);
+    pos = close + 1;
+    if (tag.empty() || tag.front() == '?' || tag.front() == '!') {
+      continue; // declarations and doctypes
+    }
+    if (tag.front() == '/') {
+      tag.remove_prefix(1);
+      if (handlers.onEnd) {
+        handlers.onEnd(tag.substr(0, tag.find_first_of(" \t\r\n")));
+      }
+      continue;
+    }
+    bool selfClosing = tag.back() == '/';
+    if (selfClosing) {
+      tag.remove_suffix(1);
+    }
+    size_t nameEnd = std::min(tag.find_first_of(" \t\r\n"), tag.size());
+    std::string_view name = tag.substr(0, nameEnd);
+    if (handlers.onStart) {
+      handlers.onStart(name, tag.substr(nameEnd));
+    }
+    if (selfClosing && handlers.onEnd) {
+      handlers.onEnd(name);
+    }
+  }
+  state.pending.erase(0, pos);
+}
+
+// Collect the untranslated id, name, summary, latest release and Flatpak
+// bundle of every <component>. Components without an app/ bundle (runtimes,
+// extensions) are skipped.
+void feedAppstreamChunk(AppstreamParseState &state, const std::string &remote,
+                        std::string_view chunk, SyncDatabase &db) {
+  XmlHandlers handlers;
+  handlers.onStart = [&](std::string_view name, std::string_view attributes) {
+    ++state.depth;
+    if (state.depth == 2 && name == "component") {
+      state.current = SyncPackage{};
+      state.current.repo = remote;
+      state.isApp = false;
+    } else if (state.depth == 3 &&
+               (name == "name" || name == "summary" || name == "bundle") &&
+               xmlAttribute(attributes, "xml:lang").empty()) {
+      if (name != "bundle" || xmlAttribute(attributes, "type") == "flatpak") {
+        state.field = name;
+        state.text.clear();
+      }
+    } else if (state.depth == 4 && name == "release" &&
+               state.current.version.empty()) {
+      state.current.version = xmlAttribute(attributes, "version");
+    }
+  };
+  handlers.onText = [&](std::string_view text) {
+    if (!state.field.empty()) {
+      state.text.append(text);
+    }
+  };
+  handlers.onEnd = [&](std::string_view name) {
+    if (state.depth == 3 && !state.field.empty()) {
+      size_t start = state.text.find_first_not_of(" \t\r\n");
+      size_t end = state.text.find_last_not_of(" \t\r\n");
+      std::string value =
+          start == std::string::npos
+              ? ""
+              : decodeXmlEntities(std::string_view(state.text).substr(
+                    start, end - start + 1));
+      if (state.field == "name") {
+        state.current.title = value;
+      } else if (state.field == "summary") {
+        state.current.description = value;
+      } else if (value.rfind("app/", 0) == 0) {
+        // app/<application id>/<arch>/<branch>
+        state.current.name = value.substr(4, value.find('/', 4) - 4);
+        state.isApp = true;
+      }
+      state.field.clear();
+    } else if (state.depth == 2 && name == "component" && state.isApp) {
+      db.packages.push_back(std::move(state.current));
+    }
+    --state.depth;
+  };
+  feedXmlChunk(state.xml, chunk, handlers);
+}
+
+// (remote, appstream file) for every remote of the system and user
+// installations, for this machine's architecture
+std::vector<std::pair<std::string, std::string>> appstreamFiles() {
+  utsname machine{};
+  uname(&machine);
+  std::vector<std::pair<std::string, std::string>> files;
+  std::error_code ec;
+  for (const std::string &base :
+       {targetRoot + "/var/lib/flatpak/appstream",
+        homeDirectory() + "/.local/share/flatpak/appstream"}) {
+    for (const auto &remote : fs::directory_iterator(base, ec)) {
+      fs::path active = remote.path() / machine.machine / "active";
+      for (const char *name : {"appstream.xml.gz", "appstream.xml"}) {
+        if (fs::exists(active / name, ec)) {
+          files.emplace_back(remote.path().filename().string(),
+                             (active / name).string());
+          break;
+        }
+      }
+    }
+  }
+  return files;
+}
+
+// Every Flatpak app in the local appstream data. The parse is kept until
+// one of the files changes: flatpak swaps the active link to a new
+// checkout when it refreshes a remote, which changes both the resolved
+// path and its modification time.
+const SyncDatabase &appstreamDatabase() {
+  static SyncDatabase db;
+  static std::string loadedStamp = "\n"; // matches no real stamp
+
+  auto files = appstreamFiles();
+  std::string stamp;
+  std::error_code ec;
+  for (const auto &[remote, path] : files) {
+    stamp += fs::canonical(path, ec).string() + " " +
+             std::to_string(
+                 fs::last_write_time(path, ec).time_since_epoch().count()) +
+             "\n";
+  }
+  if (stamp == loadedStamp) {
+    return db;
+  }
+
+  db = SyncDatabase{};
+  for (const auto &[remote, path] : files) {
+    AppstreamParseState state;
+    std::string reader = path.size() > 3 &&
+                                 path.compare(path.size() - 3, 3, ".gz") == 0
+                             ? "gzip -dc "
+                             : "cat ";
+    streamCommandChunks(reader + shellQuote(path) + " 2>/dev/null",
+                        [&](std::string_view chunk) {
+                          feedAppstreamChunk(state, remote, chunk, db);
+                        });
+  }
+  for (size_t i = 0; i < db.packages.size(); ++i) {
+    db.byName.emplace(db.packages[i].name, i); // first remote wins
+  }
+  loadedStamp = stamp;
+  return db;
+}
+
+// Case-insensitive match on application ID, name and summary, as flatpak
+// search does. Returns false when there is no local appstream data.
+bool searchAppstream(const std::string &query,
+                     const std::function<void(PackageStruct &&)> &onResult) {
+  const SyncDatabase &db = appstreamDatabase();
+  if (db.packages.empty()) {
+    return false;
+  }
+  auto contains = [&](const std::string &field) {
+    return std::search(field.begin(), field.end(), query.begin(), query.end(),
+                       [](char a, char b) {
+                         return std::tolower(static_cast<unsigned char>(a)) ==
+                                std::tolower(static_cast<unsigned char>(b));
+                       }) != field.end();
+  };
+  for (size_t i = 0; i < db.packages.size(); ++i) {
+    const SyncPackage &app = db.packages[i];
+    if (db.byName.at(app.name) != i) {
+      continue; // listed once, under the first remote offering it
+    }
+    if (contains(app.name) || contains(app.title) ||
+        contains(app.description)) {
+      onResult(PackageStruct(app.title.empty() ? app.name : app.title,
+                             app.version, app.description,
+                             PackageSource::Flatpak, app.name, app.repo));
+    }
+  }
+  return true;
+}
+
+// Package Index
+// The sync DBs, the AUR name list and the appstream data merged into one
+// binary file that is mapped, not parsed, at startup. It is rebuilt only
+// when one of its sources changes, or when the file is stale or damaged.
+std::string packageIndexPath() {
+  return cacheDirectory() + "/package-index.bin";
+}
+
+// Hash of the name, size and mtime of every file the index is built from
+uint64_t packageIndexStamp() {
+  std::vector<std::string> sources = {cacheDirectory() + "/aur-packages.gz"};
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(pacmanSyncDir(), ec)) {
+    if (entry.path().extension() == ".db") {
+      sources.push_back(entry.path().string());
+    }
+  }
+  for (const auto &[remote, path] : appstreamFiles()) {
+    sources.push_back(fs::canonical(path, ec).string());
+  }
+  std::sort(sources.begin(), sources.end());
+
+  uint64_t stamp = fnv1a64(std::to_string(PACKAGE_INDEX_VERSION));
+  for (const auto &source : sources) {
+    struct stat info{};
+    if (stat(source.c_str(), &info) == 0) {
+      stamp = fnv1a64(source + " " + std::to_string(info.st_size) + " " +
+                          std::to_string(info.st_mtim.tv_sec) + "." +
+                          std::to_string(info.st_mtim.tv_nsec),
+                      stamp);
+    }
+  }
+  return stamp;
+}
+
+// FNV-1a over 64-bit words; cheap enough to verify the whole file on open
+uint64_t indexChecksum(const char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 1099511628211ULL;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Lowercase alphanumeric runs of two or more characters
+template <typename Callback>
+void forEachIndexTerm(std::string_view text, Callback &&onTerm) {
+  std::string term;
+  for (size_t i = 0; i <= text.size(); ++i) {
+    unsigned char c = i < text.size() ? text[i] : ' ';
+    if (std::isalnum(c)) {
+      term += static_cast<char>(std::tolower(c));
+      continue;
+    }
+    if (term.size() >= 2) {
+      onTerm(term);
+    }
+    term.clear();
+  }
+}
+
+bool writePackageIndex(const std::string &path) {
+  // Load the sources before stamping: refreshing the AUR name list changes
+  // its mtime
+  const SyncDatabase &sync = syncDatabase();
+  std::vector<std::string> aurNames(aurPackageIndex().begin(),
+                                    aurPackageIndex().end());
+  std::sort(aurNames.begin(), aurNames.end());
+  const SyncDatabase &apps = appstreamDatabase();
+  uint64_t stamp = packageIndexStamp();
+
+  std::string strings;
+  std::unordered_map<std::string, IndexString> pooled;
+  auto intern = [&](const std::string &value) {
+    auto [entry, added] = pooled.try_emplace(value);
+    if (added) {
+      entry->second = {static_cast<uint32_t>(strings.size()),
+                       static_cast<uint32_t>(value.size())};
+      strings += value;
+    }
+    return entry->second;
+  };
+
+  std::vector<PackageIndexRecord> records;
+  std::unordered_map<std::string, std::vector<uint32_t>> postings;
+  auto addRecord = [&](const SyncPackage &pkg, PackageSource source) {
+    uint32_t id = static_cast<uint32_t>(records.size());
+    records.push_back({intern(pkg.name), intern(pkg.title),
+                       intern(pkg.version), intern(pkg.description),
+                       intern(pkg.repo), static_cast<uint32_t>(source)});
+    for (const std::string *field : {&pkg.name, &pkg.title, &pkg.description}) {
+      forEachIndexTerm(*field, [&](const std::string &term) {
+        auto &list = postings[term];
+        if (list.empty() || list.back() != id) {
+          list.push_back(id);
+        }
+      });
+    }
+  };
+  for (const auto &pkg : sync.packages) {
+    addRecord(pkg, PackageSource::Repo);
+  }
+  SyncPackage aurPackage;
+  aurPackage.repo = "aur";
+  for (const auto &name : aurNames) {
+    aurPackage.name = name;
+    addRecord(aurPackage, PackageSource::Aur);
+  }
+  for (const auto &app : apps.packages) {
+    addRecord(app, PackageSource::Flatpak);
+  }
+
+  std::vector<std::string> termNames;
+  termNames.reserve(postings.size());
+  for (const auto &[term, list] : postings) {
+    termNames.push_back(term);
+  }
+  std::sort(termNames.begin(), termNames.end());
+  std::vector<PackageIndexTerm> terms;
+  std::vector<uint32_t> postingData;
+  for (const auto &term : termNames) {
+    const auto &list = postings[term];
+    terms.push_back({intern(term), static_cast<uint32_t>(postingData.size()),
+                     static_cast<uint32_t>(list.size())});
+    postingData.insert(postingData.end(), list.begin(), list.end());
+  }
+
+  PackageIndexHeader header{};
+  std::memcpy(header.magic, PACKAGE_INDEX_MAGIC, sizeof(header.magic));
+  header.version = PACKAGE_INDEX_VERSION;
+  header.recordCount = static_cast<uint32_t>(records.size());
+  header.sourceStamp = stamp;
+  header.recordsOffset = sizeof(header);
+  header.termsOffset =
+      header.recordsOffset + records.size() * sizeof(PackageIndexRecord);
+  header.postingsOffset =
+      header.termsOffset + terms.size() * sizeof(PackageIndexTerm);
+  header.stringsOffset =
+      header.postingsOffset + postingData.size() * sizeof(uint32_t);
+  header.fileSize = header.stringsOffset + strings.size();
+  header.termCount = static_cast<uint32_t>(terms.size());
+  header.postingCount = static_cast<uint32_t>(postingData.size());
+
+  std::string file(header.fileSize, '\0');
+  std::memcpy(file.data() + header.recordsOffset, records.data(),
+              records.size() * sizeof(PackageIndexRecord));
+  std::memcpy(file.data() + header.termsOffset, terms.data(),
+              terms.size() * sizeof(PackageIndexTerm));
+  std::memcpy(file.data() + header.postingsOffset, postingData.data(),
+              postingData.size() * sizeof(uint32_t));
+  std::memcpy(file.data() + header.stringsOffset, strings.data(),
+              strings.size());
+  header.checksum = indexChecksum(file.data() + sizeof(header),
+                                  file.size() - sizeof(header));
+  std::memcpy(file.data(), &header, sizeof(header));
+
+  // Written beside the old file and renamed over it, so a reader never maps
+  // a half-written index
+  std::error_code ec;
+  fs::create_directories(fs::path(path).parent_path(), ec);
+  std::string partial = path + ".part";
+  {
+    std::ofstream out(partial, std::ios::binary | std::ios::trunc);
+    out.write(file.data(), static_cast<std::streamsize>(file.size()));
+    if (!out) {
+      fs::remove(partial, ec);
+      return false;
+    }
+  }
+  fs::rename(partial, path, ec);
+  return !ec;
+}
+
+// Map an index file. Returns null when it is missing, from another format
+// version, built from different sources, truncated or corrupt.
+std::unique_ptr<PackageIndex> openPackageIndex(const std::string &path,
+                                               uint64_t stamp) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  auto index = std::make_unique<PackageIndex>();
+  struct stat info{};
+  if (fstat(fd, &info) == 0 &&
+      static_cast<size_t>(info.st_size) >= sizeof(PackageIndexHeader)) {
+    index->size = static_cast<size_t>(info.st_size);
+    index->mapping =
+        mmap(nullptr, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (index->mapping == MAP_FAILED) {
+    return nullptr;
+  }
+
+  const char *base = static_cast<const char *>(index->mapping);
+  const auto *header = reinterpret_cast<const PackageIndexHeader *>(base);
+  auto fits = [&](uint64_t offset, uint64_t count, size_t width) {
+    return offset <= index->size && count <= (index->size - offset) / width;
+  };
+  bool valid =
+      std::memcmp(header->magic, PACKAGE_INDEX_MAGIC, sizeof(header->magic)) ==
+          0 &&
+      header->version == PACKAGE_INDEX_VERSION &&
+      header->sourceStamp == stamp && header->fileSize == index->size &&
+      fits(header->recordsOffset, header->recordCount,
+           sizeof(PackageIndexRecord)) &&
+      fits(header->termsOffset, header->termCount, sizeof(PackageIndexTerm)) &&
+      fits(header->postingsOffset, header->postingCount, sizeof(uint32_t)) &&
+      fits(header->stringsOffset, 0, 1) &&
+      header->checksum == indexChecksum(base + sizeof(PackageIndexHeader),
+                                        index->size -
+                                            sizeof(PackageIndexHeader));
+  if (!valid) {
+    return nullptr;
+  }
+
+  index->header = header;
+  index->records = reinterpret_cast<const PackageIndexRecord *>(
+      base + header->recordsOffset);
+  index->terms =
+      reinterpret_cast<const PackageIndexTerm *>(base + header->termsOffset);
+  index->postings =
+      reinterpret_cast<const uint32_t *>(base + header->postingsOffset);
+  index->strings = base + header->stringsOffset;
+  buildFacetBitmaps(*index);
+  return index;
+}
+
+// The current index, rebuilt first if its sources changed since it was
+// written. Null if it can be neither opened nor written.
+const PackageIndex *packageIndex() {
+  static std::unique_ptr<PackageIndex> index;
+  uint64_t stamp = packageIndexStamp();
+  if (index && index->header->sourceStamp == stamp) {
+    return index.get();
+  }
+  std::string path = packageIndexPath();
+  index = openPackageIndex(path, stamp);
+  if (!index && writePackageIndex(path)) {
+    index = openPackageIndex(path, packageIndexStamp());
+  }
+  return index.get();
+}
+
+// Search Queries
+// A search prompt is bare words plus facet filters:
+//   repo:aur installed:no name:^lib32- desc:vulkan
+// The source, repo and installed facets are bitmaps over the index records.
+// They are intersected first, then narrowed by the posting lists of the
+// text terms, and only the surviving records are matched and scored.
+
+// Four words at a time through a vector type: two SSE2 operations per
+// block, or one with AVX, and no intrinsics. The tail is scalar.
+void intersectBitmap(Bitmap &into, const Bitmap &other) {
+  uint64_t *__restrict out = into.data();
+  const uint64_t *__restrict in = other.data();
+  size_t n = into.size();
+  size_t w = 0;
+  for (; w + 4 <= n; w += 4) {
+    BitmapLanes lanes, other;
+    std::memcpy(&lanes, out + w, sizeof(lanes));
+    std::memcpy(&other, in + w, sizeof(other));
+    lanes &= other;
+    std::memcpy(out + w, &lanes, sizeof(lanes));
+  }
+  for (; w < n; ++w) {
+    out[w] &= in[w];
+  }
+}
+
+void uniteBitmap(Bitmap &into, const Bitmap &other) {
+  uint64_t *__restrict out = into.data();
+  const uint64_t *__restrict in = other.data();
+  size_t n = into.size();
+  size_t w = 0;
+  for (; w + 4 <= n; w += 4) {
+    BitmapLanes lanes, other;
+    std::memcpy(&lanes, out + w, sizeof(lanes));
+    std::memcpy(&other, in + w, sizeof(other));
+    lanes |= other;
+    std::memcpy(out + w, &lanes, sizeof(lanes));
+  }
+  for (; w < n; ++w) {
+    out[w] |= in[w];
+  }
+}
+
+Bitmap fullBitmap(size_t bits) {
+  Bitmap bitmap((bits + 63) / 64, ~0ULL);
+  if (bits % 64) {
+    bitmap.back() = (1ULL << (bits % 64)) - 1;
+  }
+  return bitmap;
+}
+
+void buildFacetBitmaps(PackageIndex &index) {
+  uint32_t count = index.header->recordCount;
+  Bitmap empty((count + 63) / 64, 0);
+  index.sourceBitmaps.fill(empty);
+  for (uint32_t r = 0; r < count; ++r) {
+    const PackageIndexRecord &entry = index.records[r];
+    uint64_t bit = 1ULL << (r % 64);
+    if (entry.source < index.sourceBitmaps.size()) {
+      index.sourceBitmaps[entry.source][r / 64] |= bit;
+    }
+    auto [repo, added] =
+        index.repoBitmaps.try_emplace(std::string(index.text(entry.repo)));
+    if (added) {
+      repo->second = empty;
+    }
+    repo->second[r / 64] |= bit;
+  }
+}
+
+// Installing or removing a package or Flatpak app touches one of these
+// directories
+std::string installedStateStamp() {
+  std::string stamp;
+  for (const std::string &dir :
+       {targetRoot + "/var/lib/pacman/local",
+        targetRoot + "/var/lib/flatpak/app",
+        homeDirectory() + "/.local/share/flatpak/app"}) {
+    struct stat info{};
+    if (stat(dir.c_str(), &info) == 0) {
+      stamp += dir + " " + std::to_string(info.st_mtim.tv_sec) + "." +
+               std::to_string(info.st_mtim.tv_nsec) + "\n";
+    }
+  }
+  return stamp;
+}
+
+const Bitmap &installedBitmap(const PackageIndex &index) {
+  std::string stamp = installedStateStamp();
+  if (!index.installedBitmap.empty() && stamp == index.installedStamp) {
+    return index.installedBitmap;
+  }
+  auto packages = localPackageNames();
+  auto apps = installedFlatpakApps();
+  uint32_t count = index.header->recordCount;
+  Bitmap &bitmap = index.installedBitmap;
+  bitmap.assign((count + 63) / 64, 0);
+  for (uint32_t r = 0; r < count; ++r) {
+    const PackageIndexRecord &entry = index.records[r];
+    std::string name(index.text(entry.name));
+    bool installed =
+        static_cast<PackageSource>(entry.source) == PackageSource::Flatpak
+            ? apps.count(name) > 0
+            : packages.count(name) > 0;
+    if (installed) {
+      bitmap[r / 64] |= 1ULL << (r % 64);
+    }
+  }
+  index.installedStamp = stamp;
+  return bitmap;
+}
+
+// Records with a term for every word of the pattern. A superset of the
+// records matching it; patterns without such words match everything.
+// A word with a separator (or anchor) on both sides must be a whole term
+// and one with a separator before it a term prefix, both found by binary
+// search in the sorted term table. Other words are looked for inside every
+// term.
+Bitmap termBitmap(const PackageIndex &index, const std::string &pattern) {
+  Bitmap candidates = fullBitmap(index.header->recordCount);
+  const PackageIndexTerm *begin = index.terms;
+  const PackageIndexTerm *end = index.terms + index.header->termCount;
+  auto addPostings = [&](Bitmap &matches, const PackageIndexTerm &term) {
+    for (uint32_t p = 0; p < term.postingCount; ++p) {
+      uint32_t record = index.postings[term.firstPosting + p];
+      matches[record / 64] |= 1ULL << (record % 64);
+    }
+  };
+  auto isWordChar = [](char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) != 0;
+  };
+
+  for (size_t start = 0; start < pattern.size();) {
+    if (!isWordChar(pattern[start])) {
+      ++start;
+      continue;
+    }
+    size_t stop = start;
+    while (stop < pattern.size() && isWordChar(pattern[stop])) {
+      ++stop;
+    }
+    std::string token = pattern.substr(start, stop - start);
+    bool wholeStart = start > 0;
+    bool wholeEnd = stop < pattern.size();
+    start = stop;
+    if (token.size() < 2) {
+      continue;
+    }
+
+    Bitmap matches(candidates.size(), 0);
+    if (wholeStart) {
+      const PackageIndexTerm *first =
+          std::lower_bound(begin, end, token,
+                           [&](const PackageIndexTerm &term,
+                               const std::string &value) {
+                             return index.text(term.term) < value;
+                           });
+      for (const PackageIndexTerm *term = first; term != end; ++term) {
+        std::string_view text = index.text(term->term);
+        if (text.substr(0, token.size()) != token ||
+            (wholeEnd && text.size() != token.size())) {
+          break;
+        }
+        addPostings(matches, *term);
+      }
+    } else {
+      for (const PackageIndexTerm *term = begin; term != end; ++term) {
+        std::string_view text = index.text(term->term);
+        bool matched =
+            wholeEnd ? text.size() >= token.size() &&
+                           text.substr(text.size() - token.size()) == token
+                     : text.find(token) != std::string_view::npos;
+        if (matched) {
+          addPostings(matches, *term);
+        }
+      }
+    }
+    intersectBitmap(candidates, matches);
+  }
+  return candidates;
+}
+
+// Unknown facets are searched for as plain words
+SearchQuery parseSearchQuery(const std::string &text) {
+  SearchQuery query;
+  std::istringstream split(text);
+  for (std::string token; split >> token;) {
+    std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+    size_t colon = token.find(':');
+    std::string facet =
+        colon == std::string::npos ? "" : token.substr(0, colon);
+    std::string value =
+        colon == std::string::npos ? "" : token.substr(colon + 1);
+    if (facet == "repo") {
+      for (const auto &repo : parse_string(value, ',')) {
+        query.repos.push_back(repo);
+      }
+    } else if (facet == "source") {
+      for (const auto &source : parse_string(value, ',')) {
+        if (source == "repo" || source == "pacman") {
+          query.sources.push_back(PackageSource::Repo);
+        } else if (source == "aur") {
+          query.sources.push_back(PackageSource::Aur);
+        } else if (source == "flatpak") {
+          query.sources.push_back(PackageSource::Flatpak);
+        }
+      }
+    } else if (facet == "installed") {
+      query.installed = value == "yes" || value == "true" || value == "1";
+    } else if (facet == "name" && !value.empty()) {
+      query.namePatterns.push_back(value);
+    } else if (facet == "desc" && !value.empty()) {
+      query.descPatterns.push_back(value);
+    } else {
+      query.words.push_back(token);
+    }
+  }
+  return query;
+}
+
+// The text part of a query, for backends that only take plain words
+std::string searchQueryText(const SearchQuery &query) {
+  std::vector<std::string> parts = query.words;
+  for (const auto *patterns : {&query.namePatterns, &query.descPatterns}) {
+    for (std::string pattern : *patterns) {
+      if (!pattern.empty() && pattern.front() == '^') {
+        pattern.erase(0, 1);
+      }
+      if (!pattern.empty() && pattern.back() == '$') {
+        pattern.pop_back();
+      }
+      parts.push_back(pattern);
+    }
+  }
+  return joinStrings(parts, " ");
+}
+
+// Case-insensitive substring match; ^ and $ anchor the lowercase pattern
+bool matchesPattern(std::string_view field, const std::string &pattern) {
+  std::string_view needle(pattern);
+  bool atStart = !needle.empty() && needle.front() == '^';
+  if (atStart) {
+    needle.remove_prefix(1);
+  }
+  bool atEnd = !needle.empty() && needle.back() == '$';
+  if (atEnd) {
+    needle.remove_suffix(1);
+  }
+  if (needle.size() > field.size()) {
+    return false;
+  }
+  auto equalAt = [&](size_t offset) {
+    for (size_t i = 0; i < needle.size(); ++i) {
+      if (std::tolower(static_cast<unsigned char>(field[offset + i])) !=
+          needle[i]) {
+        return false;
+      }
+    }
+    return true;
+  };
+  if (atStart || atEnd) {
+    return (!atStart || equalAt(0)) &&
+           (!atEnd || equalAt(field.size() - needle.size()));
+  }
+  for (size_t offset = 0; offset + needle.size() <= field.size(); ++offset) {
+    if (equalAt(offset)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Score of a package against the text part of a query, or nullopt if it
+// does not match. Exact and prefix name matches rank above name substrings,
+// which rank above title and description matches, and shorter names win
+// among equal matches.
+std::optional<double> scoreSearchMatch(std::string_view name,
+                                       std::string_view title,
+                                       std::string_view description,
+                                       const SearchQuery &query) {
+  double score = 0.0;
+  // A Flatpak app's display name counts as its name
+  std::string_view shownName = title.empty() ? name : title;
+  for (const auto &word : query.words) {
+    if (matchesPattern(name, "^" + word + "$") ||
+        matchesPattern(shownName, "^" + word + "$")) {
+      score += 100;
+    } else if (matchesPattern(name, "^" + word) ||
+               matchesPattern(shownName, "^" + word)) {
+      score += 50;
+    } else if (matchesPattern(name, word)) {
+      score += 25;
+    } else if (matchesPattern(title, word)) {
+      score += 15;
+    } else if (matchesPattern(description, word)) {
+      score += 5;
+    } else {
+      return std::nullopt;
+    }
+  }
+  for (const auto &pattern : query.namePatterns) {
+    if (!matchesPattern(name, pattern) && !matchesPattern(title, pattern)) {
+      return std::nullopt;
+    }
+  }
+  for (const auto &pattern : query.descPatterns) {
+    if (!matchesPattern(description, pattern)) {
+      return std::nullopt;
+    }
+  }
+  if (!query.words.empty()) {
+    score += 10.0 / (1.0 + shownName.size());
+  }
+  return score;
+}
+
+// Matching records, best first; ties keep index order (repos, AUR,
+// Flatpak)
+std::vector<SearchHit> searchPackageIndex(const PackageIndex &index,
+                                          const SearchQuery &query) {
+  Bitmap candidates = fullBitmap(index.header->recordCount);
+  if (!query.sources.empty()) {
+    Bitmap sources(candidates.size(), 0);
+    for (PackageSource source : query.sources) {
+      uniteBitmap(sources, index.sourceBitmaps[static_cast<size_t>(source)]);
+    }
+    intersectBitmap(candidates, sources);
+  }
+  if (!query.repos.empty()) {
+    Bitmap repos(candidates.size(), 0);
+    for (const auto &repo : query.repos) {
+      if (auto found = index.repoBitmaps.find(repo);
+          found != index.repoBitmaps.end()) {
+        uniteBitmap(repos, found->second);
+      }
+    }
+    intersectBitmap(candidates, repos);
+  }
+  if (query.installed) {
+    Bitmap installed = installedBitmap(index);
+    // installed:no keeps the records missing from the installed bitmap
+    if (!*query.installed) {
+      Bitmap all = fullBitmap(index.header->recordCount);
+      for (size_t w = 0; w < installed.size(); ++w) {
+        installed[w] = all[w] & ~installed[w];
+      }
+    }
+    intersectBitmap(candidates, installed);
+  }
+  for (const auto *patterns :
+       {&query.words, &query.namePatterns, &query.descPatterns}) {
+    for (const auto &pattern : *patterns) {
+      intersectBitmap(candidates, termBitmap(index, pattern));
+    }
+  }
+
+  std::vector<SearchHit> hits;
+  for (size_t w = 0; w < candidates.size(); ++w) {
+    for (uint64_t bits = candidates[w]; bits; bits &= bits - 1) {
+      uint32_t record = static_cast<uint32_t>(w * 64 + __builtin_ctzll(bits));
+      const PackageIndexRecord &entry = index.records[record];
+      if (auto score = scoreSearchMatch(
+              index.text(entry.name), index.text(entry.title),
+              index.text(entry.description), query)) {
+        hits.push_back({record, *score});
+      }
+    }
+  }
+  std::stable_sort(hits.begin(), hits.end(),
+                   [](const SearchHit &a, const SearchHit &b) {
+                     return a.score > b.score;
+                   });
+  return hits;
+}
+
+PackageStruct indexedPackage(const PackageIndex &index, uint32_t record) {
+  const PackageIndexRecord &entry = index.records[record];
+  auto source = static_cast<PackageSource>(entry.source);
+  std::string name(index.text(entry.name));
+  std::string title(index.text(entry.title));
+  if (source == PackageSource::Flatpak) {
+    return PackageStruct(title.empty() ? name : title,
+                         std::string(index.text(entry.version)),
+                         std::string(index.text(entry.description)), source,
+                         name, std::string(index.text(entry.repo)));
+  }
+  return PackageStruct(name, std::string(index.text(entry.version)),
+                       std::string(index.text(entry.description)), source);
+}
+
+// Transfer Rates
+// Exponential moving averages in <state>/rates, one "kind bytes/s" per line.
+// download comes from mirror benchmarks, install from timed transactions.
+double loadRate(const std::string &kind, double fallback) {
+  std::istringstream rates(readFileContents(stateDirectory() + "/rates"));
+  std::string name;
+  double value = 0;
+  while (rates >> name >> value) {
+    if (name == kind && value > 0) {
+      return value;
+    }
+  }
+  return fallback;
+}
+
+void recordRate(const std::string &kind, double bytesPerSecond) {
+  static std::mutex ratesMutex;
+  if (bytesPerSecond <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(ratesMutex);
+  std::string path = stateDirectory() + "/rates";
+  std::map<std::string, double> rates;
+  std::istringstream existing(readFileContents(path));
+  std::string name;
+  double value = 0;
+  while (existing >> name >> value) {
+    rates[name] = value;
+  }
+  rates[kind] = rates.count(kind) ? (rates[kind] + bytesPerSecond) / 2
+                                  : bytesPerSecond;
+
+  std::error_code ec;
+  fs::create_directories(stateDirectory(), ec);
+  std::ofstream file(path, std::ios::trunc);
+  for (const auto &[rateName, rate] : rates) {
+    file << rateName << " " << std::fixed << std::setprecision(0) << rate
+         << "\n";
+  }
+}
+
+std::string formatBytes(uintmax_t bytes) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+  if (bytes >= 1024ULL * 1024 * 1024) {
+    out << bytes / (1024.0 * 1024 * 1024) << " GiB";
+  } else {
+    out << bytes / (1024.0 * 1024) << " MiB";
+  }
+  return out.str();
+}
+
+std::string formatDuration(double seconds) {
+  int total = static_cast<int>(seconds + 0.5);
+  std::ostringstream out;
+  out << total / 60 << ":" << std::setw(2) << std::setfill('0') << total % 60;
+  return out.str();
+}
+
+// Refuse to start a transaction that cannot fit: installed size on the
+// target's filesystem, download size on the package cache's
+bool preflightDiskSpace(const ClosureEstimate &estimate) {
+  std::string rootPath = targetRoot.empty() ? "/" : targetRoot;
+  struct stat rootStat {}, cacheStat {};
+  std::error_code rootError, cacheError;
+  uintmax_t rootFree = fs::space(rootPath, rootError).available;
+  uintmax_t cacheFree = fs::space(PACMAN_CACHE_DIR, cacheError).available;
+  bool sameDevice = stat(rootPath.c_str(), &rootStat) == 0 &&
+                    stat(PACMAN_CACHE_DIR.c_str(), &cacheStat) == 0 &&
+                    rootStat.st_dev == cacheStat.st_dev;
+  if (rootError || cacheError) {
+    return true; // cannot tell, let pacman decide
+  }
+
+  // pacman needs some headroom beyond the package sizes
+  uintmax_t rootNeeded = estimate.installBytes + estimate.installBytes / 10 +
+                         (sameDevice ? estimate.downloadBytes : 0);
+  if (rootFree < rootNeeded ||
+      (!sameDevice && cacheFree < estimate.downloadBytes)) {
+    std::cerr << ERROR_COLOR << "Not enough disk space: need "
+              << formatBytes(rootNeeded) << " on " << rootPath << " ("
+              << formatBytes(rootFree) << " free)";
+    if (!sameDevice) {
+      std::cerr << " and " << formatBytes(estimate.downloadBytes) << " in "
+                << PACMAN_CACHE_DIR << " (" << formatBytes(cacheFree)
+                << " free)";
+    }
+    std::cerr << ".\n" << RESET_COLOR;
+    return false;
+  }
+  return true;
+}
+
+// Provider Router
+// Every package is looked up once, before anything runs, in the sync DBs,
+// the AUR package index and the Flatpak remotes, and sent straight to the
+// cheapest installer that can provide it: repo binary, cached AUR build, AUR
+// source build, then Flatpak. The AUR and Flatpak indexes are only loaded
+// for names the sync DBs miss, so a plan of repo packages needs no network.
+// Names that more than one source could satisfy are reported with the plan.
+const std::string AUR_INDEX_URL = "https://aur.archlinux.org/packages.gz";
+constexpr auto AUR_INDEX_MAX_AGE = std::chrono::hours(24);
+// The index only refines the plan, so give up on it quickly
+const FetchPolicy AUR_INDEX_POLICY{2,
+                                   std::chrono::milliseconds(500),
+                                   std::chrono::milliseconds(2000),
+                                   std::chrono::seconds(20),
+                                   std::chrono::seconds(10),
+                                   false};
+
+// Names of every AUR package, from a copy of packages.gz refreshed daily.
+// Empty when the index cannot be fetched.
+const std::unordered_set<std::string> &aurPackageIndex() {
+  static const std::unordered_set<std::string> index = [] {
+    std::string path = cacheDirectory() + "/aur-packages.gz";
+    std::error_code ec;
+    auto modified = fs::last_write_time(path, ec);
+    if (bundlePath.empty() &&
+        (ec ||
+         fs::file_time_type::clock::now() - modified > AUR_INDEX_MAX_AGE)) {
+      fs::create_directories(cacheDirectory(), ec);
+      fetchUrl({AUR_INDEX_URL}, path, AUR_INDEX_POLICY);
+    }
+
+    std::unordered_set<std::string> names;
+    streamCommandLines("gzip -dc " + path + " 2>/dev/null",
+                       [&](std::string_view line) {
+                         if (!line.empty() && line.front() != '#') {
+                           names.emplace(line);
+                         }
+                       });
+    return names;
+  }();
+  return index;
+}
+
+// Application IDs offered by the configured Flatpak remotes, loaded once
+const std::unordered_map<std::string, std::string> &flatpakAppIndex() {
+  static const std::unordered_map<std::string, std::string> index = [] {
+    std::unordered_map<std::string, std::string> apps; // app id -> remote
+    if (!targetHasCommand("flatpak")) {
+      return apps;
+    }
+    for (const auto &remote : parse_string(
+             captureCommandOutput(
+                 targetCommand("flatpak remotes --columns=name", false) +
+                 " 2>/dev/null"),
+             '\n')) {
+      if (remote.empty()) {
+        continue;
+      }
+      streamCommandLines(targetCommand("flatpak remote-ls --app "
+                                       "--columns=application " +
+                                           remote,
+                                       false) +
+                             " 2>/dev/null",
+                         [&](std::string_view line) {
+                           apps.emplace(std::string(line), remote);
+                         });
+    }
+    return apps;
+  }();
+  return index;
+}
+
+// "org.mozilla.firefox" is a Flatpak take on "firefox"
+bool flatpakIdMatches(const std::string &appId, const std::string &name) {
+  size_t dot = appId.rfind('.');
+  if (dot == std::string::npos || appId.size() - dot - 1 != name.size()) {
+    return false;
+  }
+  return std::equal(name.begin(), name.end(), appId.begin() + dot + 1,
+                    [](char a, char b) {
+                      return std::tolower(static_cast<unsigned char>(a)) ==
+                             std::tolower(static_cast<unsigned char>(b));
+                    });
+}
+
+// Built artifacts of any version of this package in the AUR cache
+bool aurCacheHas(const std::string &name) {
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(aurCacheRoot(), ec)) {
+    std::string entryName = entry.path().filename().string();
+    // <name>-<16 hex digit key>
+    if (entryName.size() == name.size() + 17 &&
+        entryName.compare(0, name.size() + 1, name + "-") == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string providerName(PackageProvider provider) {
+  switch (provider) {
+  case PackageProvider::Installed:
+    return "installed";
+  case PackageProvider::Repo:
+    return "repo";
+  case PackageProvider::AurCached:
+    return "AUR (cached build)";
+  case PackageProvider::AurSource:
+    return "AUR";
+  case PackageProvider::Flatpak:
+    return "Flatpak";
+  default:
+    return "not found";
+  }
+}
+
+ProviderRoute routePackage(const std::string &requested,
+                           const std::unordered_set<std::string> &installed) {
+  std::string name = stripVersionConstraint(requested);
+  ProviderRoute route{requested, PackageProvider::Unknown, "", {}};
+  if (installed.count(name)) {
+    route.provider = PackageProvider::Installed;
+    return route;
+  }
+
+  const SyncDatabase &db = syncDatabase();
+  if (auto byName = db.byName.find(name); byName != db.byName.end()) {
+    route.provider = PackageProvider::Repo;
+    route.detail = db.packages[byName->second].repo;
+    return route;
+  }
+  if (auto providers = db.providers.find(name);
+      providers != db.providers.end()) {
+    // pacman would ask which provider to use; take the first and say so
+    const SyncPackage &chosen = db.packages[providers->second.front()];
+    route.provider = PackageProvider::Repo;
+    route.detail = chosen.repo + "/" + chosen.name;
+    for (size_t i = 1; i < providers->second.size(); ++i) {
+      const SyncPackage &other = db.packages[providers->second[i]];
+      route.alternatives.push_back(other.repo + "/" + other.name);
+    }
+    return route;
+  }
+  if (auto replacement = db.replacedBy.find(name);
+      replacement != db.replacedBy.end()) {
+    const SyncPackage &chosen = db.packages[replacement->second.front()];
+    route.provider = PackageProvider::Repo;
+    route.detail = chosen.repo + "/" + chosen.name + " (replaces " + name + ")";
+    route.name = chosen.name;
+    return route;
+  }
+
+  // Only names the local and sync databases do not know reach the AUR and
+  // Flatpak indexes, which may have to be fetched
+  const auto &aur = aurPackageIndex();
+  // Without an AUR index, anything not in the repos is tried as AUR
+  if (aur.count(name) ||
+      (aur.empty() && name.find('.') == std::string::npos)) {
+    route.provider = aurCacheHas(name) ? PackageProvider::AurCached
+                                       : PackageProvider::AurSource;
+    for (const auto &[appId, remote] : flatpakAppIndex()) {
+      if (appId == name || flatpakIdMatches(appId, name)) {
+        route.alternatives.push_back(remote + "/" + appId);
+      }
+    }
+    return route;
+  }
+  if (auto app = flatpakAppIndex().find(name);
+      app != flatpakAppIndex().end()) {
+    route.provider = PackageProvider::Flatpak;
+    route.detail = app->second;
+  }
+  return route;
+}
+
+std::vector<ProviderRoute>
+routePackages(const std::vector<std::string> &packageNames) {
+  auto installed = installedProvisions();
+  std::vector<ProviderRoute> routes;
+  for (const auto &pkg : packageNames) {
+    routes.push_back(routePackage(pkg, installed));
+  }
+  return routes;
+}
+
+// One line per provider, plus every ambiguity and unknown package
+void printRoutePlan(const std::vector<ProviderRoute> &routes) {
+  std::map<PackageProvider, std::vector<std::string>> byProvider;
+  for (const auto &route : routes) {
+    byProvider[route.provider].push_back(route.name);
+  }
+  for (const auto &[provider, names] : byProvider) {
+    if (provider == PackageProvider::Installed) {
+      continue;
+    }
+    std::cout << (provider == PackageProvider::Unknown ? ERROR_COLOR
+                                                       : INPUT_COLOR)
+              << providerName(provider) << ": " << joinStrings(names, " ")
+              << "\n"
+              << RESET_COLOR;
+  }
+  for (const auto &route : routes) {
+    if (!route.alternatives.empty()) {
+      std::cout << OPTION_COLOR << "Ambiguous: " << route.name << " -> "
+                << providerName(route.provider)
+                << (route.detail.empty() ? "" : " " + route.detail)
+                << ", also in " << joinStrings(route.alternatives, ", ")
+                << "\n"
+                << RESET_COLOR;
+    }
+  }
+}
+
+// Install routed Flatpak apps, one transaction per remote
+bool installFlatpakApps(const std::vector<ProviderRoute> &routes) {
+  std::map<std::string, std::vector<std::string>> byRemote;
+  for (const auto &route : routes) {
+    if (route.provider == PackageProvider::Flatpak) {
+      byRemote[route.detail].push_back(stripVersionConstraint(route.name));
+    }
+  }
+  return installFlatpakRefs(byRemote);
+}
+
+// Native Flatpak backend: all refs from one remote go into a single
+// non-interactive transaction, so runtimes they share are resolved and
+// downloaded once
+bool installFlatpakRefs(
+    const std::map<std::string, std::vector<std::string>> &refsByRemote) {
+  bool allInstalled = true;
+  for (const auto &[remote, refs] : refsByRemote) {
+    std::string what =
+        std::to_string(refs.size()) + " Flatpak apps from " + remote;
+    std::string command =
+        targetCommand("flatpak install --noninteractive --or-update " +
+                          remote + " " + joinStrings(refs, " "),
+                      true);
+    bool installed;
+    if (verboseMode) {
+      std::cout << INPUT_COLOR << "Installing " << what << "...\n"
+                << RESET_COLOR;
+      installed = runQuietCommand(command);
+      if (!installed) {
+        std::cerr << ERROR_COLOR << "flatpak install from " << remote
+                  << " failed.\n"
+                  << RESET_COLOR;
+      }
+    } else {
+      auto lane = beginProgressLane("flatpak: " + what);
+      installed = runQuietCommand(command, lane.get());
+      endProgressLane(lane, installed,
+                      installed ? "Installed " + what
+                                : "flatpak install from " + remote +
+                                      " failed");
+    }
+    allInstalled = installed && allInstalled;
+  }
+  return allInstalled;
+}
+
+std::unordered_set<std::string> installedFlatpakApps() {
+  std::unordered_set<std::string> apps;
+  if (!targetHasCommand("flatpak")) {
+    return apps;
+  }
+  streamCommandLines(
+      targetCommand("flatpak list --app --columns=application", false) +
+          " 2>/dev/null",
+      [&](std::string_view line) { apps.emplace(line); });
+  return apps;
+}
+
+// Hand each selected search result to the backend its source names: repo
+// packages to one pacman transaction, AUR packages to the build stage,
+// Flatpak refs to one transaction per remote
+bool installSearchResults(const std::vector<PackageStruct> &selected) {
+  std::vector<std::string> repoPackages;
+  std::vector<std::string> aurPackages;
+  std::map<std::string, std::vector<std::string>> flatpakRefs;
+  for (const auto &pkg : selected) {
+    switch (pkg.source) {
+    case PackageSource::Repo:
+      repoPackages.push_back(pkg.name);
+      break;
+    case PackageSource::Aur:
+      aurPackages.push_back(pkg.name);
+      break;
+    case PackageSource::Flatpak:
+      flatpakRefs[pkg.remote.empty() ? "flathub" : pkg.remote].push_back(
+          pkg.ref);
+      break;
+    }
+  }
+
+  bool allInstalled = true;
+  if (!repoPackages.empty()) {
+    allInstalled = installPackages(repoPackages, "--needed");
+  }
+  if (!aurPackages.empty()) {
+    allInstalled = installAurPackages(aurPackages) && allInstalled;
+  }
+  return installFlatpakRefs(flatpakRefs) && allInstalled;
+}
+
+// AUR Build Stage
+const std::string AUR_BUILD_ROOT = "/tmp/arch-setup-aur";
+std::mutex aurOutputMutex;
+// Build dependencies go into the host; concurrent target roots take turns
+std::mutex hostPacmanMutex;
+
+// Build directory root, separate per target root so concurrent image builds
+// never share a checkout
+std::string aurBuildRoot() {
+  return targetRoot.empty() ? AUR_BUILD_ROOT
+                            : AUR_BUILD_ROOT + "/" +
+                                  toHex(fnv1a64(targetRoot)).substr(0, 8);
+}
+
+// makepkg refuses to run as root. Root runs build as --user, or else as the
+// user who ran sudo: "" when we are not root, nullopt when no unprivileged
+// user is known.
+const std::optional<std::string> &aurBuildUser() {
+  static const std::optional<std::string> user =
+      []() -> std::optional<std::string> {
+    if (geteuid() != 0) {
+      return "";
+    }
+    const char *sudoUser = std::getenv("SUDO_USER");
+    for (const std::string &name :
+         {targetUserName, std::string(sudoUser ? sudoUser : "")}) {
+      std::string uid = captureCommandOutput("id -u " + shellQuote(name) +
+                                             " 2>/dev/null");
+      if (!name.empty() && !uid.empty() && uid != "0\n") {
+        return name;
+      }
+    }
+    return std::nullopt;
+  }();
+  return user;
+}
+
+// A makepkg command line, run as the AUR build user
+std::string asAurBuildUser(const std::string &command) {
+  const std::string &user = aurBuildUser().value_or("");
+  if (user.empty()) {
+    return command;
+  }
+  return "runuser -u " + shellQuote(user) + " -- sh -c " + shellQuote(command);
+}
+
+// Clone the AUR repository of a target and read its .SRCINFO
+bool prepareAurTarget(AurBuildTarget &target) {
+  target.buildDir = aurBuildRoot() + "/" + target.name;
+  fs::remove_all(target.buildDir);
+
+  if (!cloneRepository("https://aur.archlinux.org/" + target.name + ".git",
+                       target.buildDir, {true, {}})) {
+    return false;
+  }
+
+  std::ifstream srcinfo(target.buildDir + "/.SRCINFO");
+  if (!srcinfo.is_open()) {
+    // An empty clone means the package does not exist on the AUR
+    return false;
+  }
+  // makepkg writes into the checkout as the build user
+  const std::string &buildUser = aurBuildUser().value_or("");
+  if (!buildUser.empty() &&
+      !isCommandSuccessful("chown -R " + shellQuote(buildUser) + ": " +
+                           shellQuote(target.buildDir))) {
+    return false;
+  }
+
+  target.cacheKey = toHex(
+      fnv1a64(readFileContents(target.buildDir + "/.SRCINFO"),
+              fnv1a64(readFileContents(target.buildDir + "/PKGBUILD"),
+                      fnv1a64(toolchainVersion()))));
+
+  std::string line;
+  while (std::getline(srcinfo, line)) {
+    size_t separator = line.find(" = ");
+    if (separator == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, separator);
+    key.erase(0, key.find_first_not_of(" \t"));
+    std::string value = line.substr(separator + 3);
+
+    // Architecture specific keys look like depends_x86_64
+    if (key.rfind("depends", 0) == 0) {
+      target.dependencies.push_back(value);
+      target.runtimeDependencies.push_back(value);
+    } else if (key.rfind("makedepends", 0) == 0) {
+      target.dependencies.push_back(value);
+    } else if (key.rfind("provides", 0) == 0) {
+      target.provides.push_back(stripVersionConstraint(value));
+    }
+  }
+  return true;
+}
+
+// The dependencies pacman (with its --root and --dbpath) finds unsatisfied
+std::vector<std::string>
+unsatisfiedDependencies(const std::string &pacman,
+                        const std::vector<std::string> &dependencies) {
+  if (dependencies.empty()) {
+    return {};
+  }
+  // pacman -T prints only the dependencies that are not yet satisfied
+  std::string command = pacman + " -T";
+  for (const auto &dep : dependencies) {
+    command += " " + shellQuote(dep);
+  }
+  std::vector<std::string> missing;
+  std::istringstream output(captureCommandOutput(command));
+  std::string dep;
+  while (std::getline(output, dep)) {
+    missing.push_back(dep);
+  }
+  return missing;
+}
+
+// Build a prepared target with makepkg, output goes to build.log
+bool buildAurTarget(AurBuildTarget &target) {
+  std::string logPath = target.buildDir + "/build.log";
+  if (!isCommandSuccessful(
+          asAurBuildUser("cd " + target.buildDir +
+                         " && makepkg --noconfirm --force --nocheck") +
+          " > " + logPath + " 2>&1")) {
+    return false;
+  }
+
+  std::istringstream packageList(captureCommandOutput(
+      asAurBuildUser("cd " + target.buildDir + " && makepkg --packagelist") +
+      " 2>/dev/null"));
+  std::string artifact;
+  while (std::getline(packageList, artifact)) {
+    if (fs::exists(artifact)) {
+      target.artifacts.push_back(artifact);
+    }
+  }
+  return !target.artifacts.empty();
+}
+
+// Build AUR packages concurrently (up to aurBuildJobs at a time) and install
+// the artifacts of each dependency wave in a single pacman -U transaction
+bool installAurPackages(const std::vector<std::string> &packageNames) {
+  // An offline bundle carries its AUR packages prebuilt in a repository
+  std::vector<std::string> toBuild = packageNames;
+  if (!bundlePath.empty()) {
+    std::vector<std::string> bundled;
+    toBuild.clear();
+    for (const auto &name : packageNames) {
+      (syncPackageNames().count(name) ? bundled : toBuild).push_back(name);
+    }
+    if (!bundled.empty() &&
+        !installRepoTransaction(bundled, "--needed",
+                                resolveClosure(bundled).etaSeconds)) {
+      return false;
+    }
+    if (toBuild.empty()) {
+      return true;
+    }
+  }
+
+  if (!aurBuildUser()) {
+    std::cerr << ERROR_COLOR
+              << "makepkg cannot build as root. Run arch-setup through sudo "
+                 "or pass --user NAME of an unprivileged user to build AUR "
+                 "packages.\n"
+              << RESET_COLOR;
+    return false;
+  }
+
+  std::vector<AurBuildTarget> targets;
+  std::unordered_set<std::string> known;
+  for (const auto &name : toBuild) {
+    if (known.insert(name).second) {
+      targets.emplace_back();
+      targets.back().name = name;
+    }
+  }
+
+  waitForPrefetchedPackages();
+  {
+    // makepkg runs on the host, so its toolchain is installed there
+    std::string root = targetRoot;
+    std::lock_guard<std::mutex> hostLock(hostPacmanMutex);
+    targetRoot.clear();
+    installPackage("base-devel", "--needed");
+    installPackage("git", "--needed");
+    targetRoot = root;
+  }
+  fs::create_directories(aurBuildRoot());
+
+  std::cout << INPUT_COLOR << "Preparing " << targets.size()
+            << " AUR package(s)...\n"
+            << RESET_COLOR;
+
+  // Clone targets, pulling in AUR-only dependencies as extra targets
+  std::vector<std::string> repoDependencies;
+  for (size_t prepared = 0; prepared < targets.size();) {
+    size_t batchEnd = targets.size();
+    std::vector<char> ok(batchEnd, 0);
+    runConcurrently(batchEnd - prepared, aurBuildJobs, [&](size_t i) {
+      ok[prepared + i] = prepareAurTarget(targets[prepared + i]);
+    });
+
+    std::vector<std::string> dependencies, runtimeDependencies;
+    for (size_t i = prepared; i < batchEnd; ++i) {
+      if (!ok[i]) {
+        std::cerr << ERROR_COLOR << "Failed to fetch " << targets[i].name
+                  << " from the AUR.\n"
+                  << RESET_COLOR;
+        return false;
+      }
+      dependencies.insert(dependencies.end(),
+                          targets[i].dependencies.begin(),
+                          targets[i].dependencies.end());
+      runtimeDependencies.insert(runtimeDependencies.end(),
+                                 targets[i].runtimeDependencies.begin(),
+                                 targets[i].runtimeDependencies.end());
+    }
+    prepared = batchEnd;
+
+    // makepkg needs every dependency on the host. A target root also needs
+    // the runtime ones; pacman -U resolves those from the repositories, so
+    // only AUR-only ones missing there have to be built, even when the host
+    // already has them.
+    std::vector<std::string> missing =
+        unsatisfiedDependencies("pacman", dependencies);
+    if (!targetRoot.empty()) {
+      for (const auto &dep :
+           unsatisfiedDependencies(pacmanCommand(), runtimeDependencies)) {
+        if (!syncPackageNames().count(stripVersionConstraint(dep))) {
+          missing.push_back(dep);
+        }
+      }
+    }
+    for (const auto &dep : missing) {
+      std::string depName = stripVersionConstraint(dep);
+      bool providedByTarget = false;
+      for (const auto &target : targets) {
+        if (target.name == depName ||
+            std::find(target.provides.begin(), target.provides.end(),
+                      depName) != target.provides.end()) {
+          providedByTarget = true;
+        }
+      }
+      if (providedByTarget || !known.insert(depName).second) {
+        continue;
+      }
+      if (syncPackageNames().count(depName)) {
+        repoDependencies.push_back(depName);
+      } else {
+        targets.emplace_back();
+        targets.back().name = depName;
+        targets.back().requestedExplicitly = false;
+      }
+    }
+  }
+
+  if (!repoDependencies.empty()) {
+    std::string depCommand =
+        "sudo " + hostPacmanCommand() + " -S --noconfirm --needed --asdeps";
+    for (const auto &dep : repoDependencies) {
+      depCommand += " " + dep;
+    }
+    std::unique_lock<std::mutex> hostLock(hostPacmanMutex);
+    if (!runQuietCommand(depCommand)) {
+      std::cerr << ERROR_COLOR
+                << "Failed to install build dependencies for AUR packages.\n"
+                << RESET_COLOR;
+      return false;
+    }
+  }
+
+  // A target is ready once none of its dependencies is still waiting to be
+  // built, so independent targets share a wave and build side by side
+  std::vector<AurBuildTarget *> pending;
+  for (auto &target : targets) {
+    pending.push_back(&target);
+  }
+
+  bool allInstalled = true;
+  while (!pending.empty()) {
+    std::vector<AurBuildTarget *> wave, blocked;
+    for (auto *target : pending) {
+      bool ready = true;
+      for (const auto &dep : target->dependencies) {
+        std::string depName = stripVersionConstraint(dep);
+        for (const auto *other : pending) {
+          if (other != target &&
+              (other->name == depName ||
+               std::find(other->provides.begin(), other->provides.end(),
+                         depName) != other->provides.end())) {
+            ready = false;
+          }
+        }
+      }
+      (ready ? wave : blocked).push_back(target);
+    }
+    if (wave.empty()) {
+      std::cerr << ERROR_COLOR
+                << "Circular dependency between AUR packages. Aborting.\n"
+                << RESET_COLOR;
+      return false;
+    }
+
+    // makepkg writes to build.log, so each build can have a lane in
+    // verbose mode too
+    runConcurrently(wave.size(), aurBuildJobs, [&](size_t i) {
+      AurBuildTarget &target = *wave[i];
+      auto lane = beginProgressLane("makepkg: " + target.name);
+      if (restoreAurFromCache(target)) {
+        target.success = true;
+        endProgressLane(lane, true,
+                        target.name + " is unchanged, using the cached build");
+        return;
+      }
+      target.success = buildAurTarget(target);
+      if (target.success) {
+        storeAurInCache(target);
+      }
+      endProgressLane(lane, target.success,
+                      target.success ? target.name + " built"
+                                     : "Failed to build " + target.name +
+                                           ". See " + target.buildDir +
+                                           "/build.log");
+    });
+
+    std::string installCommand =
+        "sudo " + pacmanCommand() + " -U --noconfirm --needed";
+    std::string asDepsCommand = "sudo " + pacmanCommand() + " -D --asdeps";
+    bool anyArtifacts = false, anyDeps = false;
+    for (const auto *target : wave) {
+      if (!target->success) {
+        allInstalled = false;
+        continue;
+      }
+      for (const auto &artifact : target->artifacts) {
+        installCommand += " " + artifact;
+        anyArtifacts = true;
+      }
+      if (!target->requestedExplicitly) {
+        asDepsCommand += " " + target->name;
+        anyDeps = true;
+      }
+    }
+
+    if (anyArtifacts) {
+      if (runQuietCommand(installCommand)) {
+        if (anyDeps && !runQuietCommand(asDepsCommand)) {
+          std::cerr << ERROR_COLOR << "Command failed: " << asDepsCommand
+                    << RESET_COLOR << std::endl;
+        }
+      } else {
+        std::cerr << ERROR_COLOR << "pacman -U failed for built AUR packages.\n"
+                  << RESET_COLOR;
+        allInstalled = false;
+      }
+    }
+    pending = blocked;
+  }
+
+  pruneAurCache();
+
+  for (const auto &target : targets) {
+    if (target.success) {
+      fs::remove_all(target.buildDir);
+      if (target.requestedExplicitly) {
+        std::cout << SUCCESS_COLOR << target.name
+                  << " installed successfully from the AUR.\n"
+                  << RESET_COLOR;
+      }
+    }
+  }
+  return allInstalled;
+}
+
+// AUR Build Cache
+// Built packages live in <cache>/<name>-<key>/, where the key hashes the
+// PKGBUILD, .SRCINFO and toolchain. With --aur-cache-repo the artifacts are
+// also hard linked into <cache>/repo and registered with repo-add, so the
+// directory can be served to other machines as a pacman repository.
+const std::string AUR_CACHE_REPO_DB = "arch-setup-aur.db.tar.gz";
+
+// 64-bit FNV-1a, chainable through the seed
+uint64_t fnv1a64(const std::string &data, uint64_t hash) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::string toHex(uint64_t value) {
+  std::ostringstream out;
+  out << std::hex << std::setw(16) << std::setfill('0') << value;
+  return out.str();
+}
+
+std::string readFileContents(const std::string &filePath) {
+  std::ifstream file(filePath, std::ios::binary);
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+// $XDG_CACHE_HOME/arch-setup, falling back to ~/.cache/arch-setup. Always
+// on the host, so every target root shares one cache.
+std::string cacheDirectory() {
+  const char *xdgCache = std::getenv("XDG_CACHE_HOME");
+  const char *home = std::getenv("HOME");
+  std::string base = (xdgCache && *xdgCache)
+                         ? std::string(xdgCache)
+                         : std::string(home ? home : "/root") + "/.cache";
+  return base + "/arch-setup";
+}
+
+std::string aurCacheRoot() {
+  return aurCacheDir.empty() ? cacheDirectory() + "/aur" : aurCacheDir;
+}
+
+// Versions of the packages that shape makepkg output, queried once per run
+const std::string &toolchainVersion() {
+  static const std::string version = captureCommandOutput(
+      "pacman -Q pacman gcc glibc binutils 2>/dev/null");
+  return version;
+}
+
+bool isPackageArtifact(const fs::path &path) {
+  return path.filename().string().find(".pkg.tar") != std::string::npos &&
+         path.extension() != ".sig";
+}
+
+bool restoreAurFromCache(AurBuildTarget &target) {
+  fs::path entry = fs::path(aurCacheRoot()) / (target.name + "-" +
+                                               target.cacheKey);
+  std::error_code ec;
+  if (target.cacheKey.empty() || !fs::is_directory(entry, ec)) {
+    return false;
+  }
+
+  std::vector<std::string> artifacts;
+  for (const auto &file : fs::directory_iterator(entry, ec)) {
+    if (isPackageArtifact(file.path())) {
+      artifacts.push_back(file.path().string());
+    }
+  }
+  if (artifacts.empty()) {
+    return false;
+  }
+
+  // Refresh the entry for LRU eviction, shared read-only caches just skip it
+  fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+  target.artifacts = artifacts;
+  return true;
+}
+
+void storeAurInCache(const AurBuildTarget &target) {
+  fs::path root = aurCacheRoot();
+  fs::path entry = root / (target.name + "-" + target.cacheKey);
+  std::error_code ec;
+
+  // Copy into a staging directory and rename, so machines sharing the cache
+  // never see a half-written entry. mkdtemp keeps concurrent builds of the
+  // same target (other threads or other machines) out of each other's way.
+  fs::create_directories(root, ec);
+  std::string stagingTemplate =
+      (root / (".staging-" + target.name + "-" + target.cacheKey + "-XXXXXX"))
+          .string();
+  if (mkdtemp(stagingTemplate.data()) == nullptr) {
+    return;
+  }
+  fs::path staging = stagingTemplate;
+  fs::permissions(staging, fs::perms(0755), ec); // mkdtemp creates it 0700
+  for (const auto &artifact : target.artifacts) {
+    fs::copy_file(artifact, staging / fs::path(artifact).filename(),
+                  fs::copy_options::overwrite_existing, ec);
+    if (ec) {
+      fs::remove_all(staging, ec);
+      return;
+    }
+  }
+  fs::rename(staging, entry, ec);
+  if (ec) {
+    fs::remove_all(staging, ec);
+    return;
+  }
+
+  if (aurCacheAsRepo) {
+    fs::path repoDir = root / "repo";
+    fs::create_directories(repoDir, ec);
+    std::string repoAddCommand =
+        "repo-add -q -R " + (repoDir / AUR_CACHE_REPO_DB).string();
+    for (const auto &file : fs::directory_iterator(entry, ec)) {
+      fs::path link = repoDir / file.path().filename();
+      fs::remove(link, ec);
+      fs::create_hard_link(file.path(), link, ec);
+      if (ec) {
+        fs::copy_file(file.path(), link, ec);
+      }
+      if (isPackageArtifact(file.path())) {
+        repoAddCommand += " " + link.string();
+      }
+    }
+    std::lock_guard<std::mutex> lock(aurOutputMutex);
+    runCommand(repoAddCommand + " > /dev/null 2>&1");
+  }
+}
+
+// Evict least recently used entries until the cache fits aurCacheLimitMB
+void pruneAurCache() {
+  fs::path root = aurCacheRoot();
+  std::error_code ec;
+  if (!fs::is_directory(root, ec)) {
+    return;
+  }
+
+  struct CacheEntry {
+    fs::path path;
+    fs::file_time_type lastUsed;
+    uintmax_t size;
+  };
+  std::vector<CacheEntry> entries;
+  uintmax_t totalSize = 0;
+
+  for (const auto &dir : fs::directory_iterator(root, ec)) {
+    std::string name = dir.path().filename().string();
+    if (!dir.is_directory() || name == "repo" || name[0] == '.') {
+      continue;
+    }
+    uintmax_t size = 0;
+    for (const auto &file : fs::directory_iterator(dir.path(), ec)) {
+      size += file.file_size(ec);
+    }
+    entries.push_back({dir.path(), fs::last_write_time(dir.path(), ec), size});
+    totalSize += size;
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [](const CacheEntry &a, const CacheEntry &b) {
+              return a.lastUsed < b.lastUsed;
+            });
+
+  // Entry directories are named <package>-<16 hex digit key>
+  auto packageOf = [](const fs::path &entry) {
+    std::string name = entry.filename().string();
+    return name.substr(0, name.size() - 17);
+  };
+
+  uintmax_t limit = aurCacheLimitMB * 1024 * 1024;
+  size_t evicted = 0;
+  for (; evicted < entries.size() && totalSize > limit; ++evicted) {
+    totalSize -= entries[evicted].size;
+  }
+
+  // Several entries can provide the same artifact file name (a rebuild with
+  // unchanged pkgver), so only unlink repo files no kept entry provides
+  if (aurCacheAsRepo) {
+    std::unordered_set<std::string> keptFiles;
+    for (size_t i = evicted; i < entries.size(); ++i) {
+      for (const auto &file : fs::directory_iterator(entries[i].path, ec)) {
+        keptFiles.insert(file.path().filename().string());
+      }
+    }
+    for (size_t i = 0; i < evicted; ++i) {
+      for (const auto &file : fs::directory_iterator(entries[i].path, ec)) {
+        if (!keptFiles.count(file.path().filename().string())) {
+          fs::remove(root / "repo" / file.path().filename(), ec);
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < evicted; ++i) {
+    fs::remove_all(entries[i].path, ec);
+  }
+
+  // Drop evicted packages from the repo database unless a newer build of the
+  // same package is still cached
+  if (aurCacheAsRepo) {
+    for (size_t i = 0; i < evicted; ++i) {
+      std::string package = packageOf(entries[i].path);
+      bool stillCached =
+          std::any_of(entries.begin() + evicted, entries.end(),
+                      [&](const CacheEntry &kept) {
+                        return packageOf(kept.path) == package;
+                      });
+      if (!stillCached) {
+        runCommand("repo-remove -q " +
+                   (root / "repo" / AUR_CACHE_REPO_DB).string() + " " +
+                   package + " > /dev/null 2>&1");
+      }
+    }
+  }
+}
+
+// Fetch Policy
+// Downloads and clones run with a deadline per attempt, are aborted early
+// when the transfer stalls, and are retried after an exponential backoff
+// with full jitter. A download with a known mirror is hedged: once the
+// primary has waited longer than the host's 95th percentile time to first
+// byte without receiving anything, the mirror is asked for the same file and
+// the first complete copy wins. Time to first byte does not grow with the
+// file size, unlike the time of the whole download.
+const FetchPolicy DOWNLOAD_POLICY{};
+const FetchPolicy GIT_POLICY{3,
+                             std::chrono::milliseconds(1000),
+                             std::chrono::milliseconds(15000),
+                             std::chrono::seconds(900),
+                             std::chrono::seconds(60),
+                             false};
+constexpr auto DEFAULT_HEDGE_DELAY = std::chrono::milliseconds(3000);
+constexpr auto MIN_HEDGE_DELAY = std::chrono::milliseconds(250);
+constexpr size_t FETCH_LATENCY_SAMPLES = 32;
+constexpr size_t MIN_HEDGE_SAMPLES = 5;
+constexpr auto CHILD_POLL_INTERVAL = std::chrono::milliseconds(20);
+
+// Run command in its own process group so the whole pipeline can be killed
+pid_t spawnShellCommand(const std::string &command) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    setpgid(0, 0);
+    execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char *>(nullptr));
+    _exit(127);
+  }
+  if (pid > 0) {
+    setpgid(pid, pid);
+  }
+  return pid;
+}
+
+// Exit status of a finished child, nullopt while it is still running
+std::optional<int> pollChild(pid_t pid) {
+  int status = 0;
+  pid_t result = waitpid(pid, &status, WNOHANG);
+  if (result == 0 || (result < 0 && errno == EINTR)) {
+    return std::nullopt;
+  }
+  if (result < 0) {
+    return -1;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// SIGTERM the child's process group, SIGKILL it if it lingers, then reap it
+void killChild(pid_t pid) {
+  kill(-pid, SIGTERM);
+  for (int i = 0; i < 50; ++i) {
+    if (pollChild(pid)) {
+      return;
+    }
+    std::this_thread::sleep_for(CHILD_POLL_INTERVAL);
+  }
+  kill(-pid, SIGKILL);
+  while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+  }
+}
+
+// Exit status of command, or 124 (like timeout(1)) if it missed the deadline
+int runWithDeadline(const std::string &command,
+                    std::chrono::milliseconds deadline) {
+  ensureSudoFor(command);
+  pid_t pid = spawnShellCommand(command);
+  if (pid < 0) {
+    return -1;
+  }
+  auto giveUp = std::chrono::steady_clock::now() + deadline;
+  while (true) {
+    if (auto status = pollChild(pid)) {
+      return *status;
+    }
+    if (std::chrono::steady_clock::now() >= giveUp) {
+      killChild(pid);
+      return 124;
+    }
+    std::this_thread::sleep_for(CHILD_POLL_INTERVAL);
+  }
+}
+
+// Full jitter: uniform in [0, min(maxDelay, baseDelay * 2^attempt)]
+std::chrono::milliseconds backoffDelay(const FetchPolicy &policy,
+                                       int attempt) {
+  thread_local std::mt19937_64 generator(std::random_device{}());
+  long long ceiling = std::min<long long>(
+      policy.maxDelay.count(), policy.baseDelay.count()
+                                   << std::clamp(attempt, 0, 20));
+  std::uniform_int_distribution<long long> delay(0, ceiling);
+  return std::chrono::milliseconds(delay(generator));
+}
+
+bool retryWithBackoff(const std::string &what, const FetchPolicy &policy,
+                      const std::function<bool()> &attempt) {
+  for (int i = 0; i < policy.attempts; ++i) {
+    if (i > 0) {
+      auto delay = backoffDelay(policy, i - 1);
+      printAboveProgress(std::cerr, ERROR_COLOR + what +
+                                        " failed, retrying in " +
+                                        std::to_string(delay.count()) +
+                                        " ms (attempt " +
+                                        std::to_string(i + 1) + "/" +
+                                        std::to_string(policy.attempts) +
+                                        ")" + RESET_COLOR + "\n");
+      std::this_thread::sleep_for(delay);
+    }
+    if (attempt()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string urlHost(const std::string &url) {
+  size_t start = url.find("://");
+  start = start == std::string::npos ? 0 : start + 3;
+  return url.substr(start, url.find('/', start) - start);
+}
+
+// Recent times to first byte per host, one "host ms ms ..." line each
+std::mutex fetchLatencyMutex;
+
+std::map<std::string, std::vector<double>> loadFetchLatencies() {
+  std::map<std::string, std::vector<double>> latencies;
+  std::istringstream file(
+      readFileContents(stateDirectory() + "/fetch-ttfb"));
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string host;
+    double milliseconds = 0;
+    fields >> host;
+    while (fields >> milliseconds) {
+      latencies[host].push_back(milliseconds);
+    }
+  }
+  return latencies;
+}
+
+// How long the primary may wait for its first byte before a hedged request
+// is sent: the host's 95th percentile once enough downloads have been timed
+std::chrono::milliseconds hedgeDelay(const std::string &host) {
+  std::vector<double> samples;
+  {
+    std::lock_guard<std::mutex> lock(fetchLatencyMutex);
+    samples = loadFetchLatencies()[host];
+  }
+  if (samples.size() < MIN_HEDGE_SAMPLES) {
+    return DEFAULT_HEDGE_DELAY;
+  }
+  size_t rank = (samples.size() * 95 + 99) / 100 - 1;
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  return std::max(MIN_HEDGE_DELAY,
+                  std::chrono::milliseconds(
+                      static_cast<long long>(samples[rank])));
+}
+
+void recordFetchLatency(const std::string &host, double milliseconds) {
+  std::lock_guard<std::mutex> lock(fetchLatencyMutex);
+  auto latencies = loadFetchLatencies();
+  auto &samples = latencies[host];
+  samples.push_back(milliseconds);
+  if (samples.size() > FETCH_LATENCY_SAMPLES) {
+    samples.erase(samples.begin(),
+                  samples.end() - FETCH_LATENCY_SAMPLES);
+  }
+
+  std::error_code ec;
+  fs::create_directories(stateDirectory(), ec);
+  std::ofstream file(stateDirectory() + "/fetch-ttfb", std::ios::trunc);
+  for (const auto &[name, times] : latencies) {
+    file << name;
+    for (double time : times) {
+      file << " " << std::fixed << std::setprecision(0) << time;
+    }
+    file << "\n";
+  }
+}
+
+// Mirrors serving the same bytes. raw.githubusercontent.com/OWNER/REPO/REF/
+// PATH is also served by jsDelivr as cdn.jsdelivr.net/gh/OWNER/REPO@REF/PATH.
+std::vector<std::string> alternateUrls(const std::string &url) {
+  const std::string raw = "https://raw.githubusercontent.com/";
+  if (url.rfind(raw, 0) != 0) {
+    return {};
+  }
+  std::string path = url.substr(raw.size());
+  size_t owner = path.find('/');
+  size_t repo = owner == std::string::npos ? owner : path.find('/', owner + 1);
+  if (repo == std::string::npos) {
+    return {};
+  }
+  path[repo] = '@';
+  return {"https://cdn.jsdelivr.net/gh/" + path};
+}
+
+std::string curlFetchCommand(const std::string &url,
+                             const std::string &outputPath,
+                             const FetchPolicy &policy) {
+  std::string command =
+      "curl -fsSL --connect-timeout 10 --speed-limit 1024 --speed-time " +
+      std::to_string(policy.stallTime.count()) + " --max-time " +
+      std::to_string(policy.deadline.count());
+  if (url.rfind("https://", 0) == 0) {
+    command += " --proto =https --tlsv1.2";
+  }
+  return command + " -o " + shellQuote(outputPath) + " " + shellQuote(url);
+}
+
+// Download urls.front() to outputPath, hedging with the other urls. Each
+// request writes its own .part file; the first to finish is renamed into
+// place and the rest are killed. A failed primary fails over at once. The
+// download has a progress lane that ends without a message, since callers
+// report failures themselves.
+bool fetchUrl(const std::vector<std::string> &urls,
+              const std::string &outputPath, const FetchPolicy &policy) {
+  if (urls.empty()) {
+    return false;
+  }
+  auto lane = beginProgressLane(
+      "download: " + fs::path(urls.front()).filename().string());
+  bool fetched = retryWithBackoff("Download of " + urls.front(), policy, [&] {
+    struct Request {
+      std::string url;
+      std::string part;
+      pid_t pid;
+      std::chrono::steady_clock::time_point launched;
+      std::optional<std::chrono::steady_clock::time_point> firstByte;
+    };
+    std::vector<Request> requests;
+    auto started = std::chrono::steady_clock::now();
+    auto giveUp = started + policy.deadline;
+    auto hedgeAt = started + hedgeDelay(urlHost(urls.front()));
+    size_t next = 0;
+    std::error_code ec;
+
+    auto launch = [&] {
+      const std::string &url = urls[next];
+      std::string part = outputPath + ".part" + std::to_string(next++);
+      pid_t pid = spawnShellCommand(curlFetchCommand(url, part, policy) +
+                                    " 2>/dev/null");
+      if (pid > 0) {
+        requests.push_back(
+            {url, part, pid, std::chrono::steady_clock::now(), std::nullopt});
+      }
+    };
+    auto abandon = [&](const Request &request) {
+      killChild(request.pid);
+      fs::remove(request.part, ec);
+    };
+
+    launch();
+    while (true) {
+      for (size_t i = 0; i < requests.size();) {
+        auto status = pollChild(requests[i].pid);
+        if (!status) {
+          // curl creates the .part file with the first byte it receives
+          if (!requests[i].firstByte && fs::exists(requests[i].part, ec)) {
+            requests[i].firstByte = std::chrono::steady_clock::now();
+          }
+          ++i;
+          continue;
+        }
+        Request finished = requests[i];
+        requests.erase(requests.begin() + i);
+        if (*status != 0) {
+          fs::remove(finished.part, ec);
+          continue;
+        }
+        for (const auto &request : requests) {
+          abandon(request);
+        }
+        fs::rename(finished.part, outputPath, ec);
+        if (ec) {
+          fs::remove(finished.part, ec);
+          return false;
+        }
+        // A download finished between two polls got its first byte by now
+        std::chrono::duration<double, std::milli> timeToFirstByte =
+            finished.firstByte.value_or(std::chrono::steady_clock::now()) -
+            finished.launched;
+        recordFetchLatency(urlHost(finished.url), timeToFirstByte.count());
+        return true;
+      }
+
+      // Hedge only while nothing has arrived; a transfer that started and
+      // then slowed down is left to the stall timeout
+      auto now = std::chrono::steady_clock::now();
+      bool receiving =
+          std::any_of(requests.begin(), requests.end(),
+                      [](const Request &request) { return request.firstByte; });
+      if (next < urls.size() &&
+          (requests.empty() ||
+           (policy.hedge && now >= hedgeAt && !receiving))) {
+        launch();
+        continue;
+      }
+      if (requests.empty()) {
+        return false;
+      }
+      if (now >= giveUp) {
+        for (const auto &request : requests) {
+          abandon(request);
+        }
+        return false;
+      }
+      std::this_thread::sleep_for(CHILD_POLL_INTERVAL);
+    }
+  });
+  endProgressLane(lane, fetched, "");
+  return fetched;
+}
+
+// Run a network command such as a git clone under policy. git gives up on
+// its own once the transfer stalls; the deadline catches everything else.
+// cleanup runs before each retry to remove what the failed attempt left.
+// Like fetchUrl, the command has a progress lane labelled what.
+bool runFetchCommand(const std::string &what, const std::string &command,
+                     const FetchPolicy &policy,
+                     const std::function<void()> &cleanup) {
+  std::string guarded =
+      "export GIT_TERMINAL_PROMPT=0 GIT_HTTP_LOW_SPEED_LIMIT=1024 "
+      "GIT_HTTP_LOW_SPEED_TIME=" +
+      std::to_string(policy.stallTime.count()) + "; " + command;
+  auto lane = beginProgressLane(what);
+  bool retry = false;
+  bool fetched = retryWithBackoff(what, policy, [&] {
+    if (retry && cleanup) {
+      cleanup();
+    }
+    retry = true;
+    return runWithDeadline(guarded, policy.deadline) == 0;
+  });
+  endProgressLane(lane, fetched, "");
+  return fetched;
+}
+
+// Installers published as "curl URL | sh" scripts. The script is fetched
+// under the download policy and then run, so a stalled server fails the
+// fetch instead of hanging the shell. Scripts that get executed are only
+// taken from their publisher, never from a mirror such as jsDelivr.
+bool runDownloadedInstaller(const std::string &url, const std::string &name,
+                            const std::string &interpreter,
+                            const std::string &arguments) {
+  std::string script = targetRoot + scratchPath(name);
+  if (!fetchUrl({url}, script, DOWNLOAD_POLICY)) {
+    std::cerr << ERROR_COLOR << "Failed to download the " << name
+              << " installer from " << url << ".\n"
+              << RESET_COLOR;
+    return false;
+  }
+  std::string command = interpreter + " " + shellQuote(chrootPath(script));
+  if (!arguments.empty()) {
+    command += " " + arguments;
+  }
+  bool installed = isCommandSuccessful(targetCommand(command, false));
+  std::error_code ec;
+  fs::remove(script, ec);
+  return installed;
+}
+
+bool downloadFile(const std::string &url, const std::string &outputFilePath) {
+  std::vector<std::string> urls = {url};
+  for (const auto &alternate : alternateUrls(url)) {
+    urls.push_back(alternate);
+  }
+  return fetchUrl(urls, outputFilePath, DOWNLOAD_POLICY);
+}
+
+// Check if file exists and is not empty
+bool isFileValid(const std::string &filePath) {
+  std::ifstream file(filePath);
+  return file.good() && file.peek() != std::ifstream::traits_type::eof();
+}
+
+bool applyConfig(const std::string &gistUrl, const std::string &configPath) {
+  std::string backupPath = configPath + "_old.bak";
+  std::string tempConfigPath = scratchPath("config_gist");
+
+  // Ensure the target directory exists
+  fs::path targetDir = fs::path(configPath).parent_path();
+  if (!fs::exists(targetDir)) {
+    std::cout << INPUT_COLOR
+              << "Target directory does not exist. Creating: " << targetDir
+              << RESET_COLOR << "\n";
+    fs::create_directories(targetDir);
+  }
+
+  if (fs::exists(configPath) && isFileValid(configPath)) {
+    std::cout << INPUT_COLOR << "Backing up current config..." << RESET_COLOR
+              << "\n";
+    std::ifstream src(configPath, std::ios::binary);
+    std::ofstream dst(backupPath, std::ios::binary);
+    dst << src.rdbuf();
+    std::cout << SUCCESS_COLOR << "Backup created at: " << backupPath
+              << RESET_COLOR << "\n";
+  } else {
+    std::cout << ERROR_COLOR << "No valid config found to back up.\n"
+              << RESET_COLOR;
+  }
+
+  // Use the copy fetched in the background if the prefetch stage got to it
+  std::string prefetchedPath = prefetchedConfigPath(gistUrl);
+  std::error_code ec;
+  bool usePrefetched = isFileValid(prefetchedPath) &&
+                       fs::copy_file(prefetchedPath, tempConfigPath,
+                                     fs::copy_options::overwrite_existing, ec);
+  if (usePrefetched) {
+    fs::remove(prefetchedPath, ec);
+    std::cout << INPUT_COLOR << "Using prefetched config..." << RESET_COLOR
+              << "\n";
+  } else {
+    std::cout << INPUT_COLOR << "Downloading new config..." << RESET_COLOR
+              << "\n";
+    if (!downloadFile(gistUrl, tempConfigPath)) {
+      std::cerr << ERROR_COLOR << "Failed to download the config from "
+                << gistUrl << "\n"
+                << RESET_COLOR;
+      return false;
+    }
+  }
+
+  if (!isFileValid(tempConfigPath)) {
+    std::cerr << ERROR_COLOR << "Downloaded config file is invalid or empty.\n"
+              << RESET_COLOR;
+    return false;
+  }
+
+  try {
+    std::cout << INPUT_COLOR << "Applying new config..." << RESET_COLOR << "\n";
+    std::ifstream src(tempConfigPath, std::ios::binary);
+    std::ofstream dst(configPath, std::ios::binary);
+    dst << src.rdbuf();
+    dst.close();
+    recordConfigHash(configPath);
+    std::cout << SUCCESS_COLOR << "Configuration applied successfully.\n"
+              << RESET_COLOR;
+  } catch (const std::exception &e) {
+    std::cerr << ERROR_COLOR << "Error applying new config: " << e.what()
+              << "\n"
+              << RESET_COLOR;
+    return false;
+  }
+
+  try {
+    fs::remove(tempConfigPath);
+  } catch (const fs::filesystem_error &e) {
+    std::cerr << ERROR_COLOR << "Failed to remove temporary file: " << e.what()
+              << "\n"
+              << RESET_COLOR;
+  }
+  return true;
+}
+
+// Function to install Flatpak and add Flathub repository
+void setupFlatpak() {
+  // Install flatpak
+  installPackage("flatpak", "--needed");
+
+  // Add Flathub repository if not already added
+  if (!isCommandSuccessful(targetCommand("flatpak remote-list", false) +
+                           " | grep flathub")) {
+    std::cout << INPUT_COLOR << "Adding Flathub repository to Flatpak...\n"
+              << RESET_COLOR;
+    runCommand(targetCommand("flatpak remote-add --if-not-exists flathub "
+                             "https://flathub.org/repo/flathub.flatpakrepo",
+                             true));
+  }
+}
+
+// ZSH & Starship Setup
+void setZshAsDefaultShell() {
+  if (probeConverged("shell.default-shell")) {
+    std::cout << SUCCESS_COLOR << "Zsh is already the default shell.\n"
+              << RESET_COLOR;
+    return;
+  }
+
+  if (!targetHasCommand("zsh")) {
+    std::cout << INPUT_COLOR << "Zsh is not installed. Installing Zsh..."
+              << RESET_COLOR << "\n";
+    installPackage("zsh", "--needed");
+  }
+
+  const char *user = std::getenv("USER");
+  if (user == nullptr && targetUserName.empty()) {
+    std::cerr << ERROR_COLOR
+              << "Failed to get the current user. Cannot set Zsh as the "
+                 "default shell.\n"
+              << RESET_COLOR;
+    return;
+  }
+
+  std::string command =
+      targetRoot.empty()
+          ? "chsh -s $(which zsh) " + std::string(user)
+          : targetCommand("chsh -s /usr/bin/zsh " + targetUser(), true);
+  if (isCommandSuccessful(command)) {
+    std::cout << SUCCESS_COLOR << "Zsh has been set as the default shell.\n"
+              << RESET_COLOR;
+  } else {
+    std::cerr << ERROR_COLOR << "Failed to set Zsh as the default shell.\n"
+              << RESET_COLOR;
+  }
+}
+
+// Install terminal emulator and apply configuration
+void installTerminal(const std::string &terminalName,
+                     const std::string &configUrl,
+                     const std::string &configPath) {
+  if (!installPackage(terminalName, "--needed")) {
+    std::cerr << ERROR_COLOR << "Failed to install " << terminalName
+              << ". Aborting setup.\n"
+              << RESET_COLOR;
+    return;
+  }
+
+  if (!configUrl.empty() && !configPath.empty()) {
+    applyConfig(configUrl, configPath);
+    std::cout << SUCCESS_COLOR << terminalName << " configuration applied from "
+              << configUrl << ".\n"
+              << RESET_COLOR;
+  } else {
+    std::cout << SUCCESS_COLOR << terminalName
+              << " installed with no specific configuration applied.\n"
+              << RESET_COLOR;
+  }
+
+  std::cout << SUCCESS_COLOR << terminalName << " setup completed.\n"
+            << RESET_COLOR;
+}
+
+// WezTerm
+void setupWezTerm() {
+  std::string weztermConfigPath =
+      homeDirectory() + "/.config/wezterm/wezterm.lua";
+  installTerminal("wezterm", WEZTERM_CONFIG_URL, weztermConfigPath);
+}
+
+// Kitty
+void setupKitty() {
+  std::string kittyConfigPath =
+      homeDirectory() + "/.config/kitty/kitty.conf";
+  installTerminal("kitty", KITTY_CONFIG_URL, kittyConfigPath);
+}
+
+void setupTerminal() {
+  std::cout << INPUT_COLOR << "Which terminal would you like to install? \n"
+            << RESET_COLOR;
+  std::cout << OPTION_COLOR << "(1) WezTerm \n(2) Kitty\n" << RESET_COLOR;
+
+  int terminalChoice = askChoice("terminal.choice", {"wezterm", "kitty"}, 1);
+
+  switch (terminalChoice) {
+  case 1:
+    std::cout << INPUT_COLOR << "Setting up WezTerm...\n" << RESET_COLOR;
+    setupWezTerm();
+    break;
+  case 2:
+    std::cout << INPUT_COLOR << "Setting up Kitty...\n" << RESET_COLOR;
+    setupKitty();
+    break;
+  default:
+    std::cout << ERROR_COLOR << "Invalid choice. Please try again.\n"
+              << RESET_COLOR;
+    break;
+  }
+}
+
+// Setup ZSH shell and apply .zshrc config
+void setupStarshipTheme() {
+  std::cout << INPUT_COLOR << "Choose a theme for Starship: \n" << RESET_COLOR;
+  std::cout << OPTION_COLOR << "(1) Gruvbox\n(2) Catppuccin Mocha\n"
+            << RESET_COLOR;
+
+  int themeChoice =
+      askChoice("starship.theme", {"gruvbox", "catppuccin-mocha"}, 1);
+
+  std::string starshipConfigPath =
+      homeDirectory() + "/.config/starship.toml";
+
+  switch (themeChoice) {
+  case 1: {
+    std::string gruvboxCommand = targetCommand(
+        "starship preset gruvbox-rainbow -o " + chrootPath(starshipConfigPath),
+        false);
+    if (isCommandSuccessful(gruvboxCommand)) {
+      std::cout << SUCCESS_COLOR << "Gruvbox theme applied to Starship.\n"
+                << RESET_COLOR;
+    } else {
+      std::cerr << ERROR_COLOR << "Failed to apply Gruvbox theme to Starship.\n"
+                << RESET_COLOR;
+    }
+    break;
+  }
+  case 2: {
+    std::string starshipThemePath = scratchPath("catppuccin_starship");
+    fs::remove_all(starshipThemePath);
+
+    // Only themes/mocha.toml is needed, so skip the rest of the repository
+    if (cloneRepository(CATPPUCCIN_STARSHIP_REPO, starshipThemePath,
+                        {true, {"themes/mocha.toml"}})) {
+      std::string themeFilePath = starshipThemePath + "/themes/mocha.toml";
+
+      std::ifstream themeFile(themeFilePath);
+      std::ofstream starshipConfig(starshipConfigPath, std::ios_base::app);
+
+      if (themeFile.is_open() && starshipConfig.is_open()) {
+        // Write the palette and theme configuration to starship.toml
+        starshipConfig << "\npalette = \"catppuccin_mocha\"\n";
+        starshipConfig << themeFile.rdbuf();
+        themeFile.close();
+        starshipConfig.close();
+
+        std::cout << SUCCESS_COLOR
+                  << "Catppuccin Mocha theme applied to Starship.\n"
+                  << RESET_COLOR;
+      } else {
+        std::cerr
+            << ERROR_COLOR
+            << "Failed to configure Catppuccin Mocha theme for Starship.\n"
+            << RESET_COLOR;
+      }
+
+      fs::remove_all(starshipThemePath);
+    } else {
+      std::cerr << ERROR_COLOR
+                << "Failed to clone Catppuccin Starship theme repository.\n"
+                << RESET_COLOR;
+    }
+    break;
+  }
+  default:
+    std::cout << ERROR_COLOR << "Invalid choice. No theme applied.\n"
+              << RESET_COLOR;
+    break;
+  }
+}
+
+void setupShell() {
+  // check yay
+  ensureYayInstalled();
+
+  const auto &packages = findProfile("shell")->packages;
+  runJournaledStep("shell.packages", joinStrings(packages, " "),
+                   [&] { return installPackages(packages, "--needed"); });
+
+  // Homebrew Setup
+  if (!targetRoot.empty()) {
+    std::cout << INPUT_COLOR
+              << "Skipping Homebrew, it cannot be installed into a target "
+                 "root.\n"
+              << RESET_COLOR;
+  } else {
+    runJournaledStep("shell.homebrew", HOMEBREW_INSTALLER_URL, [&] {
+      std::cout << INPUT_COLOR << "Installing Homebrew...\n" << RESET_COLOR;
+      return runDownloadedInstaller(HOMEBREW_INSTALLER_URL, "homebrew",
+                                    "/bin/bash", "");
+    });
+
+    // Source Homebrew
+    std::string sourceHomebrewCommand =
+        "eval $(/opt/homebrew/bin/brew shellenv)";
+    if (isCommandSuccessful(sourceHomebrewCommand)) {
+      std::cout << SUCCESS_COLOR
+                << "Homebrew sourced successfully in this session.\n"
+                << RESET_COLOR;
+    } else {
+      std::cerr << ERROR_COLOR
+                << "Failed to source Homebrew. You may need to restart the "
+                   "terminal.\n"
+                << RESET_COLOR;
+    }
+
+    // Install Zsh Syntax Highlighting via Homebrew
+    runJournaledStep("shell.zsh-syntax-highlighting", "brew", [] {
+      return runCommand("brew install zsh-syntax-highlighting");
+    });
+  }
+
+  // Clone zsh-autosuggestions (already handled in .zshrc)
+  std::string autosuggestionsPath =
+      homeDirectory() + "/.zsh/zsh-autosuggestions";
+  runJournaledStep(
+      "shell.zsh-autosuggestions",
+      ZSH_AUTOSUGGESTIONS_REPO + std::string(" ") + autosuggestionsPath, [&] {
+        std::cout << INPUT_COLOR << "Installing zsh-autosuggestions...\n"
+                  << RESET_COLOR;
+        if (!cloneRepository(ZSH_AUTOSUGGESTIONS_REPO, autosuggestionsPath,
+                             {true, {}})) {
+          std::cerr << ERROR_COLOR << "Failed to clone zsh-autosuggestions.\n"
+                    << RESET_COLOR;
+          return false;
+        }
+        return true;
+      });
+
+  setZshAsDefaultShell();
+
+  std::string zshrcPath = homeDirectory() + "/.zshrc";
+  runJournaledStep("shell.zshrc",
+                   ZSHRC_CONFIG_URL + std::string(" ") + zshrcPath,
+                   [&] { return applyConfig(ZSHRC_CONFIG_URL, zshrcPath); });
+
+  setupStarshipTheme();
+
+  std::cout << SUCCESS_COLOR << ".zshrc updated.\n" << RESET_COLOR;
+}
+
+// Gaming environment setup
+void gamingSetup() {
+  std::cout << INPUT_COLOR << "Installing gaming tools and libraries...\n"
+            << RESET_COLOR;
+
+  for (const auto &gpu : detectGpus()) {
+    std::cout << OPTION_COLOR << "Detected " << gpuVendorName(gpu.vendorId)
+              << " GPU at " << gpu.slot << " (device " << std::hex
+              << std::setw(4) << std::setfill('0') << gpu.deviceId << std::dec
+              << std::setfill(' ') << ")\n"
+              << RESET_COLOR;
+  }
+
+  const auto &packages = findProfile("gaming")->packages;
+  // Several gigabytes follow, so pick the fastest mirrors first. Skipped when
+  // the packages are already in place.
+  if (!probeConverged("gaming.packages")) {
+    optimizeMirrors();
+  }
+  if (!runJournaledStep("gaming.packages", joinStrings(packages, " "), [&] {
+        return installPackages(packages, "--needed");
+      })) {
+    std::cerr << ERROR_COLOR
+              << "Some gaming packages failed to install. Re-run to resume.\n"
+              << RESET_COLOR;
+  }
+
+  // Add user to gamemode group
+  runJournaledStep("gaming.gamemode-group", "gamemode", [] {
+    std::cout << INPUT_COLOR << "Setting up gamemode.\n" << RESET_COLOR;
+    return runCommand(
+        targetCommand("usermod -aG gamemode " + targetUser(), true));
+  });
+
+  // running gamemode test, only meaningful on the running system
+  if (targetRoot.empty()) {
+    runJournaledStep("gaming.gamemode-test", "gamemoded -t", [] {
+      std::cout << INPUT_COLOR << "Running gamemode tests.\n" << RESET_COLOR;
+      return runCommand("gamemoded -t");
+    });
+  }
+
+  std::cout << SUCCESS_COLOR << "Gaming environment setup complete.\n"
+            << RESET_COLOR;
+}
+
+// Developer tools setup
+void developerSetup() {
+  std::cout << INPUT_COLOR << "Installing developer tools...\n" << RESET_COLOR;
+  const auto &packages = findProfile("dev")->packages;
+  runJournaledStep("dev.packages", joinStrings(packages, " "),
+                   [&] { return installPackages(packages); });
+}
+
+// Setup LunarVim
+void setupLVim() {
+  std::cout << INPUT_COLOR << "Setting up LunarVim...\n" << RESET_COLOR;
+  const auto &packages = findProfile("lvim")->packages;
+  if (!runJournaledStep("lvim.packages", joinStrings(packages, " "), [&] {
+        return installPackages(packages, "--needed");
+      })) {
+    return;
+  }
+
+  // Node.js global setup
+  std::string profilePath = homeDirectory() + "/.profile";
+  runJournaledStep("lvim.npm-global", profilePath, [&] {
+    std::cout << INPUT_COLOR << "Setting up npm global directory...\n"
+              << RESET_COLOR;
+    runCommand(targetCommand("mkdir -p ~/.npm-global/lib", false));
+    if (!runCommand(
+            targetCommand("npm config set prefix '~/.npm-global'", false))) {
+      return false;
+    }
+
+    // Update system path for npm global directory
+    std::ofstream profileFile(profilePath, std::ios_base::app);
+    if (!profileFile.is_open()) {
+      return false;
+    }
+    profileFile << "\nexport PATH=~/.npm-global/bin:$PATH\n";
+    profileFile.close();
+    if (targetRoot.empty()) {
+      runCommand("source ~/.profile");
+    }
+    return true;
+  });
+
+  // Test npm global setup by installing a package
+  /* std::cout << INPUT_COLOR << "Testing npm global installation with
+   jshint...\n"
+             << RESET_COLOR;
+   runCommand("npm install -g jshint");
+ */
+  // Cargo Setup
+  runJournaledStep("lvim.rust", RUSTUP_INSTALLER_URL, [&] {
+    std::cout << INPUT_COLOR << "Installing Rust.\n" << RESET_COLOR;
+    return runDownloadedInstaller(RUSTUP_INSTALLER_URL, "rustup", "sh", "-y");
+  });
+
+  // Source cargo environment to avoid restart
+  if (targetRoot.empty()) {
+    std::string cargoEnvPath = homeDirectory() + "/.cargo/env";
+    runCommand("source " + cargoEnvPath);
+  }
+
+  if (!runJournaledStep("lvim.install", LVIM_INSTALLER_URL, [&] {
+        if (!runDownloadedInstaller(LVIM_INSTALLER_URL, "lvim-installer",
+                                    "LV_BRANCH='" LVIM_BRANCH "' bash", "")) {
+          return false;
+        }
+        std::cout << SUCCESS_COLOR << "LunarVim installed successfully.\n"
+                  << RESET_COLOR;
+        return true;
+      })) {
+    std::cerr << ERROR_COLOR << "Failed to install LunarVim.\n" << RESET_COLOR;
+    return;
+  }
+
+  std::string lVimConfigPath =
+      homeDirectory() + "/.config/lvim/config.lua";
+  runJournaledStep(
+      "lvim.config", LVIM_CONFIG_URL + std::string(" ") + lVimConfigPath,
+      [&] { return applyConfig(LVIM_CONFIG_URL, lVimConfigPath); });
+}
+
+// Setup Doom Emacs
+void setupDoomEmacs() {
+  std::cout << INPUT_COLOR << "Setting up Doom Emacs...\n" << RESET_COLOR;
+
+  const auto &packages = findProfile("doom")->packages;
+  runJournaledStep("doom.packages", joinStrings(packages, " "),
+                   [&] { return installPackages(packages, "--needed"); });
+
+  std::string emacsConfigPath = homeDirectory() + "/.config/emacs";
+
+  if (!runJournaledStep(
+          "doom.clone", DOOMEMACS_REPO + std::string(" ") + emacsConfigPath,
+          [&] {
+            if (!cloneRepository(DOOMEMACS_REPO, emacsConfigPath,
+                                 {true, {}})) {
+              return false;
+            }
+            std::cout << SUCCESS_COLOR << "Doom Emacs cloned successfully.\n"
+                      << RESET_COLOR;
+            return true;
+          })) {
+    std::cerr << ERROR_COLOR << "Failed to clone Doom Emacs.\n" << RESET_COLOR;
+    return;
+  }
+
+  // DOOM INSTALL
+  std::string doomInstallCommand =
+      targetCommand(chrootPath(emacsConfigPath) + "/bin/doom install", false);
+
+  if (!runJournaledStep("doom.install", doomInstallCommand, [&] {
+        std::cout << SUCCESS_COLOR << "Starting Doom Install!" << RESET_COLOR
+                  << std::endl;
+        if (!isCommandSuccessful(doomInstallCommand)) {
+          return false;
+        }
+        std::cout << SUCCESS_COLOR << "Doom Emacs installed successfully.\n"
+                  << RESET_COLOR;
+        return true;
+      })) {
+    std::cerr << ERROR_COLOR << "Failed to install Doom Emacs.\n"
+              << RESET_COLOR;
+    return;
+  }
+
+  std::string doomConfigPath = homeDirectory() + "/.config/doom/";
+
+  if (!runJournaledStep(
+          "doom.config", DOOM_CONFIG_REPO + std::string(" ") + doomConfigPath,
+          [&] {
+            std::vector<std::string> filesToRemove = {
+                doomConfigPath + "package.el", doomConfigPath + "config.el",
+                doomConfigPath + "init.el"};
+
+            for (const auto &filePath : filesToRemove) {
+              if (fs::exists(filePath)) {
+                std::cout << INPUT_COLOR << "Removing existing file: "
+                          << filePath << RESET_COLOR << "\n";
+                fs::remove(filePath); // Remove the file
+              }
+            }
+
+            if (!cloneRepository(DOOM_CONFIG_REPO, doomConfigPath)) {
+              return false;
+            }
+            std::cout << SUCCESS_COLOR
+                      << "Your Doom Emacs configuration cloned successfully.\n"
+                      << RESET_COLOR;
+            return true;
+          })) {
+    std::cerr << ERROR_COLOR
+              << "Failed to clone your Doom Emacs configuration.\n"
+              << RESET_COLOR;
+    return;
+  }
+
+  // Install 'emms' package
+  runJournaledStep("doom.emms", "emms", [] {
+    std::cout << INPUT_COLOR
+              << "Installing emms (Emacs Multimedia package)...\n"
+              << RESET_COLOR;
+    if (!installPackage("emms")) {
+      std::cerr << ERROR_COLOR << "Failed to install emms package.\n"
+                << RESET_COLOR;
+      return false;
+    }
+    return true;
+  });
+
+  // DOOM SYNC
+  std::string doomSyncCommand =
+      targetCommand(chrootPath(emacsConfigPath) + "/bin/doom sync", false);
+  runJournaledStep("doom.sync", doomSyncCommand, [&] {
+    if (!isCommandSuccessful(doomSyncCommand)) {
+      std::cerr << ERROR_COLOR << "Failed to synchronize Doom Emacs.\n"
+                << RESET_COLOR;
+      return false;
+    }
+    std::cout << SUCCESS_COLOR << "Doom Emacs synchronized successfully.\n"
+              << RESET_COLOR;
+    return true;
+  });
+
+  std::string shellConfigPath;
+  const char *shell = std::getenv("SHELL");
+  if (shell && std::string(shell).find("zsh") != std::string::npos) {
+    shellConfigPath = homeDirectory() + "/.zshrc";
+  } else {
+    shellConfigPath = homeDirectory() + "/.bashrc";
+  }
+
+  // Journaled so a rerun does not append the PATH line a second time
+  runJournaledStep("doom.path", shellConfigPath + " " + emacsConfigPath, [&] {
+    std::ofstream shellConfigFile;
+    shellConfigFile.open(shellConfigPath, std::ios_base::app);
+    if (!shellConfigFile.is_open()) {
+      std::cerr << ERROR_COLOR
+                << "Failed to add Doom Emacs to PATH. Could not open "
+                << shellConfigPath << "\n"
+                << RESET_COLOR;
+      return false;
+    }
+    shellConfigFile << "\n# Added by Arch Linux setup script\n";
+    shellConfigFile << "export PATH=\"$PATH:" << chrootPath(emacsConfigPath)
+                    << "/bin\"\n";
+    shellConfigFile.close();
+    std::cout << SUCCESS_COLOR << "Added Doom Emacs bin directory to PATH in "
+              << shellConfigPath << "\n"
+              << RESET_COLOR;
+    return true;
+  });
+
+  std::cout << INPUT_COLOR << "Doom Emacs setup complete. Useful commands:\n"
+            << RESET_COLOR;
+  std::cout << OPTION_COLOR
+            << "doom sync    - Synchronize your config with Doom Emacs.\n"
+            << "doom upgrade - Update Doom Emacs and all packages.\n"
+            << "doom doctor  - Diagnose common issues.\n"
+            << "doom env     - Regenerate the environment file.\n"
+            << RESET_COLOR;
+}
+
+// Package Downloader
+void ensureYayInstalled() {
+  if (!targetHasCommand("yay")) {
+    std::cout << INPUT_COLOR
+              << "The 'yay' AUR helper is not installed. Do you want to "
+                 "install it? (y/n): "
+              << RESET_COLOR;
+    if (askYesNo("yay.install", true)) {
+      std::cout << INPUT_COLOR << "Installing 'yay'...\n" << RESET_COLOR;
+      installAurPackages({"yay"});
+
+      if (targetHasCommand("yay")) {
+        std::cout << SUCCESS_COLOR << "'yay' installed successfully.\n"
+                  << RESET_COLOR;
+      } else {
+        std::cerr
+            << ERROR_COLOR
+            << "Failed to install 'yay'. AUR packages will not be available.\n"
+            << RESET_COLOR;
+      }
+    } else {
+      std::cout
+          << INPUT_COLOR
+          << "Proceeding without 'yay'. AUR packages will not be available.\n"
+          << RESET_COLOR;
+    }
+  }
+}
+
+void ensureFlatpakInstalled() {
+  if (!targetHasCommand("flatpak")) {
+    std::cout << INPUT_COLOR
+              << "Flatpak is not installed. Do you want to install it to "
+                 "search for Flatpak packages? (y/n): "
+              << RESET_COLOR;
+    if (askYesNo("flatpak.install", true)) {
+      installPackage("flatpak", "--needed");
+      if (targetHasCommand("flatpak")) {
+        std::cout << SUCCESS_COLOR << "Flatpak installed successfully.\n"
+                  << RESET_COLOR;
+        if (!isCommandSuccessful(
+                targetCommand("flatpak remote-list", false) +
+                " | grep flathub > /dev/null 2>&1")) {
+          std::cout << INPUT_COLOR
+                    << "Adding Flathub repository to Flatpak...\n"
+                    << RESET_COLOR;
+          runCommand(
+              targetCommand("flatpak remote-add --if-not-exists flathub "
+                            "https://flathub.org/repo/flathub.flatpakrepo",
+                            true));
+        }
+      } else {
+        std::cerr << ERROR_COLOR
+                  << "Failed to install Flatpak. Flatpak packages will not be "
+                     "available.\n"
+                  << RESET_COLOR;
+      }
+    } else {
+      std::cout << INPUT_COLOR
+                << "Proceeding without Flatpak. Flatpak packages will not be "
+                   "available.\n"
+                << RESET_COLOR;
+    }
+  }
+}
+
+// Search for Packages
+// Search the repos, the AUR and Flathub through the package index. Without
+// one, the pacman, yay and flatpak searches are run instead and parsed
+// while they are still running. Results are reported through onResult as
+// they arrive.
+std::vector<PackageStruct>
+searchForPackages(const std::string &packageName,
+                  const std::function<void(const PackageStruct &)> &onResult) {
+  std::vector<PackageStruct> matchingPackages;
+  auto collect = [&](PackageStruct &&pkg) {
+    matchingPackages.push_back(std::move(pkg));
+    if (onResult) {
+      onResult(matchingPackages.back());
+    }
+  };
+
+  SearchQuery query = parseSearchQuery(packageName);
+  const PackageIndex *index = packageIndex();
+  if (index && index->header->recordCount > 0) {
+    for (const SearchHit &hit : searchPackageIndex(*index, query)) {
+      collect(indexedPackage(*index, hit.record));
+    }
+    return matchingPackages;
+  }
+
+  // The CLI searches are given the words; their results are checked
+  // against the whole text query
+  std::string text = searchQueryText(query);
+  auto collectMatching = [&](PackageStruct &&pkg) {
+    bool flatpak = pkg.source == PackageSource::Flatpak;
+    if (scoreSearchMatch(flatpak ? pkg.ref : pkg.name, flatpak ? pkg.name : "",
+                         pkg.description, query)) {
+      collect(std::move(pkg));
+    }
+  };
+  auto wanted = [&](PackageSource source) {
+    return query.sources.empty() ||
+           std::find(query.sources.begin(), query.sources.end(), source) !=
+               query.sources.end();
+  };
+  if (wanted(PackageSource::Repo)) {
+    SearchParseState pacmanState;
+    streamCommandLines("pacman" + bundleConfigOption() + " -Ss " +
+                           shellQuote(text) + " 2>/dev/null",
+                       [&](std::string_view line) {
+                         feedSearchLine(pacmanState, line, PackageSource::Repo,
+                                        nullptr, collectMatching);
+                       });
+  }
+
+  // yay also lists repo packages, which pacman already reported
+  if (wanted(PackageSource::Aur)) {
+    SearchParseState yayState;
+    streamCommandLines(
+        "yay -Ss " + shellQuote(text) + " 2>/dev/null",
+        [&](std::string_view line) {
+          feedSearchLine(
+              yayState, line, PackageSource::Aur,
+              [](std::string_view repo) { return repo == "aur"; },
+              collectMatching);
+        });
+  }
+
+  if (wanted(PackageSource::Flatpak)) {
+    fetchFlatpakDetails(text, collectMatching);
+  }
+
+  return matchingPackages;
+}
+
+void downloadPackage() {
+  const int ITEMS_PER_PAGE = 10;
+  std::string packageName;
+
+  while (true) {
+    clearScreen();
+    std::cout << MENU_COLOR
+              << "=== Package Search and Download ===" << RESET_COLOR << "\n\n";
+    std::cout << INPUT_COLOR
+              << "Enter the package name you want to search for\n"
+              << "(filters: repo:NAME source:aur installed:no name:^lib32- "
+                 "desc:WORD)\n"
+              << "(or enter 'q' to return to the main menu): " << RESET_COLOR;
+
+    std::getline(std::cin, packageName);
+
+    if (packageName == "q" || packageName == "Q") {
+      std::cout << INPUT_COLOR << "Returning to the main menu...\n"
+                << RESET_COLOR;
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      return;
+    }
+
+    size_t found = 0;
+    auto matchingPackages =
+        searchForPackages(packageName, [&](const PackageStruct &) {
+          std::cout << INPUT_COLOR << "\rSearching... " << ++found
+                    << " found" << RESET_COLOR << std::flush;
+        });
+    std::cout << "\n";
+
+    if (matchingPackages.empty()) {
+      std::cout << ERROR_COLOR
+                << "No matching packages found for: " << packageName << "\n"
+                << RESET_COLOR;
+      std::cout << "Press Enter to try again...";
+      std::cin.get();
+      continue;
+    }
+
+    // Looked up once, not per displayed row
+    auto installedPackages = localPackageNames();
+    auto installedApps = installedFlatpakApps();
+
+    int currentPage = 0;
+    int totalPages =
+        (matchingPackages.size() + ITEMS_PER_PAGE - 1) / ITEMS_PER_PAGE;
+
+    while (true) {
+      clearScreen();
+      std::cout << MENU_COLOR << "=== Search Results (Page "
+                << (currentPage + 1) << " of " << totalPages
+                << ") ===" << RESET_COLOR << "\n\n";
+
+      int startIdx = currentPage * ITEMS_PER_PAGE;
+      int endIdx = std::min(startIdx + ITEMS_PER_PAGE,
+                            static_cast<int>(matchingPackages.size()));
+
+      for (int i = startIdx; i < endIdx; ++i) {
+        const auto &pkg = matchingPackages[i];
+        bool installed = pkg.source == PackageSource::Flatpak
+                             ? installedApps.count(pkg.ref) > 0
+                             : installedPackages.count(pkg.name) > 0;
+        const char *color = installed ? SUCCESS_COLOR : OPTION_COLOR;
+
+        std::cout << (i + 1) << ". " << color << pkg.name << RESET_COLOR
+                  << " : " << pkg.version << " (" << MENU_COLOR
+                  << pkg.sourceOfPackage << RESET_COLOR << ")\n"
+                  << "\t" << pkg.description << "\n";
+
+        if (installed) {
+          std::cout << "\t" << SUCCESS_COLOR << "[installed]" << RESET_COLOR
+                    << "\n";
+        }
+        std::cout << "\n";
+      }
+
+      std::cout << INPUT_COLOR
+                << "Enter package numbers to install (comma-separated),\n"
+                << "n for next page, p for previous page, or q to go back: "
+                << RESET_COLOR;
+
+      std::string input;
+      std::getline(std::cin, input);
+
+      if (input == "q" || input == "Q") {
+        break;
+      }
+
+      if (input == "n" || input == "N") {
+        currentPage = (currentPage + 1) % totalPages;
+        continue;
+      }
+
+      if (input == "p" || input == "P") {
+        currentPage = (currentPage - 1 + totalPages) % totalPages;
+        continue;
+      }
+
+      std::vector<PackageStruct> selectedPackages;
+      std::stringstream ss(input);
+      std::string item;
+      while (std::getline(ss, item, ',')) {
+        try {
+          int index = std::stoi(item) - 1;
+          if (index >= 0 && index < static_cast<int>(matchingPackages.size())) {
+            selectedPackages.push_back(matchingPackages[index]);
+          } else {
+            std::cout << ERROR_COLOR << "Invalid index: " << (index + 1)
+                      << ". Skipping.\n"
+                      << RESET_COLOR;
+          }
+        } catch (const std::invalid_argument &) {
+          std::cout << ERROR_COLOR << "Invalid input: " << item
+                    << ". Skipping.\n"
+                    << RESET_COLOR;
+        }
+      }
+
+      if (selectedPackages.empty()) {
+        std::cout << ERROR_COLOR
+                  << "No valid packages selected. Press Enter to continue...\n"
+                  << RESET_COLOR;
+        std::cin.get();
+        continue;
+      }
+
+      clearScreen();
+      std::cout << MENU_COLOR << "=== Installing Packages ===" << RESET_COLOR
+                << "\n\n";
+      if (!installSearchResults(selectedPackages)) {
+        printStepLogTail();
+      }
+      std::cout << "\n";
+
+      std::cout << SUCCESS_COLOR
+                << "Installation complete. Press Enter to continue...\n"
+                << RESET_COLOR;
+      std::cin.get();
+      break;
+    }
+  }
+}
+
+// Search Command
+// arch-setup search [--json] [--limit N] [--offset N] [--sort KEY] QUERY...
+// Prints one result per line as soon as it is known: NDJSON records with
+// --json, "repo/name version" otherwise. Exits 1 when nothing matches.
+const char *packageSourceName(PackageSource source) {
+  switch (source) {
+  case PackageSource::Repo:
+    return "repo";
+  case PackageSource::Aur:
+    return "aur";
+  case PackageSource::Flatpak:
+    return "flatpak";
+  }
+  return "unknown";
+}
+
+int runSearchCommand() {
+  if (searchSort != "score" && searchSort != "name" && searchSort != "source" &&
+      searchSort != "none") {
+    std::cerr << "Unknown sort key: " << searchSort
+              << " (expected score, name, source or none)\n";
+    return 2;
+  }
+
+  size_t skipped = 0;
+  size_t printed = 0;
+  // Returns false once the limit is reached
+  auto emit = [&](const std::string &name, const std::string &version,
+                  PackageSource source, const std::string &repo,
+                  bool installed, double score) {
+    if (skipped < searchOffset) {
+      ++skipped;
+      return true;
+    }
+    if (jsonOutput) {
+      std::cout << "{\"name\":\"" << jsonEscape(name) << "\",\"version\":\""
+                << jsonEscape(version) << "\",\"source\":\""
+                << packageSourceName(source) << "\",\"repo\":\""
+                << jsonEscape(repo) << "\",\"installed\":"
+                << (installed ? "true" : "false") << ",\"score\":" << std::fixed
+                << std::setprecision(2) << score << "}\n";
+    } else {
+      std::cout << (repo.empty() ? packageSourceName(source) : repo) << "/"
+                << name << " " << version << (installed ? " [installed]" : "")
+                << "\n";
+    }
+    std::cout.flush(); // let a consumer start before the search ends
+    ++printed;
+    return searchLimit == 0 || printed < searchLimit;
+  };
+
+  SearchQuery query = parseSearchQuery(joinStrings(searchTerms, " "));
+  const PackageIndex *index = packageIndex();
+  if (index && index->header->recordCount > 0) {
+    std::vector<SearchHit> hits = searchPackageIndex(*index, query);
+    auto textOf = [&](const SearchHit &hit) {
+      return index->text(index->records[hit.record].name);
+    };
+    if (searchSort == "name") {
+      std::stable_sort(hits.begin(), hits.end(),
+                       [&](const SearchHit &a, const SearchHit &b) {
+                         return textOf(a) < textOf(b);
+                       });
+    } else if (searchSort == "source") {
+      std::stable_sort(hits.begin(), hits.end(),
+                       [&](const SearchHit &a, const SearchHit &b) {
+                         return index->records[a.record].source <
+                                index->records[b.record].source;
+                       });
+    } else if (searchSort == "none") {
+      std::sort(hits.begin(), hits.end(),
+                [](const SearchHit &a, const SearchHit &b) {
+                  return a.record < b.record;
+                });
+    }
+    const Bitmap &installed = installedBitmap(*index);
+    for (const SearchHit &hit : hits) {
+      const PackageIndexRecord &entry = index->records[hit.record];
+      bool isInstalled = (installed[hit.record / 64] >> (hit.record % 64)) & 1;
+      if (!emit(std::string(index->text(entry.name)),
+                std::string(index->text(entry.version)),
+                static_cast<PackageSource>(entry.source),
+                std::string(index->text(entry.repo)), isInstalled,
+                hit.score)) {
+        break;
+      }
+    }
+    return printed + skipped > 0 ? 0 : 1;
+  }
+
+  // No index: results come from the CLI backends. With --sort none they are
+  // printed as each backend reports them, otherwise once all have finished.
+  auto packages = localPackageNames();
+  auto apps = installedFlatpakApps();
+  bool stopped = false;
+  auto emitPackage = [&](const PackageStruct &pkg) {
+    bool flatpak = pkg.source == PackageSource::Flatpak;
+    std::string name = flatpak ? pkg.ref : pkg.name;
+    double score = scoreSearchMatch(name, flatpak ? pkg.name : "",
+                                    pkg.description, query)
+                       .value_or(0.0);
+    bool installed = flatpak ? apps.count(name) > 0 : packages.count(name) > 0;
+    std::string repo = flatpak ? pkg.remote
+                       : pkg.source == PackageSource::Aur ? "aur"
+                                                          : "";
+    stopped = stopped ||
+              !emit(name, pkg.version, pkg.source, repo, installed, score);
+  };
+  bool streaming = searchSort == "none";
+  auto results = searchForPackages(
+      joinStrings(searchTerms, " "), [&](const PackageStruct &pkg) {
+        if (streaming && !stopped) {
+          emitPackage(pkg);
+        }
+      });
+  if (!streaming) {
+    std::vector<std::pair<double, const PackageStruct *>> ranked;
+    for (const auto &pkg : results) {
+      bool flatpak = pkg.source == PackageSource::Flatpak;
+      ranked.emplace_back(
+          scoreSearchMatch(flatpak ? pkg.ref : pkg.name,
+                           flatpak ? pkg.name : "", pkg.description, query)
+              .value_or(0.0),
+          &pkg);
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+                     [&](const auto &a, const auto &b) {
+                       if (searchSort == "name") {
+                         return a.second->name < b.second->name;
+                       }
+                       if (searchSort == "source") {
+                         return a.second->source < b.second->source;
+                       }
+                       return a.first > b.first;
+                     });
+    for (const auto &[score, pkg] : ranked) {
+      if (stopped) {
+        break;
+      }
+      emitPackage(*pkg);
+    }
+  }
+  return printed + skipped > 0 ? 0 : 1;
+}
+
+const std::thread::id mainThreadId = std::this_thread::get_id();
+
+// Runs on the main thread only. The prefetch worker is stopped before
+// exiting, so no std::thread is still joinable when statics are destroyed.
+void askForSudoPassword() {
+  std::cout << INPUT_COLOR << "Entering Package Installation Mode...\n"
+            << RESET_COLOR;
+  if (std::system("sudo -v") != 0) {
+    std::cerr << ERROR_COLOR << "Failed to authenticate with sudo. Exiting...\n"
+              << RESET_COLOR;
+    cancelPrefetch();
+    std::exit(1);
+  }
+}
+
+// sudo forgets the password after its timeout (15 minutes by default), and
+// a long gaming or AUR run outlasts that. Once authenticated, the timestamp
+// is refreshed every minute without prompting, so commands on worker
+// threads and the prefetch's "sudo -n" downloads keep working.
+constexpr auto SUDO_REFRESH_INTERVAL = std::chrono::seconds(60);
+
+void keepSudoAlive() {
+  std::thread([] {
+    do {
+      std::this_thread::sleep_for(SUDO_REFRESH_INTERVAL);
+    } while (std::system("sudo -n -v > /dev/null 2>&1") == 0);
+  }).detach();
+}
+
+// Ask for the sudo password right before the first command that needs it,
+// instead of at startup; searching and browsing menus never need root.
+// "sudo -n" commands never prompt and are left alone; yay runs sudo itself.
+// Only the main thread prompts: worker threads (AUR builds, image roots,
+// the prefetch) run while the progress display is drawing, and never reach
+// sudo before the main thread has authenticated or in headless mode.
+void ensureSudoFor(const std::string &command) {
+  static std::once_flag authenticated;
+  bool privileged = command.find("sudo ") != std::string::npos ||
+                    command.find("yay -S") != std::string::npos;
+  if (!privileged || command.find("sudo -n") != std::string::npos ||
+      headlessMode || geteuid() == 0 ||
+      std::this_thread::get_id() != mainThreadId) {
+    return;
+  }
+  std::call_once(authenticated, [] {
+    askForSudoPassword();
+    keepSudoAlive();
+  });
+  // The timestamp can still lapse (a suspended laptop, a short sudoers
+  // timeout). Prompt here in the open rather than inside a quiet command,
+  // whose password prompt would go to the step log.
+  if (std::system("sudo -n true > /dev/null 2>&1") != 0) {
+    askForSudoPassword();
+  }
+}
+
+// Main menu and input handling
+std::vector<std::string> getSimpleMenuDescriptions() {
+  return {"Setup Shell (Zsh)",
+          "Install Developer Tools",
+          "Setup Gaming",
+          "Install LunarVim",
+          "Install Doom Emacs",
+          "Install Terminals",
+          "Search & Download a Package [not for yay currently]",
+          "Setup Yay (AUR Helper)",
+          "Setup Flatpak",
+          "Exit"};
+}
+
+std::vector<std::string> getDetailedMenuDescriptions() {
+  /* CAN BE IMPLEMENTED LATER */
+  return getSimpleMenuDescriptions();
+}
+
+void displayMenu(const std::vector<MenuItem> &menuItems) {
+    struct winsize w;
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+
+    clearScreen();
+
+    int contentHeight = menuItems.size() + 6;
+    int verticalPadding = (w.ws_row - contentHeight) / 2;
+
+    for (int i = 0; i < verticalPadding; ++i) {
+        std::cout << "\n";
+    }
+
+    printHeader("Arch Linux Setup Menu");
+
+    for (size_t i = 0; i < menuItems.size(); ++i) {
+        std::cout << GRUVBOX_YELLOW << " [" << (i + 1) << "] " << RESET_COLOR 
+                  << GRUVBOX_FG << menuItems[i].description << RESET_COLOR << "\n";
+    }
+
+    printSeparator();
+    printPrompt("Choose an option (1-" + std::to_string(menuItems.size()) + "), or [q] to quit");
+}
+
+void handleMenuChoice(const std::vector<MenuItem> &menuItems, int choice) {
+  if (choice < 1 || choice > static_cast<int>(menuItems.size())) {
+    std::cout << ERROR_COLOR << "Invalid option! Please try again.\n"
+              << RESET_COLOR;
+  } else {
+    menuItems[choice - 1].action();
+    printSeparator();
+  }
+}
+
+// YAY
+void setupYay() {
+  if (isPackageInstalled("yay")) {
+    std::cout << SUCCESS_COLOR << "Yay is already installed.\n" << RESET_COLOR;
+    return;
+  }
+
+  std::cout << INPUT_COLOR << "Installing yay (AUR helper)...\n" << RESET_COLOR;
+
+  // Build and install yay through the AUR build stage
+  installAurPackages({"yay"});
+
+  if (isPackageInstalled("yay")) {
+    std::cout << SUCCESS_COLOR << "Yay installed successfully.\n"
+              << RESET_COLOR;
+  } else {
+    std::cerr << ERROR_COLOR << "Failed to install yay.\n" << RESET_COLOR;
+  }
+}
+
+// Provisioning Journal
+// Completed steps are appended to <state>/journal as "<step>\t<fingerprint>"
+// lines. Each append is a single write() followed by fsync(), so a crash can
+// at worst leave a torn last line, which is ignored when loading.
+thread_local std::unordered_map<std::string, std::string> journalEntries;
+thread_local bool journalLoaded = false;
+std::mutex journalMutex;
+
+// $XDG_STATE_HOME/arch-setup, falling back to ~/.local/state/arch-setup.
+// Target roots keep their own state inside the root.
+std::string stateDirectory() {
+  const char *xdgState = targetRoot.empty() ? std::getenv("XDG_STATE_HOME")
+                                            : nullptr;
+  std::string base = (xdgState && *xdgState)
+                         ? std::string(xdgState)
+                         : homeDirectory() + "/.local/state";
+  return base + "/arch-setup";
+}
+
+std::string joinStrings(const std::vector<std::string> &parts,
+                        const std::string &separator) {
+  std::string joined;
+  for (size_t i = 0; i < parts.size(); ++i) {
+    joined += (i ? separator : "") + parts[i];
+  }
+  return joined;
+}
+
+void loadJournal() {
+  if (journalLoaded) {
+    return;
+  }
+  journalLoaded = true;
+
+  std::ifstream journal(stateDirectory() + "/journal");
+  std::string line;
+  while (std::getline(journal, line)) {
+    size_t tab = line.find('\t');
+    if (journal.eof() || tab == std::string::npos) {
+      continue; // torn write from an interrupted run
+    }
+    journalEntries[line.substr(0, tab)] = line.substr(tab + 1);
+  }
+}
+
+bool recordCompletedStep(const std::string &stepId,
+                         const std::string &fingerprint) {
+  std::string directory = stateDirectory();
+  std::error_code ec;
+  bool created = fs::create_directories(directory, ec);
+
+  std::string path = directory + "/journal";
+  int fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  std::string line = stepId + "\t" + fingerprint + "\n";
+
+  // Start on a fresh line if an interrupted run left a torn entry behind
+  off_t size = lseek(fd, 0, SEEK_END);
+  char last = '\n';
+  if (size > 0 && pread(fd, &last, 1, size - 1) == 1 && last != '\n') {
+    line.insert(line.begin(), '\n');
+  }
+
+  bool written = write(fd, line.data(), line.size()) ==
+                 static_cast<ssize_t>(line.size());
+  written = fsync(fd) == 0 && written;
+  close(fd);
+
+  // Make the new directory entries durable as well
+  if (created) {
+    int dirFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirFd >= 0) {
+      fsync(dirFd);
+      close(dirFd);
+    }
+  }
+
+  if (written) {
+    journalEntries[stepId] = fingerprint;
+  }
+  return written;
+}
+
+// Run a setup step unless the journal already has it completed with the same
+// inputs. Returns true if the step succeeded now or earlier.
+bool runJournaledStep(const std::string &stepId, const std::string &inputs,
+                      const std::function<bool()> &step) {
+  std::string fingerprint = toHex(fnv1a64(inputs));
+  bool forced = forcedSteps.count(stepId) || forcedSteps.count("all");
+  if (!forced && probeConverged(stepId)) {
+    std::cout << SUCCESS_COLOR << "Skipping " << stepId
+              << ": already in place.\n"
+              << RESET_COLOR;
+    return true;
+  }
+  {
+    std::lock_guard<std::mutex> lock(journalMutex);
+    loadJournal();
+    auto entry = journalEntries.find(stepId);
+    if (!forced && entry != journalEntries.end() &&
+        entry->second == fingerprint) {
+      std::cout << SUCCESS_COLOR << "Skipping " << stepId
+                << ": already completed (--force-step=" << stepId
+                << " to redo it).\n"
+                << RESET_COLOR;
+      return true;
+    }
+  }
+
+  // Quiet mode keeps the step's output for the log file and failure dumps
+  auto previousLog = currentStepLog;
+  if (!verboseMode) {
+    currentStepLog = beginStepLog(stepId);
+  }
+  bool succeeded = step();
+  if (!succeeded) {
+    printStepLogTail();
+  }
+  if (!verboseMode) {
+    endStepLog(currentStepLog);
+    currentStepLog = previousLog;
+  }
+  if (!succeeded) {
+    noteProvisioningFailure();
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(journalMutex);
+  if (!recordCompletedStep(stepId, fingerprint)) {
+    std::cerr << ERROR_COLOR << "Could not record step " << stepId
+              << " in the journal.\n"
+              << RESET_COLOR;
+  }
+  return true;
+}
+
+// Provisioning Plan
+// Several profiles run as one pass: their packages are merged into a single
+// deduplicated set installed up front (one pacman transaction for repo
+// packages, one AUR batch), then each profile's remaining steps run in
+// dependency order and find their packages already in place.
+
+// Selected profiles with their prerequisites ordered first
+std::vector<const ProvisioningProfile *>
+planProfiles(const std::vector<std::string> &profileIds) {
+  std::vector<const ProvisioningProfile *> ordered;
+  std::unordered_set<std::string> placed;
+  std::unordered_set<std::string> selected(profileIds.begin(),
+                                           profileIds.end());
+  std::function<void(const ProvisioningProfile *)> place =
+      [&](const ProvisioningProfile *profile) {
+        if (!placed.insert(profile->id).second) {
+          return;
+        }
+        for (const auto &prerequisite : profile->after) {
+          const ProvisioningProfile *before = findProfile(prerequisite);
+          if (before != nullptr && selected.count(prerequisite)) {
+            place(before);
+          }
+        }
+        ordered.push_back(profile);
+      };
+  for (const auto &id : profileIds) {
+    if (const ProvisioningProfile *profile = findProfile(id)) {
+      place(profile);
+    }
   }
+  return ordered;
+}
 
-  // Install Zsh Syntax Highlighting via Homebrew
-  runCommand("brew install zsh-syntax-highlighting");
+// Union of the profiles' packages, first occurrence wins. Alternatives
+// (terminal: wezterm or kitty) are left to the profile's action unless
+// includeAlternatives is set, as for bundles and downloads.
+std::vector<std::string>
+mergedPackages(const std::vector<const ProvisioningProfile *> &profiles,
+               bool includeAlternatives) {
+  std::vector<std::string> packages;
+  std::unordered_set<std::string> seen;
+  for (const auto *profile : profiles) {
+    if (profile->alternatives && !includeAlternatives) {
+      continue;
+    }
+    for (const auto &pkg : profile->packages) {
+      if (seen.insert(pkg).second) {
+        packages.push_back(pkg);
+      }
+    }
+  }
+  return packages;
+}
 
-  // Clone zsh-autosuggestions (already handled in .zshrc)
-  std::cout << INPUT_COLOR << "Installing zsh-autosuggestions...\n"
+bool installMergedPackages(
+    const std::vector<const ProvisioningProfile *> &profiles) {
+  std::vector<std::string> packages = mergedPackages(profiles);
+  size_t total = 0;
+  for (const auto *profile : profiles) {
+    if (!profile->alternatives) {
+      total += profile->packages.size();
+    }
+  }
+  std::cout << INPUT_COLOR << packages.size() << " unique packages across "
+            << profiles.size() << " profiles (" << total - packages.size()
+            << " duplicates merged).\n"
             << RESET_COLOR;
-  runCommand("git clone https://github.com/zsh-users/zsh-autosuggestions "
-             "~/.zsh/zsh-autosuggestions");
-
-  setZshAsDefaultShell();
-
-  applyConfig("https://gist.githubusercontent.com/adityanav123/"
-              "00f0dd587acd1a664e0de5ccf295513e/raw",
-              std::string(getenv("HOME")) + "/.zshrc");
 
-  setupStarshipTheme();
+  std::vector<std::string> sorted = packages;
+  std::sort(sorted.begin(), sorted.end());
+  return runJournaledStep("plan.packages", joinStrings(sorted, " "), [&] {
+    return installPackages(packages, "--needed");
+  });
+}
 
-  std::cout << SUCCESS_COLOR << ".zshrc updated.\n" << RESET_COLOR;
+void runProvisioningPlan(const std::vector<std::string> &profileIds) {
+  auto profiles = planProfiles(profileIds);
+  if (profiles.empty()) {
+    return;
+  }
+  installMergedPackages(profiles);
+  for (const auto *profile : profiles) {
+    printHeader(profile->title);
+    profile->action();
+  }
 }
 
-// Gaming environment setup
-void gamingSetup() {
-  std::cout << INPUT_COLOR << "Installing gaming tools and libraries...\n"
-            << RESET_COLOR;
+// Tick several profiles, then run them as one plan
+void multiSelectProfilesMenu() {
+  const auto &profiles = getProfiles();
+  std::vector<bool> ticked(profiles.size(), false);
 
-  installPackage("mesa", "--needed");
-  installPackage("lib32-mesa", "--needed");
+  while (true) {
+    clearScreen();
+    printHeader("Provision Several Profiles");
+    for (size_t i = 0; i < profiles.size(); ++i) {
+      std::cout << GRUVBOX_YELLOW << " [" << (i + 1) << "] " << RESET_COLOR
+                << (ticked[i] ? GRUVBOX_GREEN : GRUVBOX_FG)
+                << (ticked[i] ? "[x] " : "[ ] ") << profiles[i].title
+                << RESET_COLOR << "\n";
+    }
+    printSeparator();
+    printPrompt("Toggle profiles (e.g. 1 3 5), [a] to apply, or [q] to go "
+                "back");
 
-  std::vector<std::string> nvidia_gpu_packages{
-      "nvidia",   "nvidia-utils",   "lib32-nvidia-utils",
-      "libvdpau", "lib32-libvdpau", "nvidia-settings"};
-  for (const auto &pkg : nvidia_gpu_packages)
-    installPackage(pkg, "--needed");
+    std::string choice;
+    if (!std::getline(std::cin, choice) || choice == "q" || choice == "Q") {
+      return;
+    }
+    if (choice == "a" || choice == "A") {
+      std::vector<std::string> selected;
+      for (size_t i = 0; i < profiles.size(); ++i) {
+        if (ticked[i]) {
+          selected.push_back(profiles[i].id);
+        }
+      }
+      if (selected.empty()) {
+        continue;
+      }
+      clearScreen();
+      runProvisioningPlan(selected);
+      std::cout << "\nPress Enter to continue...";
+      std::cin.get();
+      return;
+    }
 
-  std::vector<std::string> intel_gpu_packages{
-      "vulkan-intel", "intel-media-driver", "libva-intel-driver"};
-  for (const auto &pkg : intel_gpu_packages)
-    installPackage(pkg, "--needed");
+    std::istringstream numbers(choice);
+    size_t number;
+    while (numbers >> number) {
+      if (number >= 1 && number <= profiles.size()) {
+        ticked[number - 1] = !ticked[number - 1];
+      }
+    }
+  }
+}
 
-  std::vector<std::string> wine_dependencies{
-      "giflib",  "lib32-giflib",  "libpng", "lib32-libpng",
-      "libldap", "lib32-libldap", "gnutls", "lib32-gnutls"};
-  for (const auto &pkg : wine_dependencies)
-    installPackage(pkg, "--needed");
+// Provisioning Profiles
+// Common gaming stack plus the drivers for the GPUs in this machine
+std::vector<std::string> gamingPackages() {
+  std::vector<std::string> packages = {
+      "mesa", "lib32-mesa",
+      // Wine dependencies
+      "giflib", "lib32-giflib", "libpng", "lib32-libpng", "libldap",
+      "lib32-libldap", "gnutls", "lib32-gnutls",
+      // Gaming tools
+      "protonup-qt", "lutris", "steam", "gamemode", "lib32-gamemode",
+      "wine-staging", "wine", "vkd3d", "lib32-vkd3d", "faudio",
+      "lib32-faudio"};
+  for (const auto &driver : gpuDriverPackages(detectGpus())) {
+    packages.push_back(driver);
+  }
+  return packages;
+}
 
-  installPackage("protonup-qt", "--needed");
+const std::vector<ProvisioningProfile> &getProfiles() {
+  static const std::vector<ProvisioningProfile> profiles = {
+      {"shell",
+       "Setup Shell (Zsh)",
+       {"zsh", "ttf-recursive", "ttf-recursive-nerd", "ttf-firacode-nerd",
+        "pfetch", "starship", "eza"},
+       {ZSHRC_CONFIG_URL},
+       {ZSH_AUTOSUGGESTIONS_REPO, CATPPUCCIN_STARSHIP_REPO},
+       setupShell,
+       {"yay"}},
+      {"dev",
+       "Install Developer Tools",
+       {"git", "neovim", "clang", "llvm", "gdb", "lldb", "emacs"},
+       {},
+       {},
+       developerSetup,
+       {}},
+      {"gaming",
+       "Setup Gaming",
+       gamingPackages(),
+       {},
+       {},
+       gamingSetup,
+       {}},
+      {"lvim",
+       "Install LunarVim",
+       {"git", "make", "python-pip", "npm", "nodejs", "ripgrep", "lazygit",
+        "python-pynvim", "curl"},
+       {LVIM_CONFIG_URL},
+       {},
+       setupLVim,
+       {}},
+      {"doom",
+       "Install Doom Emacs",
+       {"emacs", "git"},
+       {},
+       {DOOMEMACS_REPO, DOOM_CONFIG_REPO},
+       setupDoomEmacs,
+       {}},
+      {"terminal",
+       "Install Terminals",
+       {"wezterm", "kitty"},
+       {WEZTERM_CONFIG_URL, KITTY_CONFIG_URL},
+       {},
+       setupTerminal,
+       {},
+       true},
+      {"yay", "Setup Yay (AUR Helper)", {"base-devel", "git"}, {}, {},
+       setupYay, {}},
+      {"flatpak", "Setup Flatpak", {"flatpak"}, {}, {}, setupFlatpak, {}}};
+  return profiles;
+}
 
-  std::vector<std::string> gaming_tools{
-      "lutris", "steam", "gamemode",    "lib32-gamemode", "wine-staging",
-      "wine",   "vkd3d", "lib32-vkd3d", "faudio",         "lib32-faudio"};
-  for (const auto &pkg : gaming_tools)
-    installPackage(pkg, "--needed");
+const ProvisioningProfile *findProfile(const std::string &id) {
+  for (const auto &profile : getProfiles()) {
+    if (profile.id == id) {
+      return &profile;
+    }
+  }
+  return nullptr;
+}
 
-  // Add user to gamemode group
-  std::cout << INPUT_COLOR << "Setting up gamemode.\n" << RESET_COLOR;
-  runCommand("sudo usermod -aG gamemode $USER");
+// Drift Detection
+// Names of installed packages, read from the local pacman database directory
+// (entries are <name>-<pkgver>-<pkgrel>) without running pacman
+std::unordered_set<std::string> localPackageNames() {
+  std::unordered_set<std::string> names;
+  std::error_code ec;
+  for (const auto &entry :
+       fs::directory_iterator(targetRoot + "/var/lib/pacman/local", ec)) {
+    if (!entry.is_directory()) {
+      continue;
+    }
+    std::string name = entry.path().filename().string();
+    for (int i = 0; i < 2; ++i) {
+      size_t dash = name.rfind('-');
+      if (dash == std::string::npos) {
+        break;
+      }
+      name.resize(dash);
+    }
+    names.insert(name);
+  }
+  return names;
+}
 
-  // running gamemode test
-  std::cout << INPUT_COLOR << "Running gamemode tests.\n" << RESET_COLOR;
-  runCommand("gamemoded -t");
+std::string configHashRecordPath(const std::string &configPath) {
+  return stateDirectory() + "/configs/" + toHex(fnv1a64(configPath));
+}
 
-  std::cout << SUCCESS_COLOR << "Gaming environment setup complete.\n"
-            << RESET_COLOR;
+// Remember the hash of a config we applied, for the drift probes
+void recordConfigHash(const std::string &configPath) {
+  std::error_code ec;
+  fs::create_directories(stateDirectory() + "/configs", ec);
+  std::ofstream record(configHashRecordPath(configPath), std::ios::trunc);
+  record << toHex(fnv1a64(readFileContents(configPath))) << "\n";
 }
 
-// Developer tools setup
-void developerSetup() {
-  std::cout << INPUT_COLOR << "Installing developer tools...\n" << RESET_COLOR;
-  std::vector<std::string> devTools{"git", "neovim", "clang", "llvm",
-                                    "gdb", "lldb",   "emacs"};
-  for (const auto &pkg : devTools)
-    installPackage(pkg);
+StateProbe packagesProbe(const std::string &stepId,
+                         const std::vector<std::string> &packages) {
+  return {stepId, "installed: " + joinStrings(packages, " "),
+          [packages](std::string &actual) {
+            auto installed = localPackageNames();
+            std::vector<std::string> missing;
+            for (const auto &pkg : packages) {
+              if (!installed.count(pkg)) {
+                missing.push_back(pkg);
+              }
+            }
+            actual = missing.empty() ? "all installed"
+                                     : "missing: " + joinStrings(missing, " ");
+            return missing.empty();
+          }};
 }
 
-// Setup LunarVim
-void setupLVim() {
-  std::cout << INPUT_COLOR << "Setting up LunarVim...\n" << RESET_COLOR;
-  std::vector<std::string> lvim_dependencies{
-      "git",     "make",    "python-pip",    "npm", "nodejs",
-      "ripgrep", "lazygit", "python-pynvim", "curl"};
-  for (const auto &pkg : lvim_dependencies)
-    installPackage(pkg, "--needed");
+StateProbe pathProbe(const std::string &stepId, const std::string &path) {
+  return {stepId, "present: " + path, [path](std::string &actual) {
+            bool present = fs::exists(path);
+            actual = present ? "present" : "missing";
+            return present;
+          }};
+}
 
-  // Node.js global setup
-  std::cout << INPUT_COLOR << "Setting up npm global directory...\n"
-            << RESET_COLOR;
-  runCommand("mkdir -p ~/.npm-global/lib");
-  runCommand("npm config set prefix '~/.npm-global'");
+StateProbe configProbe(const std::string &stepId,
+                       const std::string &configPath) {
+  return {stepId, "applied config: " + configPath,
+          [configPath](std::string &actual) {
+            if (!fs::exists(configPath)) {
+              actual = "missing";
+              return false;
+            }
+            std::string recorded =
+                readFileContents(configHashRecordPath(configPath));
+            std::string current =
+                toHex(fnv1a64(readFileContents(configPath))) + "\n";
+            actual = recorded.empty()       ? "not applied by arch-setup"
+                     : recorded == current ? "matches applied config"
+                                           : "modified since applied";
+            return recorded == current;
+          }};
+}
 
-  // Update system path for npm global directory
-  std::string profilePath = std::string(getenv("HOME")) + "/.profile";
-  std::ofstream profileFile(profilePath, std::ios_base::app);
-  if (profileFile.is_open()) {
-    profileFile << "\nexport PATH=~/.npm-global/bin:$PATH\n";
-    profileFile.close();
+std::string homebrewBinary() {
+  for (const std::string &path :
+       {std::string("/home/linuxbrew/.linuxbrew/bin/brew"),
+        homeDirectory() + "/.linuxbrew/bin/brew",
+        std::string("/opt/homebrew/bin/brew")}) {
+    if (fs::exists(path)) {
+      return path;
+    }
   }
-  runCommand("source ~/.profile");
-
-  // Test npm global setup by installing a package
-  /* std::cout << INPUT_COLOR << "Testing npm global installation with
-   jshint...\n"
-             << RESET_COLOR;
-   runCommand("npm install -g jshint");
- */
-  // Cargo Setup
-  std::string cargoInstallCommand =
-      "curl --proto '=https' --tlsv1.2 -sSf https://sh.rustup.rs | sh -s -- -y";
-  std::cout << INPUT_COLOR << "Installing Rust.\n" << RESET_COLOR;
+  return "";
+}
 
-  runCommand(cargoInstallCommand);
+// Login shell of a user, read from the target root's /etc/passwd
+std::string loginShell(const std::string &user) {
+#ifndef ARCH_SETUP_STATIC
+  // Static builds read /etc/passwd directly: NSS would need the shared
+  // libraries of the glibc they were linked against
+  if (targetRoot.empty()) {
+    struct passwd *pw = getpwnam(user.c_str());
+    return pw ? pw->pw_shell : "unknown user";
+  }
+#endif
+  std::istringstream passwdFile(readFileContents(targetRoot + "/etc/passwd"));
+  std::string line;
+  while (std::getline(passwdFile, line)) {
+    if (line.rfind(user + ":", 0) == 0) {
+      return line.substr(line.rfind(':') + 1);
+    }
+  }
+  return "unknown user";
+}
 
-  // Source cargo environment to avoid restart
-  std::string cargoEnvPath = std::string(getenv("HOME")) + "/.cargo/env";
-  runCommand("source " + cargoEnvPath);
-
-  if (isCommandSuccessful(
-          "LV_BRANCH='release-1.4/neovim-0.9' bash <(curl -s "
-          "https://raw.githubusercontent.com/LunarVim/LunarVim/release-1.4/"
-          "neovim-0.9/utils/installer/install.sh)")) {
-    std::cout << SUCCESS_COLOR << "LunarVim installed successfully.\n"
-              << RESET_COLOR;
-    std::string lVimConfigPath =
-        std::string(getenv("HOME")) + "/.config/lvim/config.lua";
-    applyConfig("https://gist.githubusercontent.com/adityanav123/"
-                "2e708e777628d3914cf59e5d1f332f20/raw",
-                lVimConfigPath);
-  } else {
-    std::cerr << ERROR_COLOR << "Failed to install LunarVim.\n" << RESET_COLOR;
+// Members of a group, read from the target root's /etc/group. nullopt when
+// the group does not exist.
+std::optional<std::vector<std::string>>
+groupMembers(const std::string &groupName) {
+  std::vector<std::string> members;
+#ifndef ARCH_SETUP_STATIC
+  if (targetRoot.empty()) {
+    struct group *gr = getgrnam(groupName.c_str());
+    if (gr == nullptr) {
+      return std::nullopt;
+    }
+    for (char **member = gr->gr_mem; *member; ++member) {
+      members.push_back(*member);
+    }
+    return members;
+  }
+#endif
+  std::istringstream groupFile(readFileContents(targetRoot + "/etc/group"));
+  std::string line;
+  while (std::getline(groupFile, line)) {
+    if (line.rfind(groupName + ":", 0) != 0) {
+      continue;
+    }
+    std::istringstream memberList(line.substr(line.rfind(':') + 1));
+    std::string member;
+    while (std::getline(memberList, member, ',')) {
+      members.push_back(member);
+    }
+    return members;
   }
+  return std::nullopt;
 }
 
-// Setup Doom Emacs
-void setupDoomEmacs() {
-  std::cout << INPUT_COLOR << "Setting up Doom Emacs...\n" << RESET_COLOR;
+// Probes are built once per target root; each root resolves its own home
+const std::vector<StateProbe> &getStateProbes() {
+  static std::mutex probesMutex;
+  static std::unordered_map<std::string, std::vector<StateProbe>> probesByRoot;
+  std::lock_guard<std::mutex> lock(probesMutex);
+  auto existing = probesByRoot.find(targetRoot);
+  if (existing != probesByRoot.end()) {
+    return existing->second;
+  }
 
-  installPackage("emacs", "--needed");
-  installPackage("git", "--needed");
+  const auto &probes = probesByRoot[targetRoot] = [] {
+    std::string home = homeDirectory();
+    std::string user = targetUser();
 
-  std::string emacsConfigPath = std::string(getenv("HOME")) + "/.config/emacs";
+    std::vector<StateProbe> list;
+    for (const auto &profile : getProfiles()) {
+      if (!profile.alternatives) {
+        list.push_back(packagesProbe(profile.id + ".packages",
+                                     profile.packages));
+      }
+    }
 
-  std::string cloneCommand =
-      "git clone --depth 1 https://github.com/doomemacs/doomemacs " +
-      emacsConfigPath;
+    list.push_back({"shell.default-shell", "login shell: zsh",
+                    [user](std::string &actual) {
+                      actual = loginShell(user);
+                      return actual.size() >= 4 &&
+                             actual.substr(actual.size() - 4) == "/zsh";
+                    }});
+    list.push_back({"shell.homebrew", "brew installed",
+                    [](std::string &actual) {
+                      actual = homebrewBinary();
+                      bool present = !actual.empty();
+                      if (!present) {
+                        actual = "missing";
+                      }
+                      return present;
+                    }});
+    list.push_back({"shell.zsh-syntax-highlighting",
+                    "brew formula zsh-syntax-highlighting",
+                    [](std::string &actual) {
+                      std::string brew = homebrewBinary();
+                      bool present =
+                          !brew.empty() &&
+                          fs::exists(fs::path(brew).parent_path() /
+                                     "../share/zsh-syntax-highlighting");
+                      actual = present ? "installed" : "missing";
+                      return present;
+                    }});
+    list.push_back(pathProbe("shell.zsh-autosuggestions",
+                             home + "/.zsh/zsh-autosuggestions/.git"));
+    list.push_back(configProbe("shell.zshrc", home + "/.zshrc"));
+
+    list.push_back({"gaming.gamemode-group", "member of group gamemode",
+                    [user](std::string &actual) {
+                      auto members = groupMembers("gamemode");
+                      if (!members) {
+                        actual = "group gamemode does not exist";
+                        return false;
+                      }
+                      bool member = std::find(members->begin(), members->end(),
+                                              user) != members->end();
+                      actual = member ? "member" : "not a member";
+                      return member;
+                    }});
+
+    list.push_back(pathProbe("lvim.rust", home + "/.cargo/bin/rustc"));
+    list.push_back(pathProbe("lvim.install", home + "/.local/bin/lvim"));
+    list.push_back(
+        configProbe("lvim.config", home + "/.config/lvim/config.lua"));
+
+    list.push_back(pathProbe("doom.clone", home + "/.config/emacs/bin/doom"));
+    list.push_back(pathProbe("doom.config", home + "/.config/doom/.git"));
+    list.push_back(packagesProbe("doom.emms", {"emms"}));
+
+    list.push_back(packagesProbe("terminal.wezterm", {"wezterm"}));
+    list.push_back(configProbe("terminal.wezterm-config",
+                               home + "/.config/wezterm/wezterm.lua"));
+    list.push_back(packagesProbe("terminal.kitty", {"kitty"}));
+    list.push_back(configProbe("terminal.kitty-config",
+                               home + "/.config/kitty/kitty.conf"));
+
+    list.push_back(packagesProbe("yay.yay", {"yay"}));
+    std::string flatpakConfig = targetRoot + "/var/lib/flatpak/repo/config";
+    list.push_back({"flatpak.flathub", "flathub remote configured",
+                    [flatpakConfig](std::string &actual) {
+                      bool present =
+                          readFileContents(flatpakConfig)
+                              .find("[remote \"flathub\"]") !=
+                          std::string::npos;
+                      actual = present ? "configured" : "missing";
+                      return present;
+                    }});
+    return list;
+  }();
+  return probes;
+}
 
-  if (isCommandSuccessful(cloneCommand)) {
-    std::cout << SUCCESS_COLOR << "Doom Emacs cloned successfully.\n"
-              << RESET_COLOR;
-  } else {
-    std::cerr << ERROR_COLOR << "Failed to clone Doom Emacs.\n" << RESET_COLOR;
-    return;
+// True if the step has a probe and the machine already matches it
+bool probeConverged(const std::string &stepId) {
+  for (const auto &probe : getStateProbes()) {
+    if (probe.id == stepId) {
+      std::string actual;
+      return probe.check(actual);
+    }
   }
+  return false;
+}
 
-  std::cout << SUCCESS_COLOR << "Starting Doom Install!" << RESET_COLOR
-            << std::endl;
-  // DOOM INSTALL
-  std::string doomInstallCommand = emacsConfigPath + "/bin/doom install";
+// Run every probe (or one profile's) concurrently
+std::vector<ProbeResult> runStateProbes(const std::string &profileId) {
+  std::vector<const StateProbe *> selected;
+  for (const auto &probe : getStateProbes()) {
+    if (profileId.empty() || probe.id.rfind(profileId + ".", 0) == 0) {
+      selected.push_back(&probe);
+    }
+  }
 
-  if (isCommandSuccessful(doomInstallCommand)) {
-    std::cout << SUCCESS_COLOR << "Doom Emacs installed successfully.\n"
-              << RESET_COLOR;
-  } else {
-    std::cerr << ERROR_COLOR << "Failed to install Doom Emacs.\n"
-              << RESET_COLOR;
-    return;
+  std::vector<std::future<ProbeResult>> pending;
+  for (const auto *probe : selected) {
+    pending.push_back(
+        std::async(std::launch::async, [probe, root = targetRoot] {
+          targetRoot = root;
+          ProbeResult result{probe->id, probe->desired, "", false};
+          result.converged = probe->check(result.actual);
+          return result;
+        }));
   }
 
-  std::string doomConfigPath = std::string(getenv("HOME")) + "/.config/doom/";
-  std::vector<std::string> filesToRemove = {doomConfigPath + "package.el",
-                                            doomConfigPath + "config.el",
-                                            doomConfigPath + "init.el"};
+  std::vector<ProbeResult> results;
+  for (auto &future : pending) {
+    results.push_back(future.get());
+  }
+  return results;
+}
 
-  for (const auto &filePath : filesToRemove) {
-    if (fs::exists(filePath)) {
-      std::cout << INPUT_COLOR << "Removing existing file: " << filePath
-                << RESET_COLOR << "\n";
-      fs::remove(filePath); // Remove the file
+// Print desired vs actual state, returns true if everything is converged
+bool reportSystemState(const std::string &profileId) {
+  auto start = std::chrono::steady_clock::now();
+  auto results = runStateProbes(profileId);
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  size_t drifted = 0;
+  for (const auto &result : results) {
+    if (result.converged) {
+      std::cout << SUCCESS_COLOR << " [ok]    " << RESET_COLOR << result.id
+                << "\n";
+    } else {
+      ++drifted;
+      std::cout << ERROR_COLOR << " [drift] " << RESET_COLOR << result.id
+                << "\n"
+                << "         desired: " << result.desired << "\n"
+                << "         actual:  " << result.actual << "\n";
     }
   }
 
-  std::string cloneConfigCommand =
-      "git clone https://github.com/adityanav123/MyDoomEmacsSetup " +
-      doomConfigPath;
-
-  if (isCommandSuccessful(cloneConfigCommand)) {
-    std::cout << SUCCESS_COLOR
-              << "Your Doom Emacs configuration cloned successfully.\n"
+  printSeparator();
+  if (drifted == 0) {
+    std::cout << SUCCESS_COLOR << "System is converged (" << results.size()
+              << " probes in " << elapsed.count() << " ms).\n"
               << RESET_COLOR;
   } else {
-    std::cerr << ERROR_COLOR
-              << "Failed to clone your Doom Emacs configuration.\n"
+    std::cout << ERROR_COLOR << drifted << " of " << results.size()
+              << " probes drifted (" << elapsed.count() << " ms).\n"
               << RESET_COLOR;
-    return;
   }
+  return drifted == 0;
+}
 
-  // Install 'emms' package
-  std::cout << INPUT_COLOR << "Installing emms (Emacs Multimedia package)...\n"
-            << RESET_COLOR;
-  if (!installPackage("emms")) {
-    std::cerr << ERROR_COLOR << "Failed to install emms package.\n"
-              << RESET_COLOR;
+// Headless Apply
+std::string jsonEscape(const std::string &text) {
+  std::string escaped;
+  for (char c : text) {
+    switch (c) {
+    case '"':
+      escaped += "\\\"";
+      break;
+    case '\\':
+      escaped += "\\\\";
+      break;
+    case '\n':
+      escaped += "\\n";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char code[8];
+        std::snprintf(code, sizeof(code), "\\u%04x", c);
+        escaped += code;
+      } else {
+        escaped += c;
+      }
+    }
   }
+  return escaped;
+}
 
-  // DOOM SYNC
-  std::string doomSyncCommand = emacsConfigPath + "/bin/doom sync";
-  if (isCommandSuccessful(doomSyncCommand)) {
-    std::cout << SUCCESS_COLOR << "Doom Emacs synchronized successfully.\n"
-              << RESET_COLOR;
-  } else {
-    std::cerr << ERROR_COLOR << "Failed to synchronize Doom Emacs.\n"
-              << RESET_COLOR;
+// arch-setup apply --profile a,b [--yes] [--answers FILE] [--results FILE]
+// Runs the profiles without a TTY and writes one JSON object per profile
+// (NDJSON) to the results file, or stdout.
+int runHeadlessApply() {
+  headlessMode = true;
+
+  if (!isatty(resultsFilePath.empty() ? STDERR_FILENO : STDOUT_FILENO)) {
+    RESET_COLOR = GRUVBOX_BG = GRUVBOX_FG = GRUVBOX_RED = GRUVBOX_GREEN =
+        GRUVBOX_YELLOW = GRUVBOX_BLUE = GRUVBOX_PURPLE = GRUVBOX_AQUA =
+            GRUVBOX_ORANGE = "";
+  }
+  // Nothing may block on stdin, and installers like Homebrew's honour this
+  if (!freopen("/dev/null", "r", stdin)) {
+    std::cerr << "Failed to detach stdin.\n";
   }
+  setenv("NONINTERACTIVE", "1", 1);
 
-  std::string shellConfigPath;
-  const char *shell = std::getenv("SHELL");
-  if (shell && std::string(shell).find("zsh") != std::string::npos) {
-    shellConfigPath = std::string(getenv("HOME")) + "/.zshrc";
-  } else {
-    shellConfigPath = std::string(getenv("HOME")) + "/.bashrc";
+  if (!answersFilePath.empty() && !loadAnswersFile(answersFilePath)) {
+    std::cerr << "Failed to read answers file " << answersFilePath << "\n";
+    return 2;
+  }
+  if (requestedProfiles.empty()) {
+    std::cerr << "apply needs --profile, one or more of:";
+    for (const auto &profile : getProfiles()) {
+      std::cerr << " " << profile.id;
+    }
+    std::cerr << "\n";
+    return 2;
+  }
+  if (geteuid() != 0 && std::system("sudo -n true > /dev/null 2>&1") != 0) {
+    std::cerr << "apply needs root or passwordless sudo.\n";
+    return 2;
   }
 
-  std::ofstream shellConfigFile;
-  shellConfigFile.open(shellConfigPath, std::ios_base::app);
-  if (shellConfigFile.is_open()) {
-    shellConfigFile << "\n# Added by Arch Linux setup script\n";
-    shellConfigFile << "export PATH=\"$PATH:" << emacsConfigPath << "/bin\"\n";
-    shellConfigFile.close();
-    std::cout << SUCCESS_COLOR << "Added Doom Emacs bin directory to PATH in "
-              << shellConfigPath << "\n"
-              << RESET_COLOR;
+  // Without --results, stdout carries only the NDJSON results: everything
+  // meant for people, ours and the installers' alike, moves to stderr
+  std::ofstream results;
+  if (!resultsFilePath.empty()) {
+    results.open(resultsFilePath, std::ios::trunc);
   } else {
-    std::cerr << ERROR_COLOR
-              << "Failed to add Doom Emacs to PATH. Could not open "
-              << shellConfigPath << "\n"
-              << RESET_COLOR;
+    int resultsFd = dup(STDOUT_FILENO);
+    std::cout.flush();
+    if (resultsFd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0) {
+      results.open("/proc/self/fd/" + std::to_string(resultsFd),
+                   std::ios::app);
+    }
+    if (resultsFd >= 0) {
+      close(resultsFd);
+    }
+  }
+  if (!results.is_open()) {
+    std::cerr << "Failed to open "
+              << (resultsFilePath.empty() ? "stdout" : resultsFilePath)
+              << " for results.\n";
+    return 2;
   }
 
-  std::cout << INPUT_COLOR << "Doom Emacs setup complete. Useful commands:\n"
-            << RESET_COLOR;
-  std::cout << OPTION_COLOR
-            << "doom sync    - Synchronize your config with Doom Emacs.\n"
-            << "doom upgrade - Update Doom Emacs and all packages.\n"
-            << "doom doctor  - Diagnose common issues.\n"
-            << "doom env     - Regenerate the environment file.\n"
-            << RESET_COLOR;
-}
-
-// Package Downloader
-void ensureYayInstalled() {
-  if (!isCommandSuccessful("which yay > /dev/null 2>&1")) {
-    std::cout << INPUT_COLOR
-              << "The 'yay' AUR helper is not installed. Do you want to "
-                 "install it? (y/n): "
-              << RESET_COLOR;
-    char choice;
-    std::cin >> choice;
-    if (choice == 'y' || choice == 'Y') {
-      std::cout << INPUT_COLOR << "Installing 'yay'...\n" << RESET_COLOR;
-      // Install dependencies
-      installPackage("base-devel", "--needed");
-      installPackage("git", "--needed");
-
-      std::string tmpDir = "/tmp/yay_install";
-      runCommand("git clone https://aur.archlinux.org/yay.git " + tmpDir);
-      runCommand("cd " + tmpDir + " && makepkg -si --noconfirm");
-      runCommand("rm -rf " + tmpDir);
-
-      if (isCommandSuccessful("which yay > /dev/null 2>&1")) {
-        std::cout << SUCCESS_COLOR << "'yay' installed successfully.\n"
-                  << RESET_COLOR;
-      } else {
-        std::cerr
-            << ERROR_COLOR
-            << "Failed to install 'yay'. AUR packages will not be available.\n"
-            << RESET_COLOR;
-      }
-    } else {
-      std::cout
-          << INPUT_COLOR
-          << "Proceeding without 'yay'. AUR packages will not be available.\n"
-          << RESET_COLOR;
-    }
+  if (targetRoots.empty()) {
+    std::mutex resultsMutex;
+    return applyRequestedProfiles(results, resultsMutex) ? 0 : 1;
   }
-}
 
-void ensureFlatpakInstalled() {
-  if (!isCommandSuccessful("which flatpak > /dev/null 2>&1")) {
-    std::cout << INPUT_COLOR
-              << "Flatpak is not installed. Do you want to install it to "
-                 "search for Flatpak packages? (y/n): "
-              << RESET_COLOR;
-    char choice;
-    std::cin >> choice;
-    if (choice == 'y' || choice == 'Y') {
-      installPackage("flatpak", "--needed");
-      if (isCommandSuccessful("which flatpak > /dev/null 2>&1")) {
-        std::cout << SUCCESS_COLOR << "Flatpak installed successfully.\n"
-                  << RESET_COLOR;
-        if (!isCommandSuccessful(
-                "flatpak remote-list | grep flathub > /dev/null 2>&1")) {
-          std::cout << INPUT_COLOR
-                    << "Adding Flathub repository to Flatpak...\n"
-                    << RESET_COLOR;
-          runCommand("sudo flatpak remote-add --if-not-exists flathub "
-                     "https://flathub.org/repo/flathub.flatpakrepo");
+  // Every root is seeded from the host's sync databases, so one download
+  // pass fills the shared package cache for all of them
+  std::vector<std::string> syncPackages;
+  for (const auto &id : requestedProfiles) {
+    if (const ProvisioningProfile *profile = findProfile(id)) {
+      for (const auto &pkg : profile->packages) {
+        if (syncPackageNames().count(stripVersionConstraint(pkg))) {
+          syncPackages.push_back(pkg);
         }
-      } else {
-        std::cerr << ERROR_COLOR
-                  << "Failed to install Flatpak. Flatpak packages will not be "
-                     "available.\n"
-                  << RESET_COLOR;
       }
-    } else {
-      std::cout << INPUT_COLOR
-                << "Proceeding without Flatpak. Flatpak packages will not be "
-                   "available.\n"
-                << RESET_COLOR;
     }
   }
-}
-
-// Search for Packages
-std::vector<PackageStruct> searchForPackages(const std::string &packageName) {
-  std::vector<PackageStruct> matchingPackages;
-
-  std::string pacmanCommand = "pacman -Ss " + packageName;
-  std::array<char, 128> buffer;
-  std::string result;
-  FILE *pipe = popen(pacmanCommand.c_str(), "r");
-  if (pipe) {
-    while (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
-      result += buffer.data();
-    }
-    pclose(pipe);
-    parsePacmanYayResults(result, matchingPackages, "pacman");
-  }
-
-  std::string yayCommand =
-      "yay -Ss \"" + packageName +
-      "\" | awk '"
-      "/aur\\// {"
-      "  split($1, a, \"/\");"
-      "  package = a[2];"
-      "  version = $2;"
-      "  getline;"
-      "  description = $0;"
-      "  printf \"Package: %s\\nVersion: %s\\nDescription: %s\\n\\n\", "
-      "package, version, description;"
-      "}'";
-  result.clear();
-  pipe = popen(yayCommand.c_str(), "r");
-  if (pipe) {
-    while (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
-      result += buffer.data();
-    }
-    pclose(pipe);
-    parseYayResults(result, matchingPackages);
-  }
-
-  fetchFlatpakDetails(packageName, matchingPackages);
+  if (!syncPackages.empty()) {
+    runCommand("sudo pacman -Sw --noconfirm --needed " +
+               joinStrings(syncPackages, " "));
+  }
 
-  return matchingPackages;
+  std::mutex resultsMutex;
+  std::atomic<bool> allSucceeded{true};
+  runConcurrently(targetRoots.size(), static_cast<int>(targetRoots.size()),
+                  [&](size_t i) {
+                    targetRoot = targetRoots[i];
+                    bool succeeded = false;
+                    if (prepareTargetRoot()) {
+                      succeeded = applyRequestedProfiles(results, resultsMutex);
+                    } else {
+                      std::lock_guard<std::mutex> lock(resultsMutex);
+                      results << "{\"root\":\"" << jsonEscape(targetRoot)
+                              << "\",\"status\":\"invalid-root\"}"
+                              << std::endl;
+                    }
+                    if (!succeeded) {
+                      allSucceeded = false;
+                    }
+                  });
+  return allSucceeded ? 0 : 1;
 }
 
-void downloadPackage() {
-  const int ITEMS_PER_PAGE = 10;
-  std::string packageName;
-
-  while (true) {
-    clearScreen();
-    std::cout << MENU_COLOR
-              << "=== Package Search and Download ===" << RESET_COLOR << "\n\n";
-    std::cout << INPUT_COLOR
-              << "Enter the package name you want to search for\n"
-              << "(or enter 'q' to return to the main menu): " << RESET_COLOR;
+// Apply every --profile to the current target and write one result line per
+// profile. Files written into a target root are handed to the target user.
+bool applyRequestedProfiles(std::ostream &results, std::mutex &resultsMutex) {
+  bool allSucceeded = true;
+  auto plan = planProfiles(requestedProfiles);
+  if (plan.size() > 1) {
+    installMergedPackages(plan);
+  }
 
-    std::getline(std::cin, packageName);
+  std::vector<std::string> orderedIds;
+  for (const auto *profile : plan) {
+    orderedIds.push_back(profile->id);
+  }
+  for (const auto &id : requestedProfiles) {
+    if (findProfile(id) == nullptr) {
+      orderedIds.push_back(id); // reported as unknown below
+    }
+  }
+  for (const auto &id : orderedIds) {
+    const ProvisioningProfile *profile = findProfile(id);
+    std::string rootField =
+        targetRoot.empty() ? ""
+                           : "\"root\":\"" + jsonEscape(targetRoot) + "\",";
+    if (profile == nullptr) {
+      std::lock_guard<std::mutex> lock(resultsMutex);
+      results << "{" << rootField << "\"profile\":\"" << jsonEscape(id)
+              << "\",\"status\":\"unknown-profile\"}" << std::endl;
+      allSucceeded = false;
+      continue;
+    }
 
-    if (packageName == "q" || packageName == "Q") {
-      std::cout << INPUT_COLOR << "Returning to the main menu...\n"
-                << RESET_COLOR;
-      std::this_thread::sleep_for(std::chrono::seconds(1));
-      return;
+    int failuresBefore = provisioningFailureCount();
+    auto start = std::chrono::steady_clock::now();
+    printHeader(profile->title);
+    profile->action();
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    int failures = provisioningFailureCount() - failuresBefore;
+
+    size_t drifted = 0;
+    for (const auto &probe : runStateProbes(profile->id)) {
+      drifted += probe.converged ? 0 : 1;
     }
 
-    auto matchingPackages = searchForPackages(packageName);
+    allSucceeded = allSucceeded && failures == 0;
+    std::lock_guard<std::mutex> lock(resultsMutex);
+    results << "{" << rootField << "\"profile\":\""
+            << jsonEscape(profile->id) << "\",\"status\":\""
+            << (failures ? "failed" : "ok") << "\",\"failures\":" << failures
+            << ",\"drifted_probes\":" << drifted << ",\"seconds\":"
+            << std::fixed << std::setprecision(1) << seconds << "}"
+            << std::endl;
+  }
+
+  std::string user = targetUser();
+  if (!targetRoot.empty() && user != "root") {
+    runCommand(targetCommand(
+        "chown -R " + user + ": " + chrootPath(homeDirectory()), true));
+  }
+  return allSucceeded;
+}
 
-    if (matchingPackages.empty()) {
-      std::cout << ERROR_COLOR
-                << "No matching packages found for: " << packageName << "\n"
-                << RESET_COLOR;
-      std::cout << "Press Enter to try again...";
-      std::cin.get();
-      continue;
+// Prefetch Stage
+PrefetchState prefetchState;
+
+// Run a shell command in its own process group and publish its pid, so
+// cancelPrefetch can interrupt it. The pid is published under the mutex
+// cancelPrefetch takes, and cancelled is checked again once the child
+// exists, so a cancel between the caller's check and the fork is not lost.
+// Returns the exit status.
+int runCancellableCommand(const std::string &command, PrefetchState &state) {
+  pid_t pid = spawnShellCommand(command);
+  if (pid < 0) {
+    return -1;
+  }
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.cancelled) {
+      kill(-pid, SIGINT);
+    } else {
+      state.childPid = pid;
     }
+  }
 
-    int currentPage = 0;
-    int totalPages =
-        (matchingPackages.size() + ITEMS_PER_PAGE - 1) / ITEMS_PER_PAGE;
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.childPid = 0;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
 
-    while (true) {
-      clearScreen();
-      std::cout << MENU_COLOR << "=== Search Results (Page "
-                << (currentPage + 1) << " of " << totalPages
-                << ") ===" << RESET_COLOR << "\n\n";
+std::string prefetchedConfigPath(const std::string &url) {
+  return cacheDirectory() + "/prefetch/" + toHex(fnv1a64(url));
+}
 
-      int startIdx = currentPage * ITEMS_PER_PAGE;
-      int endIdx = std::min(startIdx + ITEMS_PER_PAGE,
-                            static_cast<int>(matchingPackages.size()));
+// Bare mirror of a git repository inside the cache
+std::string gitMirrorPath(const std::string &url) {
+  std::string name = fs::path(url).filename().string();
+  if (name.size() > 4 && name.substr(name.size() - 4) == ".git") {
+    name.resize(name.size() - 4);
+  }
+  return cacheDirectory() + "/git/" + name + "-" +
+         toHex(fnv1a64(url)).substr(0, 8) + ".git";
+}
 
-      for (int i = startIdx; i < endIdx; ++i) {
-        const auto &pkg = matchingPackages[i];
-        bool installed = isPackageInstalled(pkg.name);
-        const char *color = installed ? SUCCESS_COLOR : OPTION_COLOR;
+// Git Fetch Layer
+// Every repository is kept as a bare mirror in the cache. A mirror is created
+// once with clone --mirror and brought up to date with an incremental fetch,
+// and working trees are then cloned from the local mirror.
+
+// Command that creates the mirror, or fetches into it if it already exists.
+// It holds flock on <mirror>.lock and decides between clone and fetch only
+// once it has the lock, so threads, the prefetch worker and other processes
+// sharing the cache never clone into the same directory at once. A mirror
+// that never got its HEAD is a failed clone and is started over.
+std::string gitMirrorUpdateCommand(const std::string &url) {
+  std::string mirror = gitMirrorPath(url);
+  std::string update =
+      "if [ -f " + mirror + "/HEAD ]; then git -C " + mirror +
+      " fetch --quiet --prune; else rm -rf " + mirror +
+      " && git clone --quiet --mirror " + url + " " + mirror + " && git -C " +
+      mirror + " config uploadpack.allowFilter true; fi";
+  return "flock " + mirror + ".lock sh -c " + shellQuote(update);
+}
 
-        std::cout << (i + 1) << ". " << color << pkg.name << RESET_COLOR
-                  << " : " << pkg.version << " (" << MENU_COLOR
-                  << pkg.sourceOfPackage << RESET_COLOR << ")\n"
-                  << "\t" << pkg.description << "\n";
+bool updateGitMirror(const std::string &url) {
+  std::error_code ec;
+  fs::create_directories(cacheDirectory() + "/git", ec);
+  std::string mirror = gitMirrorPath(url);
+  // Offline: the bundle seeded the mirror, there is nothing to fetch from
+  if (!bundlePath.empty()) {
+    return fs::exists(mirror + "/HEAD");
+  }
+  return runFetchCommand("Mirroring " + url,
+                         gitMirrorUpdateCommand(url) + " > /dev/null 2>&1",
+                         GIT_POLICY);
+}
 
-        if (installed) {
-          std::cout << "\t" << SUCCESS_COLOR << "[installed]" << RESET_COLOR
-                    << "\n";
-        }
-        std::cout << "\n";
-      }
+// Clone url into destination through its mirror. Plain clones hardlink the
+// mirror's objects; shallow and sparse clones go through file:// so --depth
+// and --filter apply. origin is pointed back at url afterwards. Falls back to
+// a direct clone if no mirror could be created.
+bool cloneRepository(const std::string &url, const std::string &destination,
+                     const GitCloneOptions &options) {
+  std::string mirror = gitMirrorPath(url);
+  bool haveMirror = updateGitMirror(url) || fs::exists(mirror + "/HEAD");
+  bool sparse = !options.sparsePaths.empty();
+
+  std::string command = "git clone --quiet";
+  if (options.shallow) {
+    command += " --depth 1";
+  }
+  if (!haveMirror) {
+    return runFetchCommand("Cloning " + url,
+                           command + " " + url + " " + destination,
+                           GIT_POLICY, [&] {
+                             std::error_code ec;
+                             fs::remove_all(destination, ec);
+                           });
+  }
 
-      std::cout << INPUT_COLOR
-                << "Enter package numbers to install (comma-separated),\n"
-                << "n for next page, p for previous page, or q to go back: "
-                << RESET_COLOR;
+  if (sparse) {
+    command += " --filter=blob:none --no-checkout";
+  }
+  std::string source =
+      (options.shallow || sparse) ? "file://" + mirror : mirror;
+  if (!isCommandSuccessful(command + " " + source + " " + destination)) {
+    return false;
+  }
 
-      std::string input;
-      std::getline(std::cin, input);
+  if (sparse) {
+    // Blobs are fetched lazily from the mirror, so check out before
+    // switching origin to the upstream URL
+    std::string sparseCommand =
+        "git -C " + destination + " sparse-checkout set --no-cone";
+    for (const auto &path : options.sparsePaths) {
+      sparseCommand += " '" + path + "'";
+    }
+    if (!isCommandSuccessful(sparseCommand + " && git -C " + destination +
+                             " checkout --quiet")) {
+      return false;
+    }
+  }
 
-      if (input == "q" || input == "Q") {
-        break;
-      }
+  return isCommandSuccessful("git -C " + destination +
+                             " remote set-url origin " + url);
+}
 
-      if (input == "n" || input == "N") {
-        currentPage = (currentPage + 1) % totalPages;
-        continue;
-      }
+// Download a profile's repo packages into the pacman cache, then its config
+// files and git mirrors, without blocking the menus. sudo -n keeps the
+// background pacman from ever prompting for a password, so the password is
+// asked for here, on the main thread, when a profile's menu is entered;
+// without cached credentials sudo -n would silently download nothing.
+void startPrefetch(const std::string &profileId) {
+  cancelPrefetch();
+  const ProvisioningProfile *profile = findProfile(profileId);
+  if (profile == nullptr || !bundlePath.empty()) {
+    return;
+  }
+  if (!profile->packages.empty()) {
+    ensureSudoFor("sudo pacman -Sw");
+  }
 
-      if (input == "p" || input == "P") {
-        currentPage = (currentPage - 1 + totalPages) % totalPages;
-        continue;
-      }
+  prefetchState.cancelled = false;
+  {
+    std::lock_guard<std::mutex> lock(prefetchState.mutex);
+    prefetchState.packagesPending = true;
+  }
 
-      std::vector<PackageStruct> selectedPackages;
-      std::stringstream ss(input);
-      std::string item;
-      while (std::getline(ss, item, ',')) {
-        try {
-          int index = std::stoi(item) - 1;
-          if (index >= 0 && index < static_cast<int>(matchingPackages.size())) {
-            selectedPackages.push_back(matchingPackages[index]);
-          } else {
-            std::cout << ERROR_COLOR << "Invalid index: " << (index + 1)
-                      << ". Skipping.\n"
-                      << RESET_COLOR;
-          }
-        } catch (const std::invalid_argument &) {
-          std::cout << ERROR_COLOR << "Invalid input: " << item
-                    << ". Skipping.\n"
-                    << RESET_COLOR;
-        }
+  prefetchState.worker = std::thread([profile] {
+    std::string downloadCommand = "sudo -n pacman -Sw --noconfirm --needed";
+    bool anyPackages = false;
+    for (const auto &pkg : profile->packages) {
+      if (syncPackageNames().count(pkg)) {
+        downloadCommand += " " + pkg;
+        anyPackages = true;
       }
+    }
+    if (anyPackages && !prefetchState.cancelled) {
+      runCancellableCommand(downloadCommand + " > /dev/null 2>&1",
+                            prefetchState);
+    }
+    {
+      std::lock_guard<std::mutex> lock(prefetchState.mutex);
+      prefetchState.packagesPending = false;
+    }
+    prefetchState.packagesDone.notify_all();
 
-      if (selectedPackages.empty()) {
-        std::cout << ERROR_COLOR
-                  << "No valid packages selected. Press Enter to continue...\n"
-                  << RESET_COLOR;
-        std::cin.get();
-        continue;
+    std::error_code ec;
+    fs::create_directories(cacheDirectory() + "/prefetch", ec);
+    for (const auto &url : profile->configUrls) {
+      if (prefetchState.cancelled) {
+        return;
+      }
+      // Download to a .part file so applyConfig never sees a partial config
+      std::string target = prefetchedConfigPath(url);
+      if (runCancellableCommand(curlFetchCommand(url, target + ".part",
+                                                 DOWNLOAD_POLICY) +
+                                    " > /dev/null 2>&1",
+                                prefetchState) == 0) {
+        fs::rename(target + ".part", target, ec);
       }
+    }
 
-      clearScreen();
-      std::cout << MENU_COLOR << "=== Installing Packages ===" << RESET_COLOR
-                << "\n\n";
-      for (const auto &pkg : selectedPackages) {
-        std::cout << INPUT_COLOR << "Installing " << pkg.name << "...\n"
-                  << RESET_COLOR;
-        installPackage(pkg.name, "--needed");
-        std::cout << "\n";
+    fs::create_directories(cacheDirectory() + "/git", ec);
+    for (const auto &url : profile->gitRepositories) {
+      if (prefetchState.cancelled) {
+        return;
       }
+      runCancellableCommand(gitMirrorUpdateCommand(url) + " > /dev/null 2>&1",
+                            prefetchState);
+    }
+  });
+}
 
-      std::cout << SUCCESS_COLOR
-                << "Installation complete. Press Enter to continue...\n"
-                << RESET_COLOR;
-      std::cin.get();
-      break;
+// Stop the background worker. SIGINT lets pacman release its database lock.
+// The child is signalled under the mutex, before the worker can reap it.
+void cancelPrefetch() {
+  if (!prefetchState.worker.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(prefetchState.mutex);
+    prefetchState.cancelled = true;
+    if (prefetchState.childPid > 0) {
+      kill(-prefetchState.childPid, SIGINT);
     }
   }
+  prefetchState.worker.join();
 }
 
-void askForSudoPassword() {
-  std::cout << INPUT_COLOR << "Entering Package Installation Mode...\n"
-            << RESET_COLOR;
-  if (std::system("sudo -v") != 0) {
-    std::cerr << ERROR_COLOR << "Failed to authenticate with sudo. Exiting...\n"
-              << RESET_COLOR;
-    std::exit(1);
-  }
+// pacman holds its database lock while downloading, so installs wait for the
+// package part of the prefetch before starting their own transaction
+void waitForPrefetchedPackages() {
+  std::unique_lock<std::mutex> lock(prefetchState.mutex);
+  prefetchState.packagesDone.wait(
+      lock, [] { return !prefetchState.packagesPending; });
 }
 
+// Offline Bundles
+// arch-setup bundle --profile a,b --out DIR resolves the profiles on this
+// machine and stores everything they would fetch under DIR:
+//   pkg/       the full repo dependency closure (as if nothing were
+//              installed) plus the sync databases it was resolved against
+//   repo/      prebuilt AUR packages as the arch-setup-bundle repository
+//   prefetch/  config files, named like the prefetch cache
+//   git/       bare git mirrors, named like the mirror cache
+// With --bundle DIR, pacman takes DIR/pkg as an extra cache and DIR/repo
+// as a repository, and the cache is seeded from DIR, so provisioning needs
+// no network.
+const std::string BUNDLE_REPO_NAME = "arch-setup-bundle";
+
+// Artifacts of the newest cached build of an AUR package
+std::vector<std::string> cachedAurArtifacts(const std::string &name) {
+  fs::path newest;
+  fs::file_time_type newestTime;
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(aurCacheRoot(), ec)) {
+    std::string entryName = entry.path().filename().string();
+    if (entryName.size() != name.size() + 17 ||
+        entryName.rfind(name + "-", 0) != 0) {
+      continue;
+    }
+    auto modified = fs::last_write_time(entry.path(), ec);
+    if (newest.empty() || modified > newestTime) {
+      newest = entry.path();
+      newestTime = modified;
+    }
+  }
 
-// Main menu and input handling
-std::vector<std::string> getSimpleMenuDescriptions() {
-  return {"Setup Shell (Zsh)",
-          "Install Developer Tools",
-          "Setup Gaming",
-          "Install LunarVim",
-          "Install Doom Emacs",
-          "Install Terminals",
-          "Search & Download a Package [not for yay currently]",
-          "Setup Yay (AUR Helper)",
-          "Setup Flatpak",
-          "Exit"};
+  std::vector<std::string> artifacts;
+  if (!newest.empty()) {
+    for (const auto &file : fs::directory_iterator(newest, ec)) {
+      if (isPackageArtifact(file.path())) {
+        artifacts.push_back(file.path().string());
+      }
+    }
+  }
+  return artifacts;
 }
 
-std::vector<std::string> getDetailedMenuDescriptions() {
-  /* CAN BE IMPLEMENTED LATER */
-  return getSimpleMenuDescriptions();
+// Values of one key ("depend", "provides", ...) in a package's .PKGINFO
+std::vector<std::string> artifactField(const std::string &artifact,
+                                       const std::string &key) {
+  std::vector<std::string> values;
+  std::string prefix = key + " = ";
+  streamCommandLines("bsdtar -xOf " + shellQuote(artifact) +
+                         " .PKGINFO 2>/dev/null",
+                     [&](std::string_view line) {
+                       if (line.rfind(prefix, 0) == 0) {
+                         values.emplace_back(line.substr(prefix.size()));
+                       }
+                     });
+  return values;
 }
 
-void displayMenu(const std::vector<MenuItem> &menuItems) {
-    struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-
-    clearScreen();
-
-    int contentHeight = menuItems.size() + 6;
-    int verticalPadding = (w.ws_row - contentHeight) / 2;
-
-    for (int i = 0; i < verticalPadding; ++i) {
-        std::cout << "\n";
+// Copy the cached AUR builds of packageNames and of the AUR packages they
+// depend on into repoDir. Repo dependencies are added to repoPackages.
+bool bundleAurPackages(const std::vector<std::string> &packageNames,
+                       const fs::path &repoDir,
+                       std::vector<std::string> &repoPackages) {
+  const SyncDatabase &db = syncDatabase();
+  std::vector<std::string> queue = packageNames;
+  std::unordered_set<std::string> seen, provided;
+  std::vector<std::string> missing;
+  std::string repoAddCommand =
+      "repo-add -q " + shellQuote((repoDir / (BUNDLE_REPO_NAME + ".db.tar.gz"))
+                                      .string());
+  bool anyArtifacts = false;
+  std::error_code ec;
+
+  while (!queue.empty()) {
+    std::string name = queue.back();
+    queue.pop_back();
+    if (!seen.insert(name).second) {
+      continue;
+    }
+    auto artifacts = cachedAurArtifacts(name);
+    if (artifacts.empty()) {
+      missing.push_back(name);
+      continue;
+    }
+    for (const auto &artifact : artifacts) {
+      fs::path copy = repoDir / fs::path(artifact).filename();
+      fs::copy_file(artifact, copy, fs::copy_options::overwrite_existing, ec);
+      repoAddCommand += " " + shellQuote(copy.string());
+      anyArtifacts = true;
+      for (const auto &name : artifactField(artifact, "provides")) {
+        provided.insert(stripVersionConstraint(name));
+      }
+      for (const auto &dependency : artifactField(artifact, "depend")) {
+        std::string depName = stripVersionConstraint(dependency);
+        if (findSyncProvider(db, depName)) {
+          repoPackages.push_back(depName);
+        } else {
+          queue.push_back(depName);
+        }
+      }
     }
+  }
 
-    printHeader("Arch Linux Setup Menu");
+  bool complete = true;
+  for (const auto &name : missing) {
+    if (!provided.count(name)) {
+      std::cerr << ERROR_COLOR << "No cached build of " << name
+                << " to bundle.\n"
+                << RESET_COLOR;
+      complete = false;
+    }
+  }
+  if (anyArtifacts && !runCommand(repoAddCommand + " > /dev/null")) {
+    return false;
+  }
+  return complete;
+}
 
-    for (size_t i = 0; i < menuItems.size(); ++i) {
-        std::cout << GRUVBOX_YELLOW << " [" << (i + 1) << "] " << RESET_COLOR 
-                  << GRUVBOX_FG << menuItems[i].description << RESET_COLOR << "\n";
+// Download (or copy from the local cache) every package of the closure,
+// with signatures, from the repository's own mirrors
+bool bundleRepoPackages(const std::vector<std::string> &packageNames,
+                        const fs::path &pkgDir) {
+  const SyncDatabase &db = syncDatabase();
+  ClosureEstimate closure = resolveClosure(packageNames, {});
+  std::map<std::string, std::vector<std::string>> servers;
+  for (const auto &name : closure.packages) {
+    const std::string &repo = db.packages[db.byName.at(name)].repo;
+    if (!servers.count(repo)) {
+      for (const auto &server :
+           parse_string(captureCommandOutput("pacman-conf --repo " + repo +
+                                             " Server 2>/dev/null"),
+                        '\n')) {
+        if (!server.empty()) {
+          servers[repo].push_back(server);
+        }
+      }
     }
+  }
 
-    printSeparator();
-    printPrompt("Choose an option (1-" + std::to_string(menuItems.size()) + "), or [q] to quit");
+  std::cout << INPUT_COLOR << "Bundling " << closure.packages.size()
+            << " repo packages (" << formatBytes(closure.downloadBytes)
+            << " to download)...\n"
+            << RESET_COLOR;
+  FetchPolicy signaturePolicy = DOWNLOAD_POLICY;
+  signaturePolicy.attempts = 1;
+  std::atomic<size_t> failed{0};
+  runConcurrently(
+      closure.packages.size(),
+      parallelDownloadsFor(loadRate("download", DEFAULT_DOWNLOAD_RATE)),
+      [&](size_t i) {
+        const SyncPackage &pkg =
+            db.packages[db.byName.at(closure.packages[i])];
+        std::string target = (pkgDir / pkg.filename).string();
+        std::string cached = PACMAN_CACHE_DIR + "/" + pkg.filename;
+        std::error_code ec;
+        if (fs::exists(cached) &&
+            fs::copy_file(cached, target,
+                          fs::copy_options::overwrite_existing, ec)) {
+          fs::copy_file(cached + ".sig", target + ".sig",
+                        fs::copy_options::overwrite_existing, ec);
+          return;
+        }
+        std::vector<std::string> urls, signatureUrls;
+        for (const auto &server : servers[pkg.repo]) {
+          urls.push_back(server + "/" + pkg.filename);
+          signatureUrls.push_back(urls.back() + ".sig");
+        }
+        if (!fetchUrl(urls, target, DOWNLOAD_POLICY)) {
+          printAboveProgress(std::cerr, std::string(ERROR_COLOR) +
+                                            "Failed to download " +
+                                            pkg.filename + "." +
+                                            RESET_COLOR + "\n");
+          ++failed;
+          return;
+        }
+        fetchUrl(signatureUrls, target + ".sig", signaturePolicy);
+      });
+
+  // The sync databases the closure was resolved against
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(PACMAN_SYNC_DIR, ec)) {
+    if (entry.path().extension() == ".db") {
+      fs::copy_file(entry.path(), pkgDir / entry.path().filename(),
+                    fs::copy_options::overwrite_existing, ec);
+    }
+  }
+  return failed == 0;
 }
 
-void handleMenuChoice(const std::vector<MenuItem> &menuItems, int choice) {
-  if (choice < 1 || choice > static_cast<int>(menuItems.size())) {
-    std::cout << ERROR_COLOR << "Invalid option! Please try again.\n"
+// arch-setup bundle --profile a,b --out DIR
+int runBundleCommand() {
+  if (requestedProfiles.empty() || bundleOutputPath.empty()) {
+    std::cerr << "bundle needs --profile and --out DIR\n";
+    return 2;
+  }
+  for (const auto &id : requestedProfiles) {
+    if (findProfile(id) == nullptr) {
+      std::cerr << "Unknown profile " << id << "\n";
+      return 2;
+    }
+  }
+  auto profiles = planProfiles(requestedProfiles);
+  fs::path out = fs::absolute(bundleOutputPath).lexically_normal();
+  std::error_code ec;
+  for (const char *part : {"pkg", "repo", "prefetch", "git"}) {
+    fs::create_directories(out / part, ec);
+  }
+  if (ec) {
+    std::cerr << ERROR_COLOR << "Cannot create " << out.string() << ".\n"
               << RESET_COLOR;
-  } else {
-    menuItems[choice - 1].action();
-    printSeparator();
+    return 2;
   }
-}
 
-// YAY
-void setupYay() {
-  if (isPackageInstalled("yay")) {
-    std::cout << SUCCESS_COLOR << "Yay is already installed.\n" << RESET_COLOR;
-    return;
+  // yay is built through the AUR stage by the profiles that need it
+  std::vector<std::string> packages = mergedPackages(profiles, true);
+  for (const auto *profile : profiles) {
+    if ((profile->id == "yay" ||
+         std::find(profile->after.begin(), profile->after.end(), "yay") !=
+             profile->after.end()) &&
+        std::find(packages.begin(), packages.end(), "yay") == packages.end()) {
+      packages.push_back("yay");
+    }
   }
 
-  std::cout << INPUT_COLOR << "Installing yay (AUR helper)...\n" << RESET_COLOR;
+  // Route as if nothing were installed; the target may have none of it
+  bool complete = true;
+  std::vector<std::string> repoPackages, aurPackages, unbuilt;
+  for (const auto &pkg : packages) {
+    ProviderRoute route = routePackage(pkg, {});
+    switch (route.provider) {
+    case PackageProvider::Repo:
+      repoPackages.push_back(route.name);
+      break;
+    case PackageProvider::AurCached:
+    case PackageProvider::AurSource:
+      aurPackages.push_back(route.name);
+      if (!aurCacheHas(route.name)) {
+        unbuilt.push_back(route.name);
+      }
+      break;
+    case PackageProvider::Flatpak:
+      std::cerr << ERROR_COLOR << pkg
+                << " is a Flatpak app and is not bundled.\n"
+                << RESET_COLOR;
+      break;
+    default:
+      std::cerr << ERROR_COLOR << pkg << " was not found.\n" << RESET_COLOR;
+      complete = false;
+    }
+  }
 
-  // Install yay dependencies
-  installPackage("base-devel", "--needed");
-  installPackage("git", "--needed");
+  // Builds land in the AUR cache, which the bundle is copied from
+  if (!unbuilt.empty()) {
+    complete = installAurPackages(unbuilt) && complete;
+  }
+  complete = bundleAurPackages(aurPackages, out / "repo", repoPackages) &&
+             complete;
+  complete = bundleRepoPackages(repoPackages, out / "pkg") && complete;
+
+  for (const auto *profile : profiles) {
+    for (const auto &url : profile->configUrls) {
+      fs::path target = out / "prefetch" / toHex(fnv1a64(url));
+      if (!downloadFile(url, target.string())) {
+        std::cerr << ERROR_COLOR << "Failed to download " << url << ".\n"
+                  << RESET_COLOR;
+        complete = false;
+      }
+    }
+    for (const auto &url : profile->gitRepositories) {
+      std::string mirror = gitMirrorPath(url);
+      if (!updateGitMirror(url) && !fs::exists(mirror + "/HEAD")) {
+        complete = false;
+        continue;
+      }
+      fs::copy(mirror, out / "git" / fs::path(mirror).filename(),
+               fs::copy_options::recursive |
+                   fs::copy_options::overwrite_existing,
+               ec);
+    }
+  }
 
-  // Clone and install yay from the AUR
-  std::string tmpDir = "/tmp/yay_install";
-  runCommand("git clone https://aur.archlinux.org/yay.git " + tmpDir);
-  runCommand("cd " + tmpDir + " && makepkg -si --noconfirm");
-  runCommand("rm -rf " + tmpDir);
+  std::ofstream((out / "profiles").string())
+      << joinStrings(requestedProfiles, ",") << "\n";
+  uintmax_t size = 0;
+  for (const auto &file : fs::recursive_directory_iterator(out, ec)) {
+    if (file.is_regular_file(ec)) {
+      size += file.file_size(ec);
+    }
+  }
+  if (complete) {
+    std::cout << SUCCESS_COLOR << "Bundle written to " << out.string() << " ("
+              << formatBytes(size) << ").\n"
+              << RESET_COLOR;
+  } else {
+    std::cerr << ERROR_COLOR << "Bundle in " << out.string()
+              << " is incomplete.\n"
+              << RESET_COLOR;
+  }
+  return complete ? 0 : 1;
+}
 
-  if (isPackageInstalled("yay")) {
-    std::cout << SUCCESS_COLOR << "Yay installed successfully.\n"
+// Use the bundle at bundlePath for this run without touching the host's
+// pacman files. pacman gets a private --config (the host's plus the
+// bundle's CacheDir and repository) and a private --dbpath whose sync/
+// holds the bundle's databases and whose local/ links to the host's. If
+// the run dies, only a scratch directory is left behind.
+bool activateBundle() {
+  fs::path dir = bundlePath;
+  if (!fs::is_directory(dir / "pkg")) {
+    std::cerr << ERROR_COLOR << bundlePath << " is not an offline bundle.\n"
+              << RESET_COLOR;
+    return false;
+  }
+  skipMirrorRanking = true;
+
+  fs::path runtime = scratchPath("arch-setup-bundle");
+  std::error_code ec;
+  fs::create_directories(runtime / "db" / "sync", ec);
+  fs::create_directory_symlink(PACMAN_DB_DIR + "/local",
+                               runtime / "db" / "local", ec);
+  if (ec) {
+    std::cerr << ERROR_COLOR << "Cannot set up " << runtime.string() << ".\n"
               << RESET_COLOR;
+    return false;
+  }
+  for (const auto &entry : fs::directory_iterator(dir / "pkg", ec)) {
+    if (entry.path().extension() == ".db") {
+      fs::copy_file(entry.path(),
+                    runtime / "db" / "sync" / entry.path().filename(), ec);
+    }
+  }
+  fs::path repoDb = dir / "repo" / (BUNDLE_REPO_NAME + ".db");
+  bool hasRepo = fs::exists(repoDb);
+  if (hasRepo) {
+    fs::copy_file(repoDb, runtime / "db" / "sync" / repoDb.filename(), ec);
+  }
+
+  std::string conf = readFileContents(pacmanConfPath);
+  std::string cacheDirs = "\nCacheDir = " + PACMAN_CACHE_DIR +
+                          "/\nCacheDir = " + (dir / "pkg").string() + "/";
+  size_t options = conf.find("[options]");
+  if (options == std::string::npos) {
+    conf = "[options]" + cacheDirs + "\n" + conf;
   } else {
-    std::cerr << ERROR_COLOR << "Failed to install yay.\n" << RESET_COLOR;
+    conf.insert(options + 9, cacheDirs);
+  }
+  if (hasRepo) {
+    conf += "\n[" + BUNDLE_REPO_NAME +
+            "]\nSigLevel = Optional TrustAll\nServer = file://" +
+            (dir / "repo").string() + "\n";
+  }
+  std::ofstream(runtime / "pacman.conf") << conf;
+  bundleRuntimeDir = runtime.string();
+  std::atexit(deactivateBundle);
+
+  // Configs and git mirrors go where the prefetch stage would put them
+  for (const char *part : {"prefetch", "git"}) {
+    fs::create_directories(cacheDirectory() + "/" + part, ec);
+    fs::copy(dir / part, cacheDirectory() + "/" + part,
+             fs::copy_options::recursive |
+                 fs::copy_options::overwrite_existing,
+             ec);
   }
+  std::cout << INPUT_COLOR << "Provisioning offline from " << bundlePath
+            << ".\n"
+            << RESET_COLOR;
+  return true;
+}
+
+// Remove the private pacman files; local/ is a symlink, so the host's
+// database is not followed
+void deactivateBundle() {
+  std::error_code ec;
+  fs::remove_all(bundleRuntimeDir, ec);
 }
 
 // Menus
@@ -1125,6 +6820,8 @@ void setupShellMenu() {
         {"Configure Starship theme", setupStarshipTheme}
     };
 
+    startPrefetch("shell");
+
     while (true) {
         clearScreen();
         printHeader("Setup Shell (Zsh)");
@@ -1141,6 +6838,7 @@ void setupShellMenu() {
         std::getline(std::cin, choice);
 
         if (choice == "q" || choice == "Q") {
+            cancelPrefetch();
             return;
         }
 
@@ -1163,35 +6861,36 @@ void setupShellMenu() {
 
 void developerSetupMenu() {
   singleActionMenuTemplate("Install Developer Tools", "Install developer tools",
-                           developerSetup);
+                           developerSetup, "dev");
 }
 
 void gamingSetupMenu() {
   singleActionMenuTemplate("Setup Gaming", "Set up gaming environment",
-                           gamingSetup);
+                           gamingSetup, "gaming");
 }
 
 void setupLVimMenu() {
-  singleActionMenuTemplate("Setup LVim", "Setup LunarVim", setupLVim);
+  singleActionMenuTemplate("Setup LVim", "Setup LunarVim", setupLVim, "lvim");
 }
 
 void setupDoomEmacsMenu() {
   singleActionMenuTemplate("Setup Doom-Emacs", "Setup Doom Emacs",
-                           setupDoomEmacs);
+                           setupDoomEmacs, "doom");
 }
 
 void setupTerminalMenu() {
   std::vector<std::pair<std::string, std::function<void()>>> options = {
       {"Install WezTerm", setupWezTerm}, {"Install Kitty", setupKitty}};
-  colorizedMenuTemplate("Install Terminals", options);
+  colorizedMenuTemplate("Install Terminals", options, "terminal");
 }
 
 void setupYayMenu() {
-  singleActionMenuTemplate("Setup Yay", "Setup Yay", setupYay);
+  singleActionMenuTemplate("Setup Yay", "Setup Yay", setupYay, "yay");
 }
 
 void setupFlatpakMenu() {
-  singleActionMenuTemplate("Setup Flatpak", "Setup Flatpak", setupFlatpak);
+  singleActionMenuTemplate("Setup Flatpak", "Setup Flatpak", setupFlatpak,
+                           "flatpak");
 }
 
 void showMainMenuAndHandleInput() {
@@ -1204,14 +6903,50 @@ void showMainMenuAndHandleInput() {
       {"Install Terminals", setupTerminalMenu},
       {"Search & Download a Package", downloadPackage},
       {"Setup Yay (AUR Helper)", setupYayMenu},
-      {"Setup Flatpak", setupFlatpakMenu}};
+      {"Setup Flatpak", setupFlatpakMenu},
+      {"Provision Several Profiles", multiSelectProfilesMenu},
+      {"Check System State", [] { reportSystemState(); }}};
   colorizedMenuTemplate("Arch Linux Setup Menu", options);
 }
 
 int main(int argc, char *argv[]) {
-  std::cout << GRUVBOX_BG << GRUVBOX_FG; // Set background and foreground colors
   parseFlags(argc, argv);
-  askForSudoPassword();
+  if (subcommand == "bundle") {
+    return runBundleCommand();
+  }
+  if (!bundlePath.empty() && !activateBundle()) {
+    return 2;
+  }
+  // The interactive menus, search and --check work on a single target
+  // root; apply can provision several at once
+  if (subcommand != "apply" && !targetRoots.empty()) {
+    targetRoot = targetRoots.front();
+    if (!fs::is_directory(targetRoot) ||
+        (!checkStateOnly && subcommand != "search" && !prepareTargetRoot())) {
+      std::cerr << ERROR_COLOR << "Cannot use " << targetRoot
+                << " as a target root.\n"
+                << RESET_COLOR;
+      return 2;
+    }
+  }
+  if (checkStateOnly) {
+    bool converged = reportSystemState();
+    std::cout << RESET_COLOR;
+    return converged ? 0 : 1;
+  }
+  if (subcommand == "apply") {
+    return runHeadlessApply();
+  }
+  if (subcommand == "search") {
+    return runSearchCommand();
+  }
+  if (subcommand == "rank-mirrors") {
+    bool ranked = optimizeMirrors();
+    std::cout << RESET_COLOR;
+    return ranked ? 0 : 1;
+  }
+
+  std::cout << GRUVBOX_BG << GRUVBOX_FG; // Set background and foreground colors
   showMainMenuAndHandleInput();
   std::cout << RESET_COLOR;
   return 0;
@@ -1,29 +1,335 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <grp.h>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <pwd.h>
+#include <random>
 #include <regex>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <thread>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 /*Structures*/
+// Backend that installs a search result
+enum class PackageSource { Repo, Aur, Flatpak };
+
 typedef struct PackageStruct {
   std::string name;
   std::string version;
   std::string description;
   std::string sourceOfPackage;
+  PackageSource source;
+  std::string ref;    // Flatpak application ID
+  std::string remote; // Flatpak remote offering it
   PackageStruct(std::string nam, std::string ver, std::string desc,
-                std::string src)
-      : name(nam), version(ver), description(desc), sourceOfPackage(src) {}
+                PackageSource src, std::string appRef = "",
+                std::string rem = "")
+      : name(nam), version(ver), description(desc),
+        sourceOfPackage(src == PackageSource::Repo  ? "pacman"
+                        : src == PackageSource::Aur ? "AUR"
+                                                    : "Flatpak"),
+        source(src), ref(appRef), remote(rem) {}
 } package;
 
+// Header line waiting for its description in pacman/yay -Ss output
+struct SearchParseState {
+  std::string name;
+  std::string version;
+  bool havePending = false;
+};
+
+// One AUR package going through the parallel build stage
+struct AurBuildTarget {
+  std::string name;
+  std::string buildDir;
+  std::vector<std::string> dependencies; // depends + makedepends (.SRCINFO)
+  std::vector<std::string> runtimeDependencies; // depends only
+  std::vector<std::string> provides;
+  std::vector<std::string> artifacts; // built .pkg.tar.zst paths
+  std::string cacheKey; // PKGBUILD + .SRCINFO + toolchain hash
+  bool requestedExplicitly = true;
+  bool success = false;
+};
+
+// Everything a setup entry needs from the network: repo packages, config
+// files and git repositories. Used to prefetch while the user is still in
+// the menus.
+struct ProvisioningProfile {
+  std::string id;
+  std::string title;
+  std::vector<std::string> packages;
+  std::vector<std::string> configUrls;
+  std::vector<std::string> gitRepositories;
+  std::function<void()> action;
+  std::vector<std::string> after; // profiles to run first when also selected
+  // packages are alternatives the action asks to choose from: they are
+  // prefetched and bundled, but never installed up front by a plan
+  bool alternatives = false;
+};
+
+// Background download worker started when a profile is chosen
+struct PrefetchState {
+  std::thread worker;
+  std::atomic<bool> cancelled{false};
+  std::atomic<pid_t> childPid{0}; // written under mutex
+  bool packagesPending = false;
+  std::mutex mutex;
+  std::condition_variable packagesDone;
+};
+
+// How hard a network fetch tries: each attempt has a deadline and is
+// aborted early when the transfer stalls; failed attempts are retried after
+// an exponential backoff with full jitter
+struct FetchPolicy {
+  int attempts = 4;
+  std::chrono::milliseconds baseDelay{500};
+  std::chrono::milliseconds maxDelay{8000};
+  std::chrono::seconds deadline{120};  // per attempt
+  std::chrono::seconds stallTime{30};  // below 1 KiB/s this long is a stall
+  bool hedge = true; // race an alternate mirror when the primary is slow
+};
+
+// How cloneRepository() checks out a working tree from the mirror cache
+struct GitCloneOptions {
+  bool shallow = false;                 // --depth 1
+  std::vector<std::string> sparsePaths; // only check out these paths
+};
+
+// Cheap read-only check of the state one setup step converges. The id matches
+// the step's journal id, check() fills in the actual state it observed.
+struct StateProbe {
+  std::string id;
+  std::string desired;
+  std::function<bool(std::string &actual)> check;
+};
+
+struct ProbeResult {
+  std::string id;
+  std::string desired;
+  std::string actual;
+  bool converged = false;
+};
+
+// One task on the live progress display. The owning thread updates the
+// counters with relaxed atomics and never blocks; the render thread only
+// reads them.
+struct ProgressLane {
+  std::string label;       // fixed once the lane is published
+  double etaSeconds = 0.0; // drives the bar while total is unknown
+  std::chrono::steady_clock::time_point started;
+  std::atomic<uint64_t> done{0};
+  std::atomic<uint64_t> total{0};        // 0 when there is nothing to count
+  std::atomic<const char *> phase{nullptr}; // static string, e.g. "installing"
+  std::atomic<int> outcome{0}; // 0 running, 1 succeeded, -1 failed
+  std::string message; // replaces the lane when it ends; set before outcome
+};
+
+// Fixed-size ring holding the newest output of one step. The owning thread
+// appends, the log writer thread drains it without locks.
+struct StepLog {
+  static constexpr size_t CAPACITY = 256 * 1024;
+  std::string stepId;
+  std::unique_ptr<char[]> data{new char[CAPACITY]};
+  std::atomic<uint64_t> written{0}; // bytes appended by the owning thread
+  uint64_t drained = 0;             // bytes seen by the log writer
+  uint64_t notifiedAt = 0;          // owner's last wake-up of the writer
+  std::atomic<bool> finished{false};
+};
+
+// Where a package will be installed from, cheapest first
+enum class PackageProvider {
+  Installed,
+  Repo,
+  AurCached,
+  AurSource,
+  Flatpak,
+  Unknown
+};
+
+struct ProviderRoute {
+  std::string name;
+  PackageProvider provider = PackageProvider::Unknown;
+  std::string detail;                    // repo, repo/provider or remote
+  std::vector<std::string> alternatives; // other sources with the name
+};
+
+struct SyncPackage {
+  std::string name; // package name, or application ID for appstream entries
+  std::string title; // appstream display name
+  std::string version;
+  std::string description;
+  std::string repo; // sync repository or Flatpak remote
+  std::string filename;
+  uintmax_t compressedSize = 0;
+  uintmax_t installedSize = 0;
+  std::vector<std::string> depends;
+  std::vector<std::string> provides;
+  std::vector<std::string> replaces;
+};
+
+struct SyncDatabase {
+  std::vector<SyncPackage> packages;
+  std::unordered_map<std::string, size_t> byName;
+  std::unordered_map<std::string, std::vector<size_t>> providers;
+  std::unordered_map<std::string, std::vector<size_t>> replacedBy;
+};
+
+// Unified package index file: header, string pool, fixed-width records and
+// a sorted term table whose posting lists hold record numbers. Section
+// offsets are from the start of the file, string offsets from the pool.
+struct IndexString {
+  uint32_t offset = 0;
+  uint32_t length = 0;
+};
+
+struct PackageIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordCount;
+  uint64_t sourceStamp; // hash of the upstream DBs it was built from
+  uint64_t checksum;    // of everything after the header
+  uint64_t fileSize;
+  uint64_t recordsOffset;
+  uint64_t termsOffset;
+  uint64_t postingsOffset;
+  uint64_t stringsOffset;
+  uint32_t termCount;
+  uint32_t postingCount;
+};
+
+struct PackageIndexRecord {
+  IndexString name; // package name or Flatpak application ID
+  IndexString title;
+  IndexString version;
+  IndexString description;
+  IndexString repo; // sync repository, "aur" or Flatpak remote
+  uint32_t source;  // PackageSource
+};
+
+struct PackageIndexTerm {
+  IndexString term; // lowercase word from a name, title or description
+  uint32_t firstPosting;
+  uint32_t postingCount;
+};
+
+// One bit per index record
+using Bitmap = std::vector<uint64_t>;
+// Four bitmap words handled as one SIMD value (GCC/Clang vector extension)
+typedef uint64_t BitmapLanes __attribute__((vector_size(32)));
+
+// A mapped index file; the pointers point into the mapping
+struct PackageIndex {
+  void *mapping = MAP_FAILED;
+  size_t size = 0;
+  const PackageIndexHeader *header = nullptr;
+  const PackageIndexRecord *records = nullptr;
+  const PackageIndexTerm *terms = nullptr;
+  const uint32_t *postings = nullptr;
+  const char *strings = nullptr;
+  // Facet bitmaps, built when the file is opened
+  std::array<Bitmap, 3> sourceBitmaps; // indexed by PackageSource
+  std::unordered_map<std::string, Bitmap> repoBitmaps;
+  // Installed records, kept until the local DBs change
+  mutable Bitmap installedBitmap;
+  mutable std::string installedStamp;
+
+  std::string_view text(IndexString s) const {
+    return std::string_view(strings + s.offset, s.length);
+  }
+  ~PackageIndex() {
+    if (mapping != MAP_FAILED) {
+      munmap(mapping, size);
+    }
+  }
+};
+
+// Parsed search prompt, e.g. "repo:aur installed:no name:^lib32- vulkan".
+// Patterns are lowercase; ^ and $ anchor them to the start and end.
+struct SearchQuery {
+  std::vector<std::string> words; // match name, title or description
+  std::vector<std::string> namePatterns;
+  std::vector<std::string> descPatterns;
+  std::vector<std::string> repos;
+  std::vector<PackageSource> sources;
+  std::optional<bool> installed;
+};
+
+struct SearchHit {
+  uint32_t record;
+  double score;
+};
+
+// Incremental XML tokenizer: pending holds an unfinished tag or text run
+// carried over to the next chunk
+struct XmlParseState {
+  std::string pending;
+};
+
+struct XmlHandlers {
+  // Element name and its raw attribute text
+  std::function<void(std::string_view, std::string_view)> onStart;
+  std::function<void(std::string_view)> onEnd;
+  std::function<void(std::string_view)> onText; // raw, entities undecoded
+};
+
+struct AppstreamParseState {
+  XmlParseState xml;
+  int depth = 0;
+  std::string field; // component child whose text is being collected
+  std::string text;
+  SyncPackage current;
+  bool isApp = false;
+};
+
+struct ClosureEstimate {
+  std::vector<std::string> packages; // sync packages that will be installed
+  std::vector<std::string> unresolved; // not in any sync DB (AUR)
+  uintmax_t downloadBytes = 0;         // not already in the package cache
+  uintmax_t installBytes = 0;
+  double etaSeconds = 0.0;
+};
+
+struct GpuDevice {
+  std::string slot; // PCI address, e.g. 0000:01:00.0
+  unsigned vendorId = 0;
+  unsigned deviceId = 0;
+};
+
+struct MirrorProbe {
+  std::string server;
+  double latencySeconds = 0.0;
+  double bytesPerSecond = 0.0;
+  bool reachable = false;
+};
+
 struct MenuItem {
   std::string description;
   std::function<void()> action;
@@ -31,6 +337,45 @@ struct MenuItem {
 };
 
 // Constants
+constexpr const char *ZSHRC_CONFIG_URL =
+    "https://gist.githubusercontent.com/adityanav123/"
+    "00f0dd587acd1a664e0de5ccf295513e/raw";
+constexpr const char *WEZTERM_CONFIG_URL =
+    "https://gist.githubusercontent.com/adityanav123/"
+    "dd3031a3dd82b53d36dafdecc58f4257/raw/"
+    "921bbc3b4346f21123cd8a4e6f8657f3b6fbfb64/wezterm.lua";
+constexpr const char *KITTY_CONFIG_URL =
+    "https://gist.githubusercontent.com/adityanav123/"
+    "8afec13d17c5191bbbfc2f92e632d739/raw/"
+    "c271c161ec0d74506a36900b6f2501c578cd6e18/kitty.conf";
+constexpr const char *LVIM_CONFIG_URL =
+    "https://gist.githubusercontent.com/adityanav123/"
+    "2e708e777628d3914cf59e5d1f332f20/raw";
+#define LVIM_BRANCH "release-1.4/neovim-0.9"
+constexpr const char *LVIM_INSTALLER_URL =
+    "https://raw.githubusercontent.com/LunarVim/LunarVim/" LVIM_BRANCH
+    "/utils/installer/install.sh";
+constexpr const char *HOMEBREW_INSTALLER_URL =
+    "https://raw.githubusercontent.com/Homebrew/install/HEAD/install.sh";
+constexpr const char *RUSTUP_INSTALLER_URL = "https://sh.rustup.rs";
+constexpr const char *ZSH_AUTOSUGGESTIONS_REPO =
+    "https://github.com/zsh-users/zsh-autosuggestions";
+constexpr const char *CATPPUCCIN_STARSHIP_REPO =
+    "https://github.com/catppuccin/starship";
+constexpr const char *DOOMEMACS_REPO = "https://github.com/doomemacs/doomemacs";
+constexpr const char *DOOM_CONFIG_REPO =
+    "https://github.com/adityanav123/MyDoomEmacsSetup";
+
+// pacman locations and fallback rates for the dependency resolver
+const std::string PACMAN_DB_DIR = "/var/lib/pacman";
+const std::string PACMAN_SYNC_DIR = PACMAN_DB_DIR + "/sync";
+const std::string PACMAN_CACHE_DIR = "/var/cache/pacman/pkg";
+constexpr double DEFAULT_DOWNLOAD_RATE = 5.0 * 1024 * 1024; // bytes/s
+constexpr double DEFAULT_INSTALL_RATE = 50.0 * 1024 * 1024; // bytes/s
+constexpr char PACKAGE_INDEX_MAGIC[8] = {'A', 'S', 'P', 'K',
+                                         'G', 'I', 'D', 'X'};
+constexpr uint32_t PACKAGE_INDEX_VERSION = 1;
+
 constexpr const char *YELLOW_COLOR = "\033[38;5;220m";
 constexpr const char *GREEN_COLOR = "\033[38;5;118m";
 constexpr const char *BLUE_COLOR = "\033[38;5;39m";
@@ -76,20 +421,23 @@ void printPrompt(const std::string &message) {
 }
 constexpr const char *MENU_SEPARATOR = "---------------------------------";
 
-// Regex for pacman/yay/flatpak
-std::regex pacmanYayPattern(
-    R"((\S+)\/(\S+)\s+([\d\.]+-\d+)(\s*\[installed\])?\s*\n\s*(.*))");
-std::regex flatpakPattern(R"((\S+)\s+\(([^)]+)\)\s+(.*))");
-
 void displayBackOption() {
   std::cout << "\033[1;1H" << GRUVBOX_FG;
   std::cout << "Press [q] to go back";
   std::cout << RESET_COLOR;
 }
 
+void startPrefetch(const std::string &profileId);
+void cancelPrefetch();
+
 void colorizedMenuTemplate(
     const std::string &title,
-    const std::vector<std::pair<std::string, std::function<void()>>> &options) {
+    const std::vector<std::pair<std::string, std::function<void()>>> &options,
+    const std::string &prefetchProfile = "") {
+  if (!prefetchProfile.empty()) {
+    startPrefetch(prefetchProfile);
+  }
+
   while (true) {
     clearScreen();
     printHeader(title);
@@ -104,9 +452,9 @@ void colorizedMenuTemplate(
                 "), or [q] to go back");
 
     std::string choice;
-    std::getline(std::cin, choice);
-
-    if (choice == "q" || choice == "Q") {
+    // End of input (e.g. a closed pipe) counts as [q]
+    if (!std::getline(std::cin, choice) || choice == "q" || choice == "Q") {
+      cancelPrefetch();
       return;
     }
 
@@ -130,7 +478,12 @@ void colorizedMenuTemplate(
 
 void singleActionMenuTemplate(const std::string &title,
                               const std::string &actionDescription,
-                              std::function<void()> action) {
+                              std::function<void()> action,
+                              const std::string &prefetchProfile = "") {
+  if (!prefetchProfile.empty()) {
+    startPrefetch(prefetchProfile);
+  }
+
   clearScreen();
   std::cout << GRUVBOX_BG << GRUVBOX_FG;
   std::cout << MENU_COLOR << "=== " << title << " ===" << RESET_COLOR << "\n\n";
@@ -145,41 +498,278 @@ void singleActionMenuTemplate(const std::string &title,
             << "Press Enter to proceed or [q] to go back: " << RESET_COLOR;
 
   std::string choice;
-  std::getline(std::cin, choice);
-
-  if (choice != "q" && choice != "Q") {
-    clearScreen();
-    action();
-    std::cout << "\nPress Enter to continue...";
-    std::cin.get();
+  // End of input (e.g. a closed pipe) counts as [q]
+  if (!std::getline(std::cin, choice) || choice == "q" || choice == "Q") {
+    cancelPrefetch();
+    return;
   }
+
+  // The prefetch keeps running while the action prompts; repo installs
+  // wait for its package downloads, so they never race for the pacman lock
+  clearScreen();
+  action();
+  std::cout << "\nPress Enter to continue...";
+  std::cin.get();
+  cancelPrefetch();
 }
 
 // Function Prototypes
 std::vector<std::string> parse_string(const std::string &input, char delimiter);
-void parseYayResults(const std::string &result,
-                     std::vector<PackageStruct> &matchingPackages);
-void parsePacmanYayResults(const std::string &result,
-                           std::vector<PackageStruct> &matchingPackages,
-                           const std::string &source);
-
-std::string runFlatpakCommand(const std::string &packageName,
-                              const std::string &columns);
-
-void fetchFlatpakDetails(const std::string &packageName,
-                         std::vector<PackageStruct> &matchingPackages);
+bool streamCommandChunks(const std::string &command,
+                         const std::function<void(std::string_view)> &onChunk);
+bool streamCommandLines(const std::string &command,
+                        const std::function<void(std::string_view)> &onLine);
+void feedSearchLine(SearchParseState &state, std::string_view line,
+                    PackageSource source,
+                    const std::function<bool(std::string_view)> &repoFilter,
+                    const std::function<void(PackageStruct &&)> &onResult);
+void feedFlatpakLine(std::string_view line,
+                     const std::function<void(PackageStruct &&)> &onResult);
+void fetchFlatpakDetails(
+    const std::string &packageName,
+    const std::function<void(PackageStruct &&)> &onResult);
 void parseFlags(int argc, char *argv[]);
-void showProgressBar(int totalSteps);
-void runCommand(const std::string &command);
+bool loadAnswersFile(const std::string &path);
+std::optional<std::string> unattendedAnswer(const std::string &key,
+                                            const std::string &fallback);
+bool askYesNo(const std::string &key, bool defaultYes);
+int askChoice(const std::string &key, const std::vector<std::string> &names,
+              int defaultChoice);
+std::string jsonEscape(const std::string &text);
+int runHeadlessApply();
+std::vector<const ProvisioningProfile *>
+planProfiles(const std::vector<std::string> &profileIds);
+std::vector<std::string>
+mergedPackages(const std::vector<const ProvisioningProfile *> &profiles,
+               bool includeAlternatives = false);
+bool installMergedPackages(
+    const std::vector<const ProvisioningProfile *> &profiles);
+void runProvisioningPlan(const std::vector<std::string> &profileIds);
+void multiSelectProfilesMenu();
+bool installRepoTransaction(const std::vector<std::string> &packageNames,
+                            const std::string &extraFlags, double etaSeconds);
+bool applyRequestedProfiles(std::ostream &results, std::mutex &resultsMutex);
+std::string stepLogPath();
+void appendStepLog(StepLog &log, std::string_view bytes);
+std::string drainStepLog(StepLog &log, uint64_t &dropped);
+std::string stepLogTail(const StepLog &log, int lines);
+void rotateStepLogFile(const std::string &path);
+void runStepLogWriter();
+void stopStepLogWriter();
+std::shared_ptr<StepLog> beginStepLog(const std::string &stepId);
+void endStepLog(const std::shared_ptr<StepLog> &log);
+void printStepLogTail();
+bool runQuietCommand(const std::string &command,
+                     ProgressLane *lane = nullptr);
+int terminalWidth();
+void handleTerminalResize(int);
+std::string renderProgressLane(const ProgressLane &lane, int width,
+                               size_t frame);
+void runProgressRenderer();
+void stopProgressRenderer();
+std::shared_ptr<ProgressLane> beginProgressLane(const std::string &label,
+                                                double etaSeconds = 0.0);
+void endProgressLane(const std::shared_ptr<ProgressLane> &lane, bool success,
+                     const std::string &message);
+void printAboveProgress(std::ostream &stream, const std::string &text);
+void feedProgressLine(ProgressLane &lane, std::string_view line);
+void noteProvisioningFailure();
+int provisioningFailureCount();
+bool runCommand(const std::string &command);
 bool isCommandSuccessful(const std::string &command);
 bool isPackageInstalled(const std::string &packageName);
 bool installPackageWithProgress(const std::string &packageName,
                                 const std::string &extraFlags = "");
 bool installPackage(const std::string &packageName,
                     const std::string &extraFlags = "");
+bool installPackages(const std::vector<std::string> &packageNames,
+                     const std::string &extraFlags = "");
+bool installRoutedPackage(const std::string &packageName,
+                          const std::string &extraFlags);
+bool installRoutedPackages(const std::vector<std::string> &packageNames,
+                           const std::string &extraFlags);
+std::string captureCommandOutput(const std::string &command);
+bool isRankedMirrorlist(const std::string &path);
+std::string pristineMirrorlist(const std::string &path);
+std::vector<std::string> readMirrorCandidates(const std::string &path);
+std::string expandMirrorUrl(std::string server, const std::string &repo);
+MirrorProbe probeMirror(const std::string &server);
+std::vector<MirrorProbe> rankMirrors(const std::vector<std::string> &servers);
+int parallelDownloadsFor(double bytesPerSecond);
+bool writeSystemFile(const std::string &path, const std::string &contents);
+std::string withParallelDownloads(const std::string &pacmanConf, int count);
+bool optimizeMirrors();
+unsigned readHexFile(const fs::path &path);
+std::string hostIdentifier();
+std::vector<GpuDevice> detectGpus();
+std::vector<std::string> gpuDriverPackages(const std::vector<GpuDevice> &gpus);
+std::string gpuVendorName(unsigned vendorId);
+std::vector<std::string> gamingPackages();
+void feedSyncDescLine(std::string &key, const std::string &repo,
+                      std::string_view line, SyncDatabase &db);
+const SyncDatabase &syncDatabase();
+std::string_view xmlAttribute(std::string_view attributes,
+                              std::string_view name);
+std::string decodeXmlEntities(std::string_view text);
+void feedXmlChunk(XmlParseState &state, std::string_view chunk,
+                  const XmlHandlers &handlers);
+void feedAppstreamChunk(AppstreamParseState &state, const std::string &remote,
+                        std::string_view chunk, SyncDatabase &db);
+std::vector<std::pair<std::string, std::string>> appstreamFiles();
+const SyncDatabase &appstreamDatabase();
+bool searchAppstream(const std::string &query,
+                     const std::function<void(PackageStruct &&)> &onResult);
+std::string packageIndexPath();
+uint64_t packageIndexStamp();
+uint64_t indexChecksum(const char *data, size_t size);
+bool writePackageIndex(const std::string &path);
+std::unique_ptr<PackageIndex> openPackageIndex(const std::string &path,
+                                               uint64_t stamp);
+const PackageIndex *packageIndex();
+void intersectBitmap(Bitmap &into, const Bitmap &other);
+void uniteBitmap(Bitmap &into, const Bitmap &other);
+Bitmap fullBitmap(size_t bits);
+void buildFacetBitmaps(PackageIndex &index);
+std::string installedStateStamp();
+const Bitmap &installedBitmap(const PackageIndex &index);
+Bitmap termBitmap(const PackageIndex &index, const std::string &pattern);
+SearchQuery parseSearchQuery(const std::string &text);
+std::string searchQueryText(const SearchQuery &query);
+bool matchesPattern(std::string_view field, const std::string &pattern);
+std::optional<double> scoreSearchMatch(std::string_view name,
+                                       std::string_view title,
+                                       std::string_view description,
+                                       const SearchQuery &query);
+std::vector<SearchHit> searchPackageIndex(const PackageIndex &index,
+                                          const SearchQuery &query);
+PackageStruct indexedPackage(const PackageIndex &index, uint32_t record);
+std::unordered_set<std::string> installedProvisions();
+std::optional<size_t> findSyncProvider(const SyncDatabase &db,
+                                       const std::string &dependency);
+ClosureEstimate resolveClosure(const std::vector<std::string> &requested);
+ClosureEstimate resolveClosure(const std::vector<std::string> &requested,
+                               std::unordered_set<std::string> satisfied);
+double loadRate(const std::string &kind, double fallback);
+void recordRate(const std::string &kind, double bytesPerSecond);
+std::string formatBytes(uintmax_t bytes);
+std::string formatDuration(double seconds);
+bool preflightDiskSpace(const ClosureEstimate &estimate);
+const std::unordered_set<std::string> &aurPackageIndex();
+const std::unordered_map<std::string, std::string> &flatpakAppIndex();
+bool flatpakIdMatches(const std::string &appId, const std::string &name);
+std::string aurCacheRoot();
+bool aurCacheHas(const std::string &name);
+std::string providerName(PackageProvider provider);
+ProviderRoute routePackage(const std::string &requested,
+                           const std::unordered_set<std::string> &installed);
+std::vector<ProviderRoute>
+routePackages(const std::vector<std::string> &packageNames);
+void printRoutePlan(const std::vector<ProviderRoute> &routes);
+bool installFlatpakApps(const std::vector<ProviderRoute> &routes);
+bool installFlatpakRefs(
+    const std::map<std::string, std::vector<std::string>> &refsByRemote);
+std::unordered_set<std::string> installedFlatpakApps();
+bool installSearchResults(const std::vector<PackageStruct> &selected);
+const std::unordered_set<std::string> &syncPackageNames();
+std::string stripVersionConstraint(const std::string &dependency);
+void runConcurrently(size_t taskCount, int maxJobs,
+                     const std::function<void(size_t)> &task);
+bool prepareAurTarget(AurBuildTarget &target);
+std::vector<std::string>
+unsatisfiedDependencies(const std::string &pacman,
+                        const std::vector<std::string> &dependencies);
+const std::optional<std::string> &aurBuildUser();
+std::string asAurBuildUser(const std::string &command);
+bool buildAurTarget(AurBuildTarget &target);
+bool installAurPackages(const std::vector<std::string> &packageNames);
+uint64_t fnv1a64(const std::string &data,
+                 uint64_t hash = 14695981039346656037ULL);
+std::string toHex(uint64_t value);
+std::string readFileContents(const std::string &filePath);
+std::string homeDirectory();
+std::string targetUser();
+std::string chrootPath(const std::string &hostPath);
+std::string shellQuote(const std::string &text);
+std::string bundleConfigOption();
+std::string pacmanSyncDir();
+std::string hostPacmanCommand();
+std::string pacmanCommand();
+std::string targetCommand(const std::string &command, bool asRoot);
+bool targetHasCommand(const std::string &name);
+bool prepareTargetRoot();
+std::string scratchPath(const std::string &name);
+std::string aurBuildRoot();
+std::string loginShell(const std::string &user);
+std::optional<std::vector<std::string>>
+groupMembers(const std::string &groupName);
+std::string cacheDirectory();
+const std::string &toolchainVersion();
+bool restoreAurFromCache(AurBuildTarget &target);
+void storeAurInCache(const AurBuildTarget &target);
+void pruneAurCache();
+std::string stateDirectory();
+std::string joinStrings(const std::vector<std::string> &parts,
+                        const std::string &separator);
+void loadJournal();
+bool recordCompletedStep(const std::string &stepId,
+                         const std::string &fingerprint);
+bool runJournaledStep(const std::string &stepId, const std::string &inputs,
+                      const std::function<bool()> &step);
+const std::vector<ProvisioningProfile> &getProfiles();
+std::unordered_set<std::string> localPackageNames();
+void recordConfigHash(const std::string &configPath);
+const std::vector<StateProbe> &getStateProbes();
+bool probeConverged(const std::string &stepId);
+std::vector<ProbeResult> runStateProbes(const std::string &profileId = "");
+bool reportSystemState(const std::string &profileId = "");
+const ProvisioningProfile *findProfile(const std::string &id);
+int runCancellableCommand(const std::string &command, PrefetchState &state);
+std::string prefetchedConfigPath(const std::string &url);
+std::string gitMirrorPath(const std::string &url);
+std::string gitMirrorUpdateCommand(const std::string &url);
+bool updateGitMirror(const std::string &url);
+bool cloneRepository(const std::string &url, const std::string &destination,
+                     const GitCloneOptions &options = {});
+void waitForPrefetchedPackages();
+std::vector<std::string> cachedAurArtifacts(const std::string &name);
+std::vector<std::string> artifactField(const std::string &artifact,
+                                       const std::string &key);
+bool bundleAurPackages(const std::vector<std::string> &packageNames,
+                       const fs::path &repoDir,
+                       std::vector<std::string> &repoPackages);
+bool bundleRepoPackages(const std::vector<std::string> &packageNames,
+                        const fs::path &pkgDir);
+int runBundleCommand();
+bool activateBundle();
+void deactivateBundle();
+pid_t spawnShellCommand(const std::string &command);
+std::optional<int> pollChild(pid_t pid);
+void killChild(pid_t pid);
+int runWithDeadline(const std::string &command,
+                    std::chrono::milliseconds deadline);
+std::chrono::milliseconds backoffDelay(const FetchPolicy &policy,
+                                       int attempt);
+bool retryWithBackoff(const std::string &what, const FetchPolicy &policy,
+                      const std::function<bool()> &attempt);
+std::string urlHost(const std::string &url);
+std::map<std::string, std::vector<double>> loadFetchLatencies();
+std::chrono::milliseconds hedgeDelay(const std::string &host);
+void recordFetchLatency(const std::string &host, double milliseconds);
+std::vector<std::string> alternateUrls(const std::string &url);
+std::string curlFetchCommand(const std::string &url,
+                             const std::string &outputPath,
+                             const FetchPolicy &policy);
+bool fetchUrl(const std::vector<std::string> &urls,
+              const std::string &outputPath, const FetchPolicy &policy);
+bool runFetchCommand(const std::string &what, const std::string &command,
+                     const FetchPolicy &policy,
+                     const std::function<void()> &cleanup = nullptr);
+bool runDownloadedInstaller(const std::string &url, const std::string &name,
+                            const std::string &interpreter,
+                            const std::string &arguments);
 bool downloadFile(const std::string &url, const std::string &outputFilePath);
 bool isFileValid(const std::string &filePath);
-void applyConfig(const std::string &gistUrl, const std::string &configPath);
+bool applyConfig(const std::string &gistUrl, const std::string &configPath);
 void setupFlatpak();
 void setZshAsDefaultShell();
 void installTerminal(const std::string &terminalName,
@@ -197,12 +787,18 @@ void setupDoomEmacs();
 void ensureYayInstalled();
 void ensureFlatpakInstalled();
 
-std::vector<PackageStruct> searchForPackages(const std::string &packageName);
+const char *packageSourceName(PackageSource source);
+int runSearchCommand();
+std::vector<PackageStruct> searchForPackages(
+    const std::string &packageName,
+    const std::function<void(const PackageStruct &)> &onResult = nullptr);
 void displayMatchingPackages(
     const std::vector<std::tuple<std::string, std::string, std::string,
                                  std::string, bool>> &matchingPackages);
 void downloadPackage();
 void askForSudoPassword();
+void keepSudoAlive();
+void ensureSudoFor(const std::string &command);
 void printSeparator();
 std::vector<std::string> getSimpleMenuDescriptions();
 std::vector<std::string> getDetailedMenuDescriptions();
@@ -0,0 +1,89 @@
+// Appstream parsing: tests/fixtures/appstream.xml fed whole and in chunks
+// of every awkward size must give the same apps, and the gzip files
+// flatpak keeps per remote must be found and read.
+#include "test-support.hpp"
+
+std::vector<SyncPackage> parseInChunks(const std::string &xml,
+                                       size_t chunkSize) {
+  AppstreamParseState state;
+  SyncDatabase db;
+  for (size_t pos = 0; pos < xml.size(); pos += chunkSize) {
+    feedAppstreamChunk(state, "flathub",
+                       std::string_view(xml).substr(pos, chunkSize), db);
+  }
+  return db.packages;
+}
+
+void checkFixtureApps(const std::vector<SyncPackage> &apps) {
+  CHECK(apps.size() == 2);
+  if (apps.size() != 2) {
+    return;
+  }
+  CHECK(apps[0].name == "org.example.Editor");
+  CHECK(apps[0].title == "Example Editor");
+  CHECK(apps[0].description == "Edit text & code, fast");
+  CHECK(apps[0].version == "2.4.1");
+  CHECK(apps[0].repo == "flathub");
+
+  CHECK(apps[1].name == "com.example.Player");
+  CHECK(apps[1].title == "Player <Deluxe>");
+  CHECK(apps[1].description == "Plays \"music\" <loudly>");
+  CHECK(apps[1].version == "1.0");
+}
+
+bool sameApps(const std::vector<SyncPackage> &a,
+              const std::vector<SyncPackage> &b) {
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                    [](const SyncPackage &x, const SyncPackage &y) {
+                      return x.name == y.name && x.title == y.title &&
+                             x.description == y.description &&
+                             x.version == y.version && x.repo == y.repo;
+                    });
+}
+
+void testChunkedFeed() {
+  std::string xml = readFileContents(FIXTURES_DIR + "/appstream.xml");
+  CHECK(!xml.empty());
+  auto whole = parseInChunks(xml, xml.size());
+  checkFixtureApps(whole);
+  // Chunk boundaries land inside tags, entities, CDATA and comments
+  for (size_t chunkSize : {1, 2, 3, 7, 64, 4096}) {
+    CHECK(sameApps(parseInChunks(xml, chunkSize), whole));
+  }
+}
+
+// appstreamDatabase reads <root>/var/lib/flatpak/appstream/<remote>/<arch>/
+// active/appstream.xml.gz, or appstream.xml when there is no .gz
+void testAppstreamFiles() {
+  TempDir root;
+  utsname machine{};
+  uname(&machine);
+  std::string active = root / ("var/lib/flatpak/appstream/flathub/" +
+                               std::string(machine.machine) + "/active");
+  fs::create_directories(active);
+  CHECK(std::system(("gzip -c " + FIXTURES_DIR + "/appstream.xml > " +
+                     active + "/appstream.xml.gz")
+                        .c_str()) == 0);
+
+  targetRoot = root.path.string();
+  auto files = appstreamFiles();
+  CHECK(files.size() == 1);
+  const SyncDatabase &db = appstreamDatabase();
+  checkFixtureApps(db.packages);
+  CHECK(db.byName.count("com.example.Player") == 1);
+
+  std::vector<std::string> found;
+  CHECK(searchAppstream("deluxe", [&](PackageStruct &&result) {
+    found.push_back(result.ref);
+  }));
+  CHECK(found == std::vector<std::string>{"com.example.Player"});
+  targetRoot.clear();
+}
+
+int main() {
+  TempDir home;
+  isolateHome(home);
+  testChunkedFeed();
+  testAppstreamFiles();
+  return testResult("appstream");
+}
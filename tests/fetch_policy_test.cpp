@@ -0,0 +1,127 @@
+// Fetch policy against local HTTP servers that stall, answer late or hang
+// up: stalls and deadlines end an attempt, failed attempts are retried,
+// a primary that has not answered by its hedge delay is raced by the
+// alternate, and a primary that is already streaming is left alone.
+#include "test-support.hpp"
+
+// Short policy so a misbehaving server costs seconds, not minutes
+FetchPolicy testPolicy(int attempts, bool hedge) {
+  return {attempts,
+          std::chrono::milliseconds(10),
+          std::chrono::milliseconds(20),
+          std::chrono::seconds(10),
+          std::chrono::seconds(1),
+          hedge};
+}
+
+// Times to first byte for the host of url, enough for hedgeDelay to use
+void seedLatencies(const std::string &url, const std::string &milliseconds) {
+  std::ofstream(stateDirectory() + "/fetch-ttfb", std::ios::app)
+      << urlHost(url) << " " << milliseconds << " " << milliseconds << " "
+      << milliseconds << " " << milliseconds << " " << milliseconds << "\n";
+}
+
+bool noPartFiles(const TempDir &dir) {
+  for (const auto &entry : fs::directory_iterator(dir.path)) {
+    if (entry.path().string().find(".part") != std::string::npos) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void testStallEndsAttempt(const TempDir &dir, const std::string &body) {
+  TestHttpServer stalling(body, {std::chrono::milliseconds(0), 0, 1000});
+  auto start = std::chrono::steady_clock::now();
+  CHECK(!fetchUrl({stalling.url()}, dir / "stalled", testPolicy(1, false)));
+  CHECK(secondsSince(start) < 5);
+  CHECK(!fs::exists(dir / "stalled"));
+  CHECK(noPartFiles(dir));
+}
+
+void testDeadlineEndsAttempt(const TempDir &dir, const std::string &body) {
+  TestHttpServer silent(body, {std::chrono::seconds(30)});
+  FetchPolicy policy = testPolicy(1, false);
+  policy.deadline = std::chrono::seconds(1);
+  policy.stallTime = std::chrono::seconds(30);
+  auto start = std::chrono::steady_clock::now();
+  CHECK(!fetchUrl({silent.url()}, dir / "late", policy));
+  CHECK(secondsSince(start) < 3);
+  CHECK(noPartFiles(dir));
+}
+
+void testRetriesAndFailover(const TempDir &dir, const std::string &body) {
+  TestHttpServer dropping(body, {std::chrono::milliseconds(0), 0, SIZE_MAX,
+                                 true});
+  CHECK(!fetchUrl({dropping.url()}, dir / "dropped", testPolicy(3, false)));
+  CHECK(dropping.requests() == 3);
+
+  // A failed primary moves on to the alternate without waiting to hedge
+  TestHttpServer fast(body);
+  auto start = std::chrono::steady_clock::now();
+  CHECK(fetchUrl({dropping.url(), fast.url()}, dir / "failover",
+                 testPolicy(1, false)));
+  CHECK(secondsSince(start) < 2);
+  CHECK(readFileContents(dir / "failover") == body);
+}
+
+void testLatePrimaryIsHedged(const TempDir &dir, const std::string &body) {
+  TestHttpServer late(body, {std::chrono::seconds(5)});
+  TestHttpServer fast(body);
+  seedLatencies(late.url(), "100");
+  CHECK(hedgeDelay(urlHost(late.url())) == MIN_HEDGE_DELAY);
+
+  auto start = std::chrono::steady_clock::now();
+  CHECK(fetchUrl({late.url(), fast.url()}, dir / "hedged",
+                 testPolicy(1, true)));
+  CHECK(secondsSince(start) < 2);
+  CHECK(fast.requests() == 1);
+  CHECK(readFileContents(dir / "hedged") == body);
+  CHECK(noPartFiles(dir));
+}
+
+// Time to first byte is what gets hedged; a slow transfer that has started
+// is never raced, however long the whole download takes
+void testStreamingPrimaryIsNotHedged(const TempDir &dir,
+                                     const std::string &body) {
+  TestHttpServer streaming(body, {std::chrono::milliseconds(0), 100 * 1024});
+  TestHttpServer fast(body);
+  seedLatencies(streaming.url(), "50");
+  CHECK(fetchUrl({streaming.url(), fast.url()}, dir / "streamed",
+                 testPolicy(1, true)));
+  CHECK(fast.requests() == 0);
+  CHECK(readFileContents(dir / "streamed") == body);
+  CHECK(loadFetchLatencies()[urlHost(streaming.url())].size() == 6);
+}
+
+void testDeadlineAndBackoff() {
+  CHECK(hedgeDelay("unknown.example") == DEFAULT_HEDGE_DELAY);
+
+  auto start = std::chrono::steady_clock::now();
+  CHECK(runWithDeadline("sleep 5", std::chrono::milliseconds(200)) == 124);
+  CHECK(secondsSince(start) < 2);
+  CHECK(runWithDeadline("exit 3", std::chrono::seconds(5)) == 3);
+
+  FetchPolicy policy;
+  for (int attempt = 0; attempt < 8; ++attempt) {
+    auto ceiling = std::min(policy.maxDelay, policy.baseDelay * (1 << attempt));
+    for (int draw = 0; draw < 50; ++draw) {
+      auto delay = backoffDelay(policy, attempt);
+      CHECK(delay.count() >= 0 && delay <= ceiling);
+    }
+  }
+}
+
+int main() {
+  TempDir home, dir;
+  isolateHome(home);
+  fs::create_directories(stateDirectory());
+  std::string body(64 * 1024, 'x');
+  testStallEndsAttempt(dir, body);
+  testDeadlineEndsAttempt(dir, body);
+  testRetriesAndFailover(dir, body);
+  testLatePrimaryIsHedged(dir, body);
+  testStreamingPrimaryIsNotHedged(dir, body);
+  testDeadlineAndBackoff();
+  return testResult("fetch policy");
+}
@@ -0,0 +1,87 @@
+// Git fetch layer against local bare repositories: concurrent clones share
+// one mirror, the mirror follows upstream, sparse clones only check out
+// their paths, and a broken mirror is cloned again.
+#include "test-support.hpp"
+
+bool git(const std::string &arguments) {
+  return std::system(("git -c user.name=test -c user.email=test@example.com " +
+                      arguments + " > /dev/null 2>&1")
+                         .c_str()) == 0;
+}
+
+// Upstream bare repository with one commit of the given files
+std::string makeUpstream(const TempDir &dir,
+                         const std::vector<std::string> &files) {
+  std::string work = dir / "work";
+  std::string upstream = dir / "upstream.git";
+  git("init -q " + work);
+  for (const auto &file : files) {
+    writeTestFile(work + "/" + file, file + "\n");
+  }
+  git("-C " + work + " add -A");
+  git("-C " + work + " commit -q -m initial");
+  git("clone -q --bare " + work + " " + upstream);
+  return upstream;
+}
+
+void testConcurrentClones(const TempDir &dir, const std::string &upstream) {
+  constexpr size_t CLONES = 8;
+  std::vector<char> cloned(CLONES, 0);
+  runConcurrently(CLONES, CLONES, [&](size_t i) {
+    cloned[i] = cloneRepository(upstream, dir / ("clone" + std::to_string(i)),
+                                {});
+  });
+  for (size_t i = 0; i < CLONES; ++i) {
+    std::string clone = dir / ("clone" + std::to_string(i));
+    CHECK(cloned[i]);
+    CHECK(fs::exists(clone + "/README"));
+    CHECK(captureCommandOutput("git -C " + clone +
+                               " remote get-url origin") == upstream + "\n");
+  }
+  CHECK(fs::exists(gitMirrorPath(upstream) + "/HEAD"));
+}
+
+void testMirrorFollowsUpstream(const TempDir &dir,
+                               const std::string &upstream) {
+  std::string work = dir / "work";
+  writeTestFile(work + "/NEWS", "news\n");
+  git("-C " + work + " add NEWS");
+  git("-C " + work + " commit -q -m news");
+  git("-C " + work + " push -q " + upstream + " HEAD");
+
+  CHECK(cloneRepository(upstream, dir / "after-push", {}));
+  CHECK(fs::exists(dir / "after-push/NEWS"));
+}
+
+void testShallowSparseClone(const TempDir &dir, const std::string &upstream) {
+  std::string clone = dir / "sparse";
+  CHECK(cloneRepository(upstream, clone, {true, {"docs/guide.md"}}));
+  CHECK(fs::exists(clone + "/docs/guide.md"));
+  CHECK(!fs::exists(clone + "/README"));
+  CHECK(captureCommandOutput("git -C " + clone + " rev-list --count HEAD") ==
+        "1\n");
+}
+
+// A clone killed halfway leaves a mirror without HEAD; the next update
+// starts it over instead of fetching into it
+void testBrokenMirrorIsRecloned(const TempDir &dir,
+                                const std::string &upstream) {
+  std::string mirror = gitMirrorPath(upstream);
+  fs::remove_all(mirror);
+  writeTestFile(mirror + "/objects/garbage", "partial clone\n");
+  CHECK(updateGitMirror(upstream));
+  CHECK(fs::exists(mirror + "/HEAD"));
+  CHECK(!fs::exists(mirror + "/objects/garbage"));
+  CHECK(cloneRepository(upstream, dir / "after-repair", {}));
+}
+
+int main() {
+  TempDir home, dir;
+  isolateHome(home);
+  std::string upstream = makeUpstream(dir, {"README", "docs/guide.md"});
+  testConcurrentClones(dir, upstream);
+  testMirrorFollowsUpstream(dir, upstream);
+  testShallowSparseClone(dir, upstream);
+  testBrokenMirrorIsRecloned(dir, upstream);
+  return testResult("git mirror");
+}
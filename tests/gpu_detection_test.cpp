@@ -0,0 +1,66 @@
+// GPU detection against the fake sysfs tree in tests/fixtures/sysfs (an
+// Intel iGPU, an Ethernet controller and an NVIDIA Ada card), and the
+// driver packages picked for each vendor and generation.
+#include "test-support.hpp"
+
+std::vector<std::string> driversFor(unsigned vendorId, unsigned deviceId) {
+  return gpuDriverPackages({{"0000:01:00.0", vendorId, deviceId}});
+}
+
+bool contains(const std::vector<std::string> &packages,
+              const std::string &name) {
+  return std::find(packages.begin(), packages.end(), name) != packages.end();
+}
+
+// The host's /sys says nothing about a --root target
+void testTargetRootWithoutSysfs() {
+  targetRoots = {"/mnt"};
+  sysfsRoot.clear();
+  CHECK(detectGpus().empty());
+  CHECK(!contains(gamingPackages(), "nvidia-utils"));
+  targetRoots.clear();
+}
+
+void testFixtureTree() {
+  sysfsRoot = FIXTURES_DIR + "/sysfs";
+  auto gpus = detectGpus();
+  CHECK(gpus.size() == 2);
+  if (gpus.size() == 2) {
+    CHECK(gpus[0].slot == "0000:00:02.0");
+    CHECK(gpus[0].vendorId == PCI_VENDOR_INTEL);
+    CHECK(gpus[1].slot == "0000:01:00.0");
+    CHECK(gpus[1].vendorId == PCI_VENDOR_NVIDIA);
+    CHECK(gpus[1].deviceId == 0x2684);
+  }
+  CHECK(fs::exists(cacheDirectory() + "/hardware/" +
+                   toHex(fnv1a64(hostIdentifier() + sysfsRoot))));
+
+  auto packages = gamingPackages();
+  CHECK(contains(packages, "nvidia-open"));
+  CHECK(contains(packages, "vulkan-intel"));
+  CHECK(!contains(packages, "vulkan-radeon"));
+}
+
+void testDriverChoice() {
+  CHECK(contains(driversFor(PCI_VENDOR_NVIDIA, 0x1e04), "nvidia-open"));
+  CHECK(contains(driversFor(PCI_VENDOR_NVIDIA, 0x1b80), "nvidia"));
+  CHECK(!contains(driversFor(PCI_VENDOR_NVIDIA, 0x1b80), "nvidia-open"));
+  // Kepler and older are left to nouveau
+  CHECK(driversFor(PCI_VENDOR_NVIDIA, 0x0fc0).empty());
+  // Ivy Bridge and GMA X4500 need the legacy VA-API driver, Tiger Lake not
+  CHECK(contains(driversFor(PCI_VENDOR_INTEL, 0x0166), "libva-intel-driver"));
+  CHECK(contains(driversFor(PCI_VENDOR_INTEL, 0x2e22), "libva-intel-driver"));
+  CHECK(!contains(driversFor(PCI_VENDOR_INTEL, 0x9a49), "libva-intel-driver"));
+  CHECK(contains(driversFor(PCI_VENDOR_INTEL, 0x0166), "intel-media-driver"));
+  CHECK(contains(driversFor(PCI_VENDOR_AMD, 0x73bf), "vulkan-radeon"));
+  CHECK(driversFor(0x1af4, 0x1050).empty());
+}
+
+int main() {
+  TempDir home;
+  isolateHome(home);
+  testTargetRootWithoutSysfs();
+  testFixtureTree();
+  testDriverChoice();
+  return testResult("gpu detection");
+}
@@ -0,0 +1,80 @@
+// Mirror ranking against local HTTP servers throttled to different speeds:
+// the ranking follows the measured throughput, unreachable mirrors are
+// dropped, the original mirrorlist is backed up and probed again later,
+// and ParallelDownloads is set without disturbing pacman.conf.
+#include "test-support.hpp"
+
+std::string serverLine(const TestHttpServer &server) {
+  return server.url("/$repo/os/$arch");
+}
+
+void testRanking(const std::vector<std::string> &fastestFirst,
+                 const std::string &unreachable) {
+  std::vector<std::string> servers = {fastestFirst[2], unreachable,
+                                      fastestFirst[0], fastestFirst[1]};
+  auto probes = rankMirrors(servers);
+  CHECK(probes.size() == 3);
+  for (size_t i = 0; i < probes.size() && i < fastestFirst.size(); ++i) {
+    CHECK(probes[i].server == fastestFirst[i]);
+  }
+}
+
+void testParallelDownloadsLine() {
+  CHECK(withParallelDownloads("[options]\n\n#ParallelDownloads = 5\n", 3) ==
+        "[options]\n\nParallelDownloads = 3\n");
+  CHECK(withParallelDownloads("[options]\nParallelDownloads = 5\n", 8) ==
+        "[options]\nParallelDownloads = 8\n");
+  CHECK(withParallelDownloads("[options]\nHoldPkg = pacman\n", 2) ==
+        "[options]\nParallelDownloads = 2\nHoldPkg = pacman\n");
+  CHECK(withParallelDownloads("[core]\n", 2) ==
+        "[options]\nParallelDownloads = 2\n[core]\n");
+}
+
+void testOptimizeMirrors(const TempDir &dir,
+                         const std::vector<std::string> &fastestFirst,
+                         const std::string &unreachable) {
+  std::string original;
+  for (const auto &server : {unreachable, fastestFirst[2], fastestFirst[0],
+                             fastestFirst[1]}) {
+    original += "#Server = " + server + "\n";
+  }
+  std::string mirrorlist = dir / "mirrorlist";
+  writeTestFile(mirrorlist, original);
+  writeTestFile(dir / "pacman.conf",
+                "[options]\n\n#ParallelDownloads = 5\n[core]\n");
+  mirrorCandidatesPath = mirrorlistOutputPath = mirrorlist;
+  pacmanConfPath = dir / "pacman.conf";
+
+  CHECK(optimizeMirrors());
+  CHECK(readFileContents(mirrorlist + ".arch-setup.bak") == original);
+  CHECK(isRankedMirrorlist(mirrorlist));
+  CHECK(readMirrorCandidates(mirrorlist) == fastestFirst);
+  std::string pacmanConf = readFileContents(pacmanConfPath);
+  CHECK(pacmanConf.rfind("[options]\n\nParallelDownloads = ", 0) == 0);
+
+  // Later runs probe every original candidate, not the ranked subset
+  CHECK(pristineMirrorlist(mirrorlist) == mirrorlist + ".arch-setup.bak");
+  CHECK(readMirrorCandidates(pristineMirrorlist(mirrorlist)).size() == 4);
+  fs::remove(mirrorlist + ".arch-setup.bak");
+  writeTestFile(mirrorlist + ".pacnew", original);
+  CHECK(pristineMirrorlist(mirrorlist) == mirrorlist + ".pacnew");
+}
+
+int main() {
+  TempDir home, dir;
+  isolateHome(home);
+  std::string body(120 * 1024, 'x');
+  TestHttpServer fast(body);
+  TestHttpServer medium(body, {std::chrono::milliseconds(0), 400 * 1024});
+  TestHttpServer slow(body, {std::chrono::milliseconds(0), 60 * 1024});
+  TestHttpServer dropping(body, {std::chrono::milliseconds(0), 0, SIZE_MAX,
+                                 true});
+  std::vector<std::string> fastestFirst = {serverLine(fast),
+                                           serverLine(medium),
+                                           serverLine(slow)};
+
+  testRanking(fastestFirst, serverLine(dropping));
+  testParallelDownloadsLine();
+  testOptimizeMirrors(dir, fastestFirst, serverLine(dropping));
+  return testResult("mirror ranking");
+}
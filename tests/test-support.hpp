@@ -0,0 +1,211 @@
+// Shared helpers for the tests in this directory. Every test is a single
+// program that includes setup-linux.cpp with its main renamed, so it can
+// call any function and set any flag variable directly. Tests run from the
+// repository root (make test) and never touch the real home directory.
+#pragma once
+
+#define main arch_setup_main
+#include "../setup-linux.cpp"
+#undef main
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+const std::string FIXTURES_DIR = "tests/fixtures";
+
+int testFailures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition        \
+                << ") failed\n";                                               \
+      ++testFailures;                                                          \
+    }                                                                          \
+  } while (0)
+
+// Exit status for main: 0 when every CHECK held
+int testResult(const std::string &name) {
+  std::cout << name << ": " << (testFailures ? "FAILED" : "ok") << " ("
+            << testFailures << " failed checks)\n";
+  return testFailures ? 1 : 0;
+}
+
+// Scratch directory removed with everything in it at the end of the scope
+struct TempDir {
+  fs::path path;
+
+  TempDir() {
+    std::string pattern = "/tmp/arch-setup-test-XXXXXX";
+    if (mkdtemp(pattern.data()) == nullptr) {
+      std::perror("mkdtemp");
+      std::exit(2);
+    }
+    path = pattern;
+  }
+  ~TempDir() {
+    std::error_code ec;
+    fs::remove_all(path, ec);
+  }
+  TempDir(const TempDir &) = delete;
+  TempDir &operator=(const TempDir &) = delete;
+
+  std::string operator/(const std::string &name) const {
+    return (path / name).string();
+  }
+};
+
+// Point HOME and the XDG directories at home, so caches, state and logs
+// written by the code under test stay out of the real home directory
+void isolateHome(const TempDir &home) {
+  setenv("HOME", home.path.c_str(), 1);
+  setenv("XDG_CACHE_HOME", (home / "cache").c_str(), 1);
+  setenv("XDG_STATE_HOME", (home / "state").c_str(), 1);
+}
+
+void writeTestFile(const std::string &path, const std::string &contents) {
+  fs::create_directories(fs::path(path).parent_path());
+  std::ofstream(path, std::ios::trunc) << contents;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// How a TestHttpServer misbehaves
+struct HttpBehaviour {
+  std::chrono::milliseconds firstByteDelay{0}; // before the status line
+  size_t bytesPerSecond = 0;                   // 0 sends at full speed
+  size_t stallAfter = SIZE_MAX; // body bytes sent before going silent
+  bool dropConnection = false;  // close without answering
+};
+
+// HTTP server on 127.0.0.1 answering every GET with the same body. Each
+// connection is served on its own thread; the destructor wakes and joins
+// them, including connections that are stalling on purpose.
+class TestHttpServer {
+public:
+  TestHttpServer(std::string body, HttpBehaviour behaviour = {})
+      : body_(std::move(body)), behaviour_(behaviour) {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(listener_, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+        listen(listener_, 64) != 0 ||
+        getsockname(listener_, reinterpret_cast<sockaddr *>(&address),
+                    &length) != 0) {
+      std::perror("test server");
+      std::exit(2);
+    }
+    port_ = ntohs(address.sin_port);
+    acceptor_ = std::thread([this] { acceptLoop(); });
+  }
+
+  ~TestHttpServer() {
+    stopping_ = true;
+    acceptor_.join();
+    for (auto &connection : connections_) {
+      connection.join();
+    }
+    close(listener_);
+  }
+
+  TestHttpServer(const TestHttpServer &) = delete;
+  TestHttpServer &operator=(const TestHttpServer &) = delete;
+
+  std::string url(const std::string &path = "/file") const {
+    return "http://127.0.0.1:" + std::to_string(port_) + path;
+  }
+  int requests() const { return requests_; }
+
+private:
+  void acceptLoop() {
+    while (!stopping_) {
+      pollfd ready{listener_, POLLIN, 0};
+      if (poll(&ready, 1, 20) <= 0) {
+        continue;
+      }
+      int client = accept(listener_, nullptr, nullptr);
+      if (client >= 0) {
+        connections_.emplace_back([this, client] { serve(client); });
+      }
+    }
+  }
+
+  // Sleep in small steps so the destructor never waits for a full delay
+  bool pause(std::chrono::milliseconds duration) {
+    auto until = std::chrono::steady_clock::now() + duration;
+    while (!stopping_ && std::chrono::steady_clock::now() < until) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return !stopping_;
+  }
+
+  bool sendAll(int client, std::string_view data) {
+    while (!data.empty()) {
+      ssize_t sent = send(client, data.data(), data.size(), MSG_NOSIGNAL);
+      if (sent <= 0) {
+        return false;
+      }
+      data.remove_prefix(static_cast<size_t>(sent));
+    }
+    return true;
+  }
+
+  void serve(int client) {
+    std::string request;
+    std::array<char, 4096> buffer{};
+    while (request.find("\r\n\r\n") == std::string::npos && !stopping_) {
+      pollfd ready{client, POLLIN, 0};
+      if (poll(&ready, 1, 20) <= 0) {
+        continue;
+      }
+      ssize_t count = recv(client, buffer.data(), buffer.size(), 0);
+      if (count <= 0) {
+        break;
+      }
+      request.append(buffer.data(), static_cast<size_t>(count));
+    }
+    ++requests_;
+
+    if (!behaviour_.dropConnection && pause(behaviour_.firstByteDelay)) {
+      std::string header = "HTTP/1.1 200 OK\r\nContent-Length: " +
+                           std::to_string(body_.size()) +
+                           "\r\nConnection: close\r\n\r\n";
+      // Throttled bodies go out in 50 ms slices
+      size_t slice = behaviour_.bytesPerSecond
+                         ? std::max<size_t>(1, behaviour_.bytesPerSecond / 20)
+                         : body_.size();
+      size_t limit = std::min(body_.size(), behaviour_.stallAfter);
+      bool open = sendAll(client, header);
+      for (size_t sent = 0; open && sent < limit; sent += slice) {
+        open = sendAll(client, std::string_view(body_).substr(
+                                   sent, std::min(slice, limit - sent))) &&
+               (!behaviour_.bytesPerSecond ||
+                pause(std::chrono::milliseconds(50)));
+      }
+      if (limit < body_.size()) {
+        while (pause(std::chrono::milliseconds(50))) {
+        }
+      }
+    }
+    close(client);
+  }
+
+  std::string body_;
+  HttpBehaviour behaviour_;
+  int listener_ = -1;
+  int port_ = 0;
+  std::atomic<bool> stopping_{false};
+  std::atomic<int> requests_{0};
+  std::thread acceptor_;
+  std::vector<std::thread> connections_; // only touched by the acceptor
+};